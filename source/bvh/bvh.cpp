@@ -1,475 +1,3158 @@
 #include "bvh.hpp"
 
+#include <array>
 #include <queue>
 #include <chrono>
+#include <random>
+#include <numeric>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <unordered_map>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#include <glm/glm.hpp>
+#include <glm/gtx/component_wise.hpp>
 
-#include "../octree/octree.cpp"
 #include "../common/format.hpp"
+#include "../common/morton.hpp"
+#include "../common/binary-file.hpp"
+#include "../common/parallel.hpp"
+#include "../common/perf-counter.hpp"
+#include "../common/constants.hpp"
 #include "../surface/surface.hpp"
+#include "../scene/scene.hpp"
 #include "../common/util.hpp"
 
 BVH::BVH(const BoundingBox &BB, 
          const std::vector<std::shared_ptr<Surface::Base>> &surfaces, 
-         const nlohmann::json &j)
+         const nlohmann::json &j,
+         bool animated) : BVH(surfaces, j, false, animated) { }
+
+/**************************************************************************
+Builds a BVH over the triangles, or over the instances if instance_leaves
+is set. Instances are stored in a separate top-level BVH when triangles are
+stored in the tree, and other surfaces are intersected linearly. The build
+tree is retained if the BVH is animated, so that it can be updated.
+**************************************************************************/
+BVH::BVH(const std::vector<std::shared_ptr<Surface::Base>> &surfaces, 
+         const nlohmann::json &j, 
+         bool instance_leaves,
+         bool animated) : instance_leaves(instance_leaves)
 {
     df_idx = 0;
 
-    std::shared_ptr<BuildNode> root = std::make_shared<BuildNode>();
-    root->BB = BB;
+    std::vector<std::shared_ptr<Surface::Base>> tree_surfaces, instances;
+    BoundingBox tree_BB;
+    for (const auto &surface : surfaces)
+    {
+        if (instance_leaves || std::dynamic_pointer_cast<Surface::Triangle>(surface))
+        {
+            tree_surfaces.push_back(surface);
+            tree_BB.merge(surface->BB());
+        }
+        else if (std::dynamic_pointer_cast<Surface::Instance>(surface))
+        {
+            instances.push_back(surface);
+        }
+        else
+        {
+            other_surfaces.push_back(surface);
+        }
+    }
+
+    if (!instances.empty())
+    {
+        std::cout << "\nBuilding top-level BVH over " << Format::largeNumber(instances.size()) << " instances.\n";
+        instance_bvh = std::shared_ptr<BVH>(new BVH(instances, nestedSettings(j), true, animated));
+    }
 
     auto begin = std::chrono::high_resolution_clock::now();
 
+    size_t benchmark_rays = getOptional(j, "benchmark_rays", 0);
+
+    // The cache is not used when benchmarking, since the linear tree of a wide BVH is not cached,
+    // or when animating, since the build tree is not cached
+    std::string cache = animated ? "" : getOptional<std::string>(j, "cache", "");
+    std::filesystem::path cache_path = Scene::path / cache;
+    uint64_t hash = 0;
+    bool cached = false;
+    size_t stack_size = 0;
+    if (!cache.empty())
+    {
+        hash = cacheHash(tree_surfaces, j);
+        cached = !benchmark_rays && readCache(cache_path, hash, tree_surfaces, stack_size);
+    }
+
+    size_t num_blocks = 0, num_bytes = 0;
+    if (cached)
+    {
+        std::cout << "\nLoaded BVH from " << cache_path.string() << ".\n\n";
+        num_bytes = memoryUsage();
+    }
+    else
+    {
+        build_surfaces = tree_surfaces;
+        build_indices.resize(tree_surfaces.size());
+        std::iota(build_indices.begin(), build_indices.end(), 0);
+
+        BuildNode *root = buildTree(0, build_indices.size(), tree_BB, j, true);
+
+        if (animated)
+        {
+            refit(root);
+            setBuildCosts(root);
+            build_root = root;
+            build_settings = j;
+            rebuild_threshold = getOptional(j, "rebuild_threshold", 1.5);
+        }
+
+        requested_width = getOptional(j, "width", 8);
+        quantized = getOptional(j, "quantized", false);
+
+        std::string node_order = getOptional<std::string>(j, "layout", "DEPTH_FIRST");
+        std::transform(node_order.begin(), node_order.end(), node_order.begin(), toupper);
+        node_layout = node_order == "VAN_EMDE_BOAS" ? VAN_EMDE_BOAS : (node_order == "TREELET" ? TREELET : DEPTH_FIRST);
+        stack_size = layout(root, requested_width);
+        num_bytes = memoryUsage();
+
+        // The linear tree is also built temporarily when benchmarking a wide tree
+        num_blocks = triangle_blocks.size();
+        if (width && benchmark_rays)
+        {
+            linear_tree = std::vector<LinearNode>(df_idx, LinearNode());
+            compact(root);
+        }
+
+        if (!animated)
+        {
+            clearBuildData();
+        }
+    }
+
+    size_t num_nodes = 1;
+    double num_branchings = 0.0;
+    for (const auto &b : branching)
+    {
+        num_branchings += b.second;
+        num_nodes += b.first * b.second;
+    }
+
+    std::string traversal = getOptional<std::string>(j, "traversal", "PRIORITY_QUEUE");
+    std::transform(traversal.begin(), traversal.end(), traversal.begin(), toupper);
+    requested_stack_traversal = traversal == "STACK";
+    stack_traversal = requested_stack_traversal && stack_size <= max_stack_size;
+
+    auto end = std::chrono::high_resolution_clock::now();
+    size_t msec_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+
+    std::cout << (cached ? "BVH loaded in " : "BVH constructed in ") + Format::timeDuration(msec_duration);
+    if (num_branchings > 0.0)
+    {
+        std::cout << ". Branching factor of tree: " << (num_nodes - 1) / num_branchings;
+    }
+    if (num_references > tree_surfaces.size())
+    {
+        std::cout << ". Duplicated references: " << Format::largeNumber(num_references - tree_surfaces.size());
+    }
+    if (width)
+    {
+        size_t num_wide_nodes = wide4_tree.size() + wide8_tree.size() + quantized4_tree.size() + quantized8_tree.size();
+        std::cout << ". Collapsed to " << Format::largeNumber(num_wide_nodes) << " " << width << "-wide" << (quantized ? " quantized" : "") << " nodes";
+    }
+    if (!tree_surfaces.empty())
+    {
+        double bytes_per_surface = std::round(10.0 * num_bytes / tree_surfaces.size()) / 10.0;
+        std::cout << ". Size: " << bytes_per_surface << (instance_leaves ? " bytes/instance" : " bytes/triangle");
+    }
+    std::cout << std::endl;
+
+    if (!width && !stack_traversal && traversal == "STACK")
+    {
+        std::cout << "BVH is too deep for stack traversal, using priority queue traversal instead.\n";
+    }
+
+    if (benchmark_rays)
+    {
+        benchmark(tree_BB, benchmark_rays, stack_size <= max_stack_size);
+
+        if (width)
+        {
+            linear_tree.clear();
+            triangle_blocks.resize(num_blocks);
+            ordered_surfaces.resize(num_blocks * triangle_block_width);
+        }
+    }
+
+    if (!cached && !cache.empty())
+    {
+        writeCache(cache_path, hash, tree_surfaces, stack_size);
+    }
+}
+
+/**************************************************************************
+Builds the tree over the surfaces in the range [begin, end) of build_indices
+using the construction method given by the type field.
+**************************************************************************/
+BVH::BuildNode* BVH::buildTree(size_t begin, size_t end, 
+                               const BoundingBox &BB, 
+                               const nlohmann::json &j,
+                               bool print)
+{
+    build_scratch.resize(build_indices.size());
+    build_child_indices.resize(build_indices.size());
+
+    BuildNode *root = build_arena.allocate(1);
+    root->BB = BB;
+    root->begin = (uint32_t)begin;
+    root->end = (uint32_t)end;
+
     std::string type = getOptional<std::string>(j, "type", "OCTREE");
     std::transform(type.begin(), type.end(), type.begin(), toupper);
 
     if (type == "QUATERNARY_SAH")
     {
         bins_per_axis = getOptional(j, "bins_per_axis", 8);
-        std::cout << "\nBuilding quaternary BVH using SAH.\n\n";
-        root->surfaces = surfaces;
+        if (print) std::cout << "\nBuilding quaternary BVH using SAH.\n\n";
         recursiveBuildQuaternarySAH(root);
     }
     else if (type == "BINARY_SAH")
     {
         bins_per_axis = getOptional(j, "bins_per_axis", 16);
-        std::cout << "\nBuilding binary BVH using SAH.\n\n";
-        root->surfaces = surfaces;
+        if (print) std::cout << "\nBuilding binary BVH using SAH.\n\n";
         recursiveBuildBinarySAH(root);
     }
+    else if (type == "SBVH")
+    {
+        bins_per_axis = getOptional(j, "bins_per_axis", 32);
+        double duplication_budget = getOptional(j, "duplication_budget", 0.3);
+        if (print) std::cout << "\nBuilding binary BVH using SAH with spatial splits.\n\n";
+
+        std::vector<Reference> refs;
+        refs.reserve(end - begin);
+        for (size_t i = begin; i < end; i++)
+        {
+            refs.push_back({ build_indices[i], build_surfaces[build_indices[i]]->BB() });
+        }
+        size_t split_budget = (size_t)(std::max(duplication_budget, 0.0) * (end - begin));
+
+        // The leaf ranges are appended to the indices
+        build_indices.reserve(build_indices.size() + refs.size() + split_budget);
+        root_area = BB.area();
+        recursiveBuildSBVH(root, std::move(refs), split_budget);
+    }
+    else if (type == "LBVH")
+    {
+        bool hlbvh = getOptional(j, "hlbvh", true);
+        bins_per_axis = getOptional(j, "bins_per_axis", 16);
+        if (hlbvh)
+        {
+            if (print) std::cout << "\nBuilding BVH from Morton codes with SAH-built top levels.\n\n";
+        }
+        else
+        {
+            if (print) std::cout << "\nBuilding BVH from Morton codes.\n\n";
+        }
+        buildLBVH(root, hlbvh);
+    }
     else // OCTREE
     {
-        std::cout << "\nBuilding BVH from octree.\n\n";
+        if (print) std::cout << "\nBuilding BVH from octree.\n\n";
+
+        double half_max = glm::compMax(root->BB.dimensions()) / 2.0;
+        BoundingBox cube_BB(root->BB.centroid() - half_max, root->BB.centroid() + half_max);
+
+        recursiveBuildOctree(root, cube_BB);
+    }
+
+    return root;
+}
+
+void BVH::clearBuildData()
+{
+    build_root = nullptr;
+    build_arena.clear();
+    build_surfaces = std::vector<std::shared_ptr<Surface::Base>>();
+    build_indices = std::vector<uint32_t>();
+    build_scratch = std::vector<uint32_t>();
+    build_child_indices = std::vector<uint8_t>();
+}
+
+size_t BVH::layout(BuildNode *root, size_t requested_width)
+{
+    df_idx = 0;
+    num_references = 0;
+    wide_depth = 0;
+    branching.clear();
+    linear_tree.clear();
+    wide4_tree.clear();
+    wide8_tree.clear();
+    quantized4_tree.clear();
+    quantized8_tree.clear();
+    triangle_blocks.clear();
+    ordered_surfaces.clear();
+
+    size_t stack_size = assignIndices(root);
+
+    width = requested_width;
+    if (width != 4 && width != 8) width = 0;
+
+    if (width == 4)
+    {
+        collapse(root, wide4_tree, 1);
+    }
+    else if (width == 8)
+    {
+        collapse(root, wide8_tree, 1);
+    }
+
+    // Fall back to the linear tree if the wide tree is too deep for the fixed traversal stack
+    if (width && wide_depth * (width - 1) + 1 > max_stack_size)
+    {
+        std::cout << "Wide BVH is too deep (" << wide_depth << " levels), using linear BVH instead.\n";
+        wide4_tree.clear(); wide8_tree.clear();
+        triangle_blocks.clear(); ordered_surfaces.clear();
+        width = 0;
+    }
+
+    if (width == 4)
+    {
+        reorder(wide4_tree);
+    }
+    else if (width == 8)
+    {
+        reorder(wide8_tree);
+    }
+
+    // The single-precision wide tree is only used to quantize the child bounds
+    if (width == 4 && quantized)
+    {
+        quantized4_tree.assign(wide4_tree.begin(), wide4_tree.end());
+        wide4_tree = std::vector<WideNode<4>>();
+    }
+    else if (width == 8 && quantized)
+    {
+        quantized8_tree.assign(wide8_tree.begin(), wide8_tree.end());
+        wide8_tree = std::vector<WideNode<8>>();
+    }
+
+    if (!width)
+    {
+        linear_tree = std::vector<LinearNode>(df_idx, LinearNode());
+        compact(root);
+    }
+
+    return stack_size;
+}
+
+size_t BVH::memoryUsage() const
+{
+    return linear_tree.size() * sizeof(LinearNode) + 
+           wide4_tree.size() * sizeof(WideNode<4>) + 
+           wide8_tree.size() * sizeof(WideNode<8>) + 
+           quantized4_tree.size() * sizeof(QuantizedWideNode<4>) + 
+           quantized8_tree.size() * sizeof(QuantizedWideNode<8>) + 
+           triangle_blocks.size() * sizeof(TriangleBlock) + 
+           ordered_surfaces.size() * sizeof(std::shared_ptr<Surface::Base>);
+}
+
+/**************************************************************************
+Refits the retained build tree bottom-up to the current surface bounds. 
+Subtrees whose SAH cost has degraded by more than rebuild_threshold since
+they were built are then rebuilt top-down, and the traversal arrays are 
+emitted again from the build tree, which also repacks the moved triangles.
+**************************************************************************/
+void BVH::update()
+{
+    if (instance_bvh)
+    {
+        instance_bvh->update();
+    }
+
+    if (!build_root) return;
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    size_t num_rebuilt = 0;
+    refit(build_root);
+    rebuildDegraded(build_root, num_rebuilt);
+
+    // The replaced nodes and ranges of rebuilt subtrees are left behind, so the tree is copied to a new arena
+    if (num_rebuilt)
+    {
+        Arena<BuildNode> arena;
+        std::vector<uint32_t> indices;
+        indices.reserve(num_references);
+
+        BuildNode *root = arena.allocate(1);
+        copyBuildTree(build_root, root, arena, indices);
+
+        build_arena.swap(arena);
+        build_indices.swap(indices);
+        build_root = root;
+    }
+
+    size_t stack_size = layout(build_root, requested_width);
+    stack_traversal = requested_stack_traversal && stack_size <= max_stack_size;
+
+    auto end = std::chrono::high_resolution_clock::now();
+    size_t msec_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+
+    std::cout << "BVH updated in " << Format::timeDuration(msec_duration) 
+              << ". Rebuilt subtrees: " << Format::largeNumber(num_rebuilt) << std::endl;
+}
+
+/**************************************************************************
+Refits the bounding boxes of the subtree bottom-up to the current surface
+bounds and returns the SAH cost of the subtree with unit traversal and 
+intersection costs, i.e. the sum of the node areas plus the leaf areas 
+times the number of leaf surfaces. The returned cost is not divided by the
+node area, which makes it additive over children. The cost of each node
+relative to its area is recorded in the node.
+**************************************************************************/
+double BVH::refit(BuildNode *bvh_node)
+{
+    bvh_node->BB = BoundingBox();
+
+    double cost = 0.0;
+    if (bvh_node->leaf())
+    {
+        for (uint32_t i = bvh_node->begin; i < bvh_node->end; i++)
+        {
+            bvh_node->BB.merge(build_surfaces[build_indices[i]]->BB());
+        }
+    }
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
+    {
+        cost += refit(bvh_node->children + i);
+        bvh_node->BB.merge(bvh_node->children[i].BB);
+    }
+
+    double area = bvh_node->BB.area();
+    cost += bvh_node->leaf() ? area * bvh_node->size() : area;
+
+    bvh_node->cost = area > 0.0 ? cost / area : 0.0;
+    return cost;
+}
+
+// Rebuilds the largest subtrees that have degraded, so that no subtree is rebuilt more than once
+void BVH::rebuildDegraded(BuildNode *bvh_node, size_t &num_rebuilt)
+{
+    if (bvh_node->leaf()) return;
+
+    if (bvh_node->cost > rebuild_threshold * bvh_node->build_cost)
+    {
+        rebuild(bvh_node);
+        num_rebuilt++;
+        return;
+    }
+
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
+    {
+        rebuildDegraded(bvh_node->children + i, num_rebuilt);
+    }
+}
+
+void BVH::setBuildCosts(BuildNode *bvh_node)
+{
+    bvh_node->build_cost = bvh_node->cost;
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
+    {
+        setBuildCosts(bvh_node->children + i);
+    }
+}
+
+// The subtree is rebuilt over a new range at the end of build_indices
+void BVH::rebuild(BuildNode *bvh_node)
+{
+    std::vector<uint32_t> S;
+    std::vector<const BuildNode*> stack{ bvh_node };
+    while (!stack.empty())
+    {
+        const BuildNode *node = stack.back();
+        stack.pop_back();
+        if (node->leaf())
+        {
+            S.insert(S.end(), build_indices.begin() + node->begin, build_indices.begin() + node->end);
+        }
+        for (uint32_t i = 0; i < node->num_children; i++)
+        {
+            stack.push_back(node->children + i);
+        }
+    }
+
+    // References are duplicated by spatial splits
+    std::sort(S.begin(), S.end());
+    S.erase(std::unique(S.begin(), S.end()), S.end());
+
+    size_t begin = build_indices.size();
+    build_indices.insert(build_indices.end(), S.begin(), S.end());
+
+    *bvh_node = *buildTree(begin, build_indices.size(), bvh_node->BB, build_settings, false);
+
+    refit(bvh_node);
+    setBuildCosts(bvh_node);
+}
+
+void BVH::copyBuildTree(const BuildNode *src, BuildNode *dst, Arena<BuildNode> &arena, std::vector<uint32_t> &indices) const
+{
+    *dst = *src;
+
+    if (src->leaf())
+    {
+        dst->begin = (uint32_t)indices.size();
+        indices.insert(indices.end(), build_indices.begin() + src->begin, build_indices.begin() + src->end);
+        dst->end = (uint32_t)indices.size();
+        return;
+    }
+
+    dst->children = arena.allocate(src->num_children);
+    for (uint32_t i = 0; i < src->num_children; i++)
+    {
+        copyBuildTree(src->children + i, dst->children + i, arena, indices);
+    }
+}
+
+nlohmann::json BVH::nestedSettings(const nlohmann::json &j)
+{
+    nlohmann::json settings = j;
+    settings.erase("cache");
+    settings.erase("benchmark_rays");
+    return settings;
+}
+
+namespace
+{
+    constexpr uint64_t CACHE_MAGIC = 0x4843414348564242; // "BBVHCACH"
+
+    // Changed whenever the layout of the cached data or the hash changes
+    constexpr uint64_t CACHE_VERSION = 3;
+
+    // Ordered surface index of unused block lanes
+    constexpr uint32_t NO_SURFACE = std::numeric_limits<uint32_t>::max();
+}
+
+uint64_t BVH::cacheHash(const std::vector<std::shared_ptr<Surface::Base>> &triangles, const nlohmann::json &j) const
+{
+    // Settings that don't affect the cached data
+    nlohmann::json settings = j;
+    for (const auto &field : { "cache", "traversal", "benchmark_rays" })
+    {
+        settings.erase(field);
+    }
+    std::string settings_str = settings.dump();
+
+    uint64_t layout[] = { CACHE_VERSION, triangle_block_width, sizeof(LinearNode), sizeof(TriangleBlock), triangles.size() };
+    uint64_t hash = BinaryFile::hash(layout, sizeof(layout));
+    hash = BinaryFile::hash(settings_str.data(), settings_str.size(), hash);
+
+    for (const auto &s : triangles)
+    {
+        const auto *triangle = static_cast<const Surface::Triangle*>(s.get());
+        glm::dvec3 v[3] = { triangle->vertex0(), triangle->edge1(), triangle->edge2() };
+        hash = BinaryFile::hash(v, sizeof(v), hash);
+    }
+    return hash;
+}
+
+/**************************************************************************
+Reads the traversal data written by writeCache if the file exists and was
+written for the same hash. The ordered surfaces are stored as indices into
+triangles, which are mapped back to the triangles of this run. Returns 
+false and leaves the BVH unchanged if the file can't be used.
+**************************************************************************/
+bool BVH::readCache(const std::filesystem::path &path, uint64_t hash, 
+                    const std::vector<std::shared_ptr<Surface::Base>> &triangles, size_t &stack_size)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+    {
+        return false;
+    }
+    size_t file_size = in.tellg();
+    in.seekg(0);
+
+    uint64_t magic, file_hash;
+    if (!BinaryFile::read(in, magic) || magic != CACHE_MAGIC || !BinaryFile::read(in, file_hash) || file_hash != hash)
+    {
+        std::cout << "\nBVH cache " << path.string() << " is out of date, rebuilding BVH.\n";
+        return false;
+    }
+
+    uint64_t cached_width, cached_stack_size, cached_wide_depth, cached_num_references;
+    std::vector<uint64_t> cached_branching;
+    std::vector<LinearNode> cached_linear_tree;
+    std::vector<WideNode<4>> cached_wide4_tree;
+    std::vector<WideNode<8>> cached_wide8_tree;
+    std::vector<QuantizedWideNode<4>> cached_quantized4_tree;
+    std::vector<QuantizedWideNode<8>> cached_quantized8_tree;
+    std::vector<TriangleBlock> cached_triangle_blocks;
+    std::vector<uint32_t> surface_indices;
+
+    bool valid =
+        BinaryFile::read(in, cached_width) &&
+        BinaryFile::read(in, cached_stack_size) &&
+        BinaryFile::read(in, cached_wide_depth) &&
+        BinaryFile::read(in, cached_num_references) &&
+        BinaryFile::read(in, cached_branching, file_size / sizeof(uint64_t)) &&
+        BinaryFile::read(in, cached_linear_tree, file_size / sizeof(LinearNode)) &&
+        BinaryFile::read(in, cached_wide4_tree, file_size / sizeof(WideNode<4>)) &&
+        BinaryFile::read(in, cached_wide8_tree, file_size / sizeof(WideNode<8>)) &&
+        BinaryFile::read(in, cached_quantized4_tree, file_size / sizeof(QuantizedWideNode<4>)) &&
+        BinaryFile::read(in, cached_quantized8_tree, file_size / sizeof(QuantizedWideNode<8>)) &&
+        BinaryFile::read(in, cached_triangle_blocks, file_size / sizeof(TriangleBlock)) &&
+        BinaryFile::read(in, surface_indices, file_size / sizeof(uint32_t));
+
+    valid = valid && cached_branching.size() % 2 == 0 &&
+            surface_indices.size() == cached_triangle_blocks.size() * triangle_block_width &&
+            std::all_of(surface_indices.begin(), surface_indices.end(), [&](uint32_t i)
+            {
+                return i < triangles.size() || i == NO_SURFACE;
+            });
+
+    if (!valid)
+    {
+        std::cout << "\nBVH cache " << path.string() << " is invalid, rebuilding BVH.\n";
+        return false;
+    }
+
+    width = cached_width;
+    stack_size = cached_stack_size;
+    wide_depth = cached_wide_depth;
+    num_references = cached_num_references;
+    for (size_t i = 0; i < cached_branching.size(); i += 2)
+    {
+        branching[cached_branching[i]] = cached_branching[i + 1];
+    }
+    linear_tree = std::move(cached_linear_tree);
+    wide4_tree = std::move(cached_wide4_tree);
+    wide8_tree = std::move(cached_wide8_tree);
+    quantized4_tree = std::move(cached_quantized4_tree);
+    quantized8_tree = std::move(cached_quantized8_tree);
+    quantized = !quantized4_tree.empty() || !quantized8_tree.empty();
+    triangle_blocks = std::move(cached_triangle_blocks);
+
+    ordered_surfaces.resize(surface_indices.size());
+    for (size_t i = 0; i < surface_indices.size(); i++)
+    {
+        ordered_surfaces[i] = surface_indices[i] == NO_SURFACE ? nullptr : triangles[surface_indices[i]];
+    }
+    return true;
+}
+
+void BVH::writeCache(const std::filesystem::path &path, uint64_t hash, 
+                     const std::vector<std::shared_ptr<Surface::Base>> &triangles, size_t stack_size) const
+{
+    std::unordered_map<const Surface::Base*, uint32_t> triangle_indices;
+    for (size_t i = 0; i < triangles.size(); i++)
+    {
+        triangle_indices[triangles[i].get()] = (uint32_t)i;
+    }
+
+    std::vector<uint32_t> surface_indices(ordered_surfaces.size(), NO_SURFACE);
+    for (size_t i = 0; i < ordered_surfaces.size(); i++)
+    {
+        if (ordered_surfaces[i])
+        {
+            surface_indices[i] = triangle_indices.at(ordered_surfaces[i].get());
+        }
+    }
+
+    std::vector<uint64_t> flat_branching;
+    for (const auto &b : branching)
+    {
+        flat_branching.push_back(b.first);
+        flat_branching.push_back(b.second);
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    BinaryFile::write(out, CACHE_MAGIC);
+    BinaryFile::write(out, hash);
+    BinaryFile::write(out, (uint64_t)width);
+    BinaryFile::write(out, (uint64_t)stack_size);
+    BinaryFile::write(out, (uint64_t)wide_depth);
+    BinaryFile::write(out, (uint64_t)num_references);
+    BinaryFile::write(out, flat_branching);
+    BinaryFile::write(out, linear_tree);
+    BinaryFile::write(out, wide4_tree);
+    BinaryFile::write(out, wide8_tree);
+    BinaryFile::write(out, quantized4_tree);
+    BinaryFile::write(out, quantized8_tree);
+    BinaryFile::write(out, triangle_blocks);
+    BinaryFile::write(out, surface_indices);
+
+    if (out)
+    {
+        std::cout << "BVH saved to " << path.string() << ".\n";
+    }
+    else
+    {
+        std::cout << "Failed to save BVH to " << path.string() << ".\n";
+    }
+}
+
+namespace
+{
+    // Ray data for slab-testing single-precision node bounds.
+    struct SlabRay
+    {
+        SlabRay() { }
+        SlabRay(const Ray &ray)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                origin[i] = (float)ray.start[i];
+                inv_dir[i] = (float)(1.0 / ray.direction[i]);
+                near[i] = std::signbit(inv_dir[i]) ? i + 3 : i;
+                far[i] = std::signbit(inv_dir[i]) ? i : i + 3;
+            }
+        }
+
+        float origin[3], inv_dir[3];
+        int near[3], far[3];
+    };
+
+    // Scales the far slab distance to compensate for rounding errors in the 
+    // single-precision slab test, 1 + 2 * gamma(3) from PBRT (3rd ed.) 3.9.2.
+    constexpr float SLAB_SCALE = 1.0f + 2.0f * (3.0f * 0x1p-24f) / (1.0f - 3.0f * 0x1p-24f);
+
+    float roundDown(double d)
+    {
+        float f = (float)d;
+        return (double)f > d ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    float roundUp(double d)
+    {
+        float f = (float)d;
+        return (double)f < d ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+
+    bool intersectBounds(const float (&bounds)[6], const SlabRay &r, float t_max, float &t)
+    {
+        t = 0.0f;
+        for (int a = 0; a < 3; a++)
+        {
+            float t0 = (bounds[r.near[a]] - r.origin[a]) * r.inv_dir[a];
+            float t1 = (bounds[r.far[a]] - r.origin[a]) * r.inv_dir[a];
+            if (t0 > t) t = t0;
+            if (t1 < t_max) t_max = t1;
+        }
+        return t <= t_max * SLAB_SCALE;
+    }
+
+    void setBounds(float (&bounds)[6], const BoundingBox &BB)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            bounds[a] = roundDown(BB.min[a]);
+            bounds[a + 3] = roundUp(BB.max[a]);
+        }
+    }
+
+    float roundUpDistance(double t)
+    {
+        return t < std::numeric_limits<float>::max() ? roundUp(t) : std::numeric_limits<float>::max();
+    }
+
+    /**********************************************************************
+     Slab-tests all W child lanes of a wide node. Returns a bit mask of the 
+     intersected lanes and writes the lane entry distances to t_near.
+    **********************************************************************/
+    template<size_t W>
+    uint32_t intersectLanes(const float (&bounds)[6][W], const SlabRay &r, float t_max, float *t_near)
+    {
+        uint32_t mask = 0;
+#if defined(__AVX__)
+        if constexpr (W == 8)
+        {
+            __m256 tn = _mm256_setzero_ps();
+            __m256 tf = _mm256_set1_ps(t_max);
+            for (int a = 0; a < 3; a++)
+            {
+                __m256 o = _mm256_set1_ps(r.origin[a]);
+                __m256 inv_d = _mm256_set1_ps(r.inv_dir[a]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.near[a]]), o), inv_d);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.far[a]]), o), inv_d);
+                // NaN distances (0 * inf) are discarded since max/min returns the second operand
+                tn = _mm256_max_ps(t0, tn);
+                tf = _mm256_min_ps(t1, tf);
+            }
+            tf = _mm256_mul_ps(tf, _mm256_set1_ps(SLAB_SCALE));
+            _mm256_storeu_ps(t_near, tn);
+            return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        for (size_t i = 0; i < W; i += 4)
+        {
+            __m128 tn = _mm_setzero_ps();
+            __m128 tf = _mm_set1_ps(t_max);
+            for (int a = 0; a < 3; a++)
+            {
+                __m128 o = _mm_set1_ps(r.origin[a]);
+                __m128 inv_d = _mm_set1_ps(r.inv_dir[a]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[r.near[a]] + i), o), inv_d);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[r.far[a]] + i), o), inv_d);
+                tn = _mm_max_ps(t0, tn);
+                tf = _mm_min_ps(t1, tf);
+            }
+            tf = _mm_mul_ps(tf, _mm_set1_ps(SLAB_SCALE));
+            _mm_storeu_ps(t_near + i, tn);
+            mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tn, tf)) << i;
+        }
+#else
+        for (size_t i = 0; i < W; i++)
+        {
+            float tn = 0.0f, tf = t_max;
+            for (int a = 0; a < 3; a++)
+            {
+                float t0 = (bounds[r.near[a]][i] - r.origin[a]) * r.inv_dir[a];
+                float t1 = (bounds[r.far[a]][i] - r.origin[a]) * r.inv_dir[a];
+                tn = t0 > tn ? t0 : tn;
+                tf = t1 < tf ? t1 : tf;
+            }
+            t_near[i] = tn;
+            if (tn <= tf * SLAB_SCALE) mask |= 1u << i;
+        }
+#endif
+        return mask;
+    }
+}
+
+Intersection BVH::intersect(const Ray& ray) const
+{
+    Intersection intersect;
+    for (const auto &surface : other_surfaces)
+    {
+        Intersection t_intersect;
+        if (surface->intersect(ray, t_intersect) && t_intersect.t < intersect.t)
+        {
+            intersect = t_intersect;
+            intersect.surface = surface;
+        }
+    }
+
+    if (instance_bvh)
+    {
+        Intersection t_intersect = instance_bvh->intersect(ray);
+        if (t_intersect.t < intersect.t)
+        {
+            intersect = t_intersect;
+        }
+    }
+
+    // The surface pointer is only copied once for the closest triangle
+    uint32_t hit = std::numeric_limits<uint32_t>::max();
+
+    if (width == 4 && quantized) intersectWide(ray, quantized4_tree, intersect, hit);
+    else if (width == 8 && quantized) intersectWide(ray, quantized8_tree, intersect, hit);
+    else if (width == 4) intersectWide(ray, wide4_tree, intersect, hit);
+    else if (width == 8) intersectWide(ray, wide8_tree, intersect, hit);
+    else if (stack_traversal) intersectStack(ray, intersect, hit);
+    else intersectPriorityQueue(ray, intersect, hit);
+
+    if (hit != std::numeric_limits<uint32_t>::max())
+    {
+        intersect.surface = ordered_surfaces[hit];
+    }
+    return intersect;
+}
+
+void BVH::intersect(const Ray *rays, Intersection *intersects, size_t num_rays) const
+{
+    if (width != 4 && width != 8)
+    {
+        for (size_t i = 0; i < num_rays; i++)
+        {
+            intersects[i] = intersect(rays[i]);
+        }
+        return;
+    }
+
+    uint32_t hits[max_packet_size];
+    for (size_t i = 0; i < num_rays; i++)
+    {
+        intersects[i] = Intersection();
+        for (const auto &surface : other_surfaces)
+        {
+            Intersection t_intersect;
+            if (surface->intersect(rays[i], t_intersect) && t_intersect.t < intersects[i].t)
+            {
+                intersects[i] = t_intersect;
+                intersects[i].surface = surface;
+            }
+        }
+        if (instance_bvh)
+        {
+            Intersection t_intersect = instance_bvh->intersect(rays[i]);
+            if (t_intersect.t < intersects[i].t)
+            {
+                intersects[i] = t_intersect;
+            }
+        }
+        hits[i] = std::numeric_limits<uint32_t>::max();
+    }
+
+    if (width == 4 && quantized) intersectWidePacket(rays, num_rays, quantized4_tree, intersects, hits);
+    else if (width == 8 && quantized) intersectWidePacket(rays, num_rays, quantized8_tree, intersects, hits);
+    else if (width == 4) intersectWidePacket(rays, num_rays, wide4_tree, intersects, hits);
+    else intersectWidePacket(rays, num_rays, wide8_tree, intersects, hits);
+
+    for (size_t i = 0; i < num_rays; i++)
+    {
+        if (hits[i] != std::numeric_limits<uint32_t>::max())
+        {
+            intersects[i].surface = ordered_surfaces[hits[i]];
+        }
+    }
+}
+
+void BVH::intersectPriorityQueue(const Ray& ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats) const
+{
+    thread_local AccessiblePQ<LinearNode::NodeIntersection> to_visit; to_visit.clear();
+
+    SlabRay slab_ray(ray);
+    TriangleRay triangle_ray(ray);
+
+    float t;
+    if (intersectBounds(linear_tree[0].bounds, slab_ray, roundUpDistance(intersect.t), t))
+    {
+        uint32_t node_idx = 0;
+        while (true)
+        {
+            if (stats) stats->nodes++;
+
+            const auto &node = linear_tree[node_idx];
+            if (node.num_surfaces)
+            {
+                intersectLeaf(ray, triangle_ray, node.start_surface, node.num_surfaces, intersect, hit);
+            }
+            else
+            {
+                float t_max = roundUpDistance(intersect.t);
+                uint32_t child_idx = node_idx + 1;
+                while (true)
+                {
+                    const auto &child = linear_tree[child_idx];
+                    if (intersectBounds(child.bounds, slab_ray, t_max, t))
+                    {
+                        to_visit.push({ t, child_idx });
+                    }
+
+                    if (child.num_surfaces)
+                    {
+                        if (child_idx == node.last_descendant) break;
+                        child_idx++;
+                    }
+                    else
+                    {
+                        if (child.last_descendant == node.last_descendant) break;
+                        child_idx = child.last_descendant + 1;
+                    }
+                }
+            }
+            if (to_visit.empty() || to_visit.top().t >= intersect.t)
+            {
+                break;
+            }
+            node_idx = to_visit.top().node; 
+            to_visit.pop();
+        }
+    }
+}
+
+/**************************************************************************
+Ordered traversal of the linear tree using a fixed-size stack. The 
+intersected children of a node are sorted by entry distance and pushed 
+farthest first, so that the closest child is visited next. Nodes that are
+entered beyond the closest intersection found so far are skipped when 
+popped. The size of the stack is checked against the tree after it is 
+built, see assignIndices.
+**************************************************************************/
+void BVH::intersectStack(const Ray& ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats) const
+{
+    LinearNode::NodeIntersection stack[max_stack_size];
+    size_t stack_size = 0;
+
+    SlabRay slab_ray(ray);
+    TriangleRay triangle_ray(ray);
+
+    float t;
+    if (intersectBounds(linear_tree[0].bounds, slab_ray, roundUpDistance(intersect.t), t))
+    {
+        stack[stack_size++] = { t, 0 };
+    }
+
+    while (stack_size)
+    {
+        const auto entry = stack[--stack_size];
+        if (entry.t > intersect.t)
+        {
+            continue;
+        }
+
+        if (stats) stats->nodes++;
+
+        const auto &node = linear_tree[entry.node];
+        if (node.num_surfaces)
+        {
+            intersectLeaf(ray, triangle_ray, node.start_surface, node.num_surfaces, intersect, hit);
+            continue;
+        }
+
+        float t_max = roundUpDistance(intersect.t);
+        size_t first = stack_size;
+        uint32_t child_idx = entry.node + 1;
+        while (true)
+        {
+            const auto &child = linear_tree[child_idx];
+            if (intersectBounds(child.bounds, slab_ray, t_max, t))
+            {
+                // Insertion sort of the pushed children by descending entry distance
+                size_t i = stack_size++;
+                while (i > first && stack[i - 1].t < t)
+                {
+                    stack[i] = stack[i - 1];
+                    i--;
+                }
+                stack[i] = { t, child_idx };
+            }
+
+            if (child.num_surfaces)
+            {
+                if (child_idx == node.last_descendant) break;
+                child_idx++;
+            }
+            else
+            {
+                if (child.last_descendant == node.last_descendant) break;
+                child_idx = child.last_descendant + 1;
+            }
+        }
+    }
+}
+
+template<class Node>
+void BVH::intersectWide(const Ray& ray, const std::vector<Node> &wide_tree, Intersection &intersect, uint32_t &hit, TraversalStats *stats) const
+{
+    constexpr size_t W = Node::num_lanes;
+
+    struct StackEntry
+    {
+        float t;
+        uint32_t child;
+        uint32_t num_surfaces;
+    };
+
+    StackEntry stack[max_stack_size];
+    size_t stack_size = 0;
+    stack[stack_size++] = { 0.0f, 0, 0 };
+
+    SlabRay wide_ray(ray);
+    TriangleRay triangle_ray(ray);
+    alignas(32) float t_near[W];
+    alignas(32) LaneBounds<W> decoded;
+    std::pair<float, uint32_t> hits[W];
+
+    while (stack_size)
+    {
+        const StackEntry entry = stack[--stack_size];
+        if (entry.t > intersect.t)
+        {
+            continue;
+        }
+
+        if (stats) stats->nodes++;
+
+        if (entry.num_surfaces)
+        {
+            intersectLeaf(ray, triangle_ray, entry.child, entry.num_surfaces, intersect, hit);
+            continue;
+        }
+
+        const auto &node = wide_tree[entry.child];
+        float t_max = roundUpDistance(intersect.t);
+        uint32_t mask = intersectLanes(childBounds(node, decoded), wide_ray, t_max, t_near);
+
+        // Sort intersected lanes by descending entry distance so that the closest is visited first
+        size_t num_hits = 0;
+        while (mask)
+        {
+            uint32_t lane = countTrailingZeros(mask);
+            mask &= mask - 1;
+            size_t i = num_hits++;
+            while (i > 0 && hits[i - 1].first < t_near[lane])
+            {
+                hits[i] = hits[i - 1];
+                i--;
+            }
+            hits[i] = { t_near[lane], lane };
+        }
+
+        for (size_t i = 0; i < num_hits; i++)
+        {
+            uint32_t lane = hits[i].second;
+            stack[stack_size++] = { hits[i].first, node.child[lane], node.num_surfaces[lane] };
+        }
+    }
+}
+
+/**************************************************************************
+Traverses the wide tree with a packet of coherent rays, such as the camera
+rays of a pixel. Each stack entry holds a bit mask of the rays that 
+intersected the node, so the node data and the stack operations are shared
+by the packet. The children are visited in order of the closest entry 
+distance of any ray in the packet, and rays that have already found a 
+closer intersection than this distance are removed from the entry mask.
+**************************************************************************/
+template<class Node>
+void BVH::intersectWidePacket(const Ray *rays, size_t num_rays, const std::vector<Node> &wide_tree, Intersection *intersects, uint32_t *hits) const
+{
+    constexpr size_t W = Node::num_lanes;
+
+    struct StackEntry
+    {
+        float t;
+        uint32_t child;
+        uint32_t num_surfaces;
+        uint32_t ray_mask;
+    };
+
+    StackEntry stack[max_stack_size];
+    size_t stack_size = 0;
+    stack[stack_size++] = { 0.0f, 0, 0, (uint32_t)((1ull << num_rays) - 1) };
+
+    SlabRay slab_rays[max_packet_size];
+    TriangleRay triangle_rays[max_packet_size];
+    for (size_t i = 0; i < num_rays; i++)
+    {
+        slab_rays[i] = SlabRay(rays[i]);
+        triangle_rays[i] = TriangleRay(rays[i]);
+    }
+
+    alignas(32) float t_near[W];
+    alignas(32) LaneBounds<W> decoded;
+    float child_t[W];
+    uint32_t child_rays[W];
+    std::pair<float, uint32_t> children[W];
+
+    while (stack_size)
+    {
+        StackEntry entry = stack[--stack_size];
+
+        uint32_t ray_mask = entry.ray_mask;
+        while (ray_mask)
+        {
+            uint32_t i = countTrailingZeros(ray_mask);
+            ray_mask &= ray_mask - 1;
+            if (entry.t > intersects[i].t) entry.ray_mask &= ~(1u << i);
+        }
+
+        if (!entry.ray_mask)
+        {
+            continue;
+        }
+
+        if (entry.num_surfaces)
+        {
+            ray_mask = entry.ray_mask;
+            while (ray_mask)
+            {
+                uint32_t i = countTrailingZeros(ray_mask);
+                ray_mask &= ray_mask - 1;
+                intersectLeaf(rays[i], triangle_rays[i], entry.child, entry.num_surfaces, intersects[i], hits[i]);
+            }
+            continue;
+        }
+
+        const auto &node = wide_tree[entry.child];
+        const auto &bounds = childBounds(node, decoded);
+        for (size_t lane = 0; lane < W; lane++)
+        {
+            child_t[lane] = std::numeric_limits<float>::infinity();
+            child_rays[lane] = 0;
+        }
+
+        ray_mask = entry.ray_mask;
+        while (ray_mask)
+        {
+            uint32_t i = countTrailingZeros(ray_mask);
+            ray_mask &= ray_mask - 1;
+
+            uint32_t mask = intersectLanes(bounds, slab_rays[i], roundUpDistance(intersects[i].t), t_near);
+            while (mask)
+            {
+                uint32_t lane = countTrailingZeros(mask);
+                mask &= mask - 1;
+                child_rays[lane] |= 1u << i;
+                child_t[lane] = std::min(child_t[lane], t_near[lane]);
+            }
+        }
+
+        // Sort intersected lanes by descending entry distance so that the closest is visited first
+        size_t num_children = 0;
+        for (uint32_t lane = 0; lane < W; lane++)
+        {
+            if (!child_rays[lane]) continue;
+            size_t i = num_children++;
+            while (i > 0 && children[i - 1].first < child_t[lane])
+            {
+                children[i] = children[i - 1];
+                i--;
+            }
+            children[i] = { child_t[lane], lane };
+        }
+
+        for (size_t i = 0; i < num_children; i++)
+        {
+            uint32_t lane = children[i].second;
+            stack[stack_size++] = { children[i].first, node.child[lane], node.num_surfaces[lane], child_rays[lane] };
+        }
+    }
+}
+
+/**************************************************************************
+Any-hit query used for shadow rays. The linear tree is traversed without a
+stack in depth-first order, where subtrees whose bounding box is missed are
+skipped using the last descendant index. Traversal ends at the first hit.
+**************************************************************************/
+bool BVH::occluded(const Ray& ray, double t_max, const std::shared_ptr<Surface::Base> &ignore_surface) const
+{
+    for (const auto &surface : other_surfaces)
+    {
+        Intersection t_intersect;
+        if (surface != ignore_surface && surface->intersect(ray, t_intersect) && t_intersect.t < t_max)
+        {
+            return true;
+        }
+    }
+
+    if (instance_bvh && instance_bvh->occluded(ray, t_max, ignore_surface))
+    {
+        return true;
+    }
+
+    if (width == 4 && quantized) return occludedWide(ray, quantized4_tree, t_max, ignore_surface.get());
+    if (width == 8 && quantized) return occludedWide(ray, quantized8_tree, t_max, ignore_surface.get());
+    if (width == 4) return occludedWide(ray, wide4_tree, t_max, ignore_surface.get());
+    if (width == 8) return occludedWide(ray, wide8_tree, t_max, ignore_surface.get());
+
+    SlabRay slab_ray(ray);
+    TriangleRay triangle_ray(ray);
+    float float_t_max = roundUpDistance(t_max);
+
+    uint32_t end_idx = linear_tree[0].num_surfaces ? 1 : linear_tree[0].last_descendant + 1;
+    uint32_t node_idx = 0;
+    float t;
+    while (node_idx < end_idx)
+    {
+        const auto &node = linear_tree[node_idx];
+        if (!intersectBounds(node.bounds, slab_ray, float_t_max, t))
+        {
+            node_idx = node.num_surfaces ? node_idx + 1 : node.last_descendant + 1;
+            continue;
+        }
+
+        if (node.num_surfaces)
+        {
+            if (occludedLeaf(ray, triangle_ray, node.start_surface, node.num_surfaces, t_max, ignore_surface.get()))
+            {
+                return true;
+            }
+        }
+        node_idx++;
+    }
+    return false;
+}
+
+template<class Node>
+bool BVH::occludedWide(const Ray& ray, const std::vector<Node> &wide_tree, double t_max, const Surface::Base *ignore_surface) const
+{
+    constexpr size_t W = Node::num_lanes;
+
+    uint32_t stack[max_stack_size];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+
+    SlabRay wide_ray(ray);
+    TriangleRay triangle_ray(ray);
+    float float_t_max = roundUpDistance(t_max);
+    alignas(32) float t_near[W];
+    alignas(32) LaneBounds<W> decoded;
+
+    while (stack_size)
+    {
+        const auto &node = wide_tree[stack[--stack_size]];
+        uint32_t mask = intersectLanes(childBounds(node, decoded), wide_ray, float_t_max, t_near);
+        while (mask)
+        {
+            uint32_t lane = countTrailingZeros(mask);
+            mask &= mask - 1;
+            if (node.num_surfaces[lane])
+            {
+                if (occludedLeaf(ray, triangle_ray, node.child[lane], node.num_surfaces[lane], t_max, ignore_surface))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                stack[stack_size++] = node.child[lane];
+            }
+        }
+    }
+    return false;
+}
+
+bool BVH::occludedLeaf(const Ray& ray, const TriangleRay &triangle_ray, uint32_t start_surface, uint32_t num_surfaces, 
+                       double t_max, const Surface::Base *ignore_surface) const
+{
+    constexpr size_t W = triangle_block_width;
+
+    if (instance_leaves)
+    {
+        for (uint32_t i = start_surface; i < start_surface + num_surfaces; i++)
+        {
+            const auto *instance = static_cast<const Surface::Instance*>(ordered_surfaces[i].get());
+            if (instance != ignore_surface && instance->occluded(ray, t_max))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    float float_t_max = roundUpDistance(t_max);
+    for (uint32_t b = start_surface / W; num_surfaces; b++)
+    {
+        uint32_t num_lanes = std::min(num_surfaces, (uint32_t)W);
+        num_surfaces -= num_lanes;
+
+        uint32_t mask = triangle_blocks[b].intersect(triangle_ray, float_t_max);
+        mask &= (uint32_t)((1ull << num_lanes) - 1);
+
+        while (mask)
+        {
+            uint32_t surface_idx = b * W + countTrailingZeros(mask);
+            mask &= mask - 1;
+
+            const auto *triangle = static_cast<const Surface::Triangle*>(ordered_surfaces[surface_idx].get());
+            if (triangle == ignore_surface) continue;
+
+            Intersection t_intersect;
+            if (triangle->Surface::Triangle::intersect(ray, t_intersect) && t_intersect.t < t_max)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**************************************************************************
+Traces num_rays random rays, with origins uniformly distributed in BB and 
+uniformly distributed directions, using each traversal method available 
+for the tree and prints the average number of visited nodes per ray and
+the wall time. The linear tree nodes visited by the priority queue and
+stack traversals are comparable, while wide tree nodes contain W children.
+**************************************************************************/
+void BVH::benchmark(const BoundingBox &BB, size_t num_rays, bool stack) const
+{
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> U(0.0, 1.0);
+
+    std::vector<Ray> rays;
+    rays.reserve(num_rays);
+    for (size_t i = 0; i < num_rays; i++)
+    {
+        glm::dvec3 origin = BB.min + glm::dvec3(U(rng), U(rng), U(rng)) * BB.dimensions();
+        double z = 1.0 - 2.0 * U(rng);
+        double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+        double phi = 2.0 * C::PI * U(rng);
+        rays.emplace_back(origin, glm::dvec3(r * std::cos(phi), r * std::sin(phi), z), 1.0);
+    }
+
+    // Cache misses are counted with hardware counters where available
+    PerfCounter cache_misses(PerfCounter::CACHE_MISSES), l1d_misses(PerfCounter::L1D_READ_MISSES);
+
+    auto run = [&](const std::string &name, auto traverse)
+    {
+        TraversalStats stats;
+        size_t num_hits = 0;
+        cache_misses.start();
+        l1d_misses.start();
+        auto begin = std::chrono::high_resolution_clock::now();
+        for (const auto &ray : rays)
+        {
+            Intersection intersect;
+            uint32_t hit = std::numeric_limits<uint32_t>::max();
+            traverse(ray, intersect, hit, &stats);
+            if (hit != std::numeric_limits<uint32_t>::max()) num_hits++;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double l1d_misses_per_ray = (double)l1d_misses.stop() / num_rays;
+        double cache_misses_per_ray = (double)cache_misses.stop() / num_rays;
+        double sec = std::chrono::duration<double>(end - begin).count();
+
+        std::cout << "  " << name << ": " << (double)stats.nodes / num_rays << " nodes/ray, " 
+                  << sec << " s, " << num_rays / (sec * 1e6) << " Mrays/s, " 
+                  << Format::largeNumber(num_hits) << " hits";
+        if (l1d_misses.valid()) std::cout << ", " << l1d_misses_per_ray << " L1D misses/ray";
+        if (cache_misses.valid()) std::cout << ", " << cache_misses_per_ray << " cache misses/ray";
+        std::cout << "\n";
+    };
+
+    if (width == 4 && quantized) printLayoutStats(quantized4_tree);
+    else if (width == 8 && quantized) printLayoutStats(quantized8_tree);
+    else if (width == 4) printLayoutStats(wide4_tree);
+    else if (width == 8) printLayoutStats(wide8_tree);
+
+    std::cout << "\nTraversal benchmark using " << Format::largeNumber(num_rays) << " random rays:\n";
+
+    run("priority queue", [this](const Ray &ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats)
+    {
+        intersectPriorityQueue(ray, intersect, hit, stats);
+    });
+
+    if (stack)
+    {
+        run("stack", [this](const Ray &ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats)
+        {
+            intersectStack(ray, intersect, hit, stats);
+        });
+    }
+
+    if (width == 4 && quantized)
+    {
+        run("4-wide quantized stack", [this](const Ray &ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats)
+        {
+            intersectWide(ray, quantized4_tree, intersect, hit, stats);
+        });
+    }
+    else if (width == 8 && quantized)
+    {
+        run("8-wide quantized stack", [this](const Ray &ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats)
+        {
+            intersectWide(ray, quantized8_tree, intersect, hit, stats);
+        });
+    }
+    else if (width == 4)
+    {
+        run("4-wide stack", [this](const Ray &ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats)
+        {
+            intersectWide(ray, wide4_tree, intersect, hit, stats);
+        });
+    }
+    else if (width == 8)
+    {
+        run("8-wide stack", [this](const Ray &ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats)
+        {
+            intersectWide(ray, wide8_tree, intersect, hit, stats);
+        });
+    }
+}
+
+/**************************************************************************
+Intersects the triangle blocks of a leaf. Lanes that pass the conservative
+single-precision test are refined with the double-precision triangle test,
+and hit is set to the surface index of the closest intersected triangle.
+**************************************************************************/
+void BVH::intersectLeaf(const Ray& ray, const TriangleRay &triangle_ray, uint32_t start_surface, uint32_t num_surfaces, 
+                        Intersection &intersect, uint32_t &hit) const
+{
+    constexpr size_t W = triangle_block_width;
+
+    if (instance_leaves)
+    {
+        for (uint32_t i = start_surface; i < start_surface + num_surfaces; i++)
+        {
+            Intersection t_intersect;
+            if (ordered_surfaces[i]->intersect(ray, t_intersect) && t_intersect.t < intersect.t)
+            {
+                intersect = t_intersect;
+                hit = i;
+            }
+        }
+        return;
+    }
+
+    for (uint32_t b = start_surface / W; num_surfaces; b++)
+    {
+        uint32_t num_lanes = std::min(num_surfaces, (uint32_t)W);
+        num_surfaces -= num_lanes;
+
+        uint32_t mask = triangle_blocks[b].intersect(triangle_ray, roundUpDistance(intersect.t));
+        mask &= (uint32_t)((1ull << num_lanes) - 1);
+
+        while (mask)
+        {
+            uint32_t surface_idx = b * W + countTrailingZeros(mask);
+            mask &= mask - 1;
+
+            const auto *triangle = static_cast<const Surface::Triangle*>(ordered_surfaces[surface_idx].get());
+
+            Intersection t_intersect;
+            if (triangle->Surface::Triangle::intersect(ray, t_intersect) && t_intersect.t < intersect.t)
+            {
+                intersect.t = t_intersect.t;
+                intersect.uv = t_intersect.uv;
+                intersect.interpolate = t_intersect.interpolate;
+                intersect.instanced = nullptr;
+                hit = surface_idx;
+            }
+        }
+    }
+}
+
+BVH::TriangleRay::TriangleRay(const Ray &ray)
+{
+    origin_scale = 0.0f;
+    direction_scale = 0.0f;
+    for (int i = 0; i < 3; i++)
+    {
+        origin[i] = (float)ray.start[i];
+        direction[i] = (float)ray.direction[i];
+        origin_scale = std::max(origin_scale, std::abs(origin[i]));
+        direction_scale = std::max(direction_scale, std::abs(direction[i]));
+    }
+}
+
+BVH::TriangleBlock::TriangleBlock()
+{
+    for (size_t i = 0; i < W; i++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            v0[a][i] = E1[a][i] = E2[a][i] = 0.0f;
+        }
+        R[i] = L[i] = 0.0f;
+    }
+}
+
+/**************************************************************************
+Möller-Trumbore test of all lanes without divisions. The barycentric
+coordinates and the distance are compared scaled by the determinant, and 
+err bounds the rounding errors of the scaled coordinates. NaN comparisons
+are false, so degenerate lanes are kept as candidates.
+**************************************************************************/
+uint32_t BVH::TriangleBlock::intersect(const TriangleRay &r, float t_max) const
+{
+    constexpr float K = 128.0f * 0x1p-24f;
+    const float ray_err = K * r.direction_scale;
+
+#if defined(__AVX__)
+    if constexpr (W == 8)
+    {
+        __m256 d[3], T[3], e1[3], e2[3];
+        for (int a = 0; a < 3; a++)
+        {
+            d[a] = _mm256_set1_ps(r.direction[a]);
+            T[a] = _mm256_sub_ps(_mm256_set1_ps(r.origin[a]), _mm256_load_ps(v0[a]));
+            e1[a] = _mm256_load_ps(E1[a]);
+            e2[a] = _mm256_load_ps(E2[a]);
+        }
+
+        auto cross = [](const __m256 (&a)[3], const __m256 (&b)[3], __m256 (&c)[3])
+        {
+            c[0] = _mm256_sub_ps(_mm256_mul_ps(a[1], b[2]), _mm256_mul_ps(a[2], b[1]));
+            c[1] = _mm256_sub_ps(_mm256_mul_ps(a[2], b[0]), _mm256_mul_ps(a[0], b[2]));
+            c[2] = _mm256_sub_ps(_mm256_mul_ps(a[0], b[1]), _mm256_mul_ps(a[1], b[0]));
+        };
+
+        auto dot = [](const __m256 (&a)[3], const __m256 (&b)[3])
+        {
+            return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a[0], b[0]), _mm256_mul_ps(a[1], b[1])), _mm256_mul_ps(a[2], b[2]));
+        };
+
+        __m256 P[3], Q[3];
+        cross(d, e2, P);
+        cross(T, e1, Q);
+
+        const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+        __m256 det = dot(P, e1);
+        __m256 sign = _mm256_and_ps(det, sign_mask);
+        __m256 abs_det = _mm256_andnot_ps(sign_mask, det);
+
+        __m256 u = _mm256_xor_ps(dot(P, T), sign);
+        __m256 v = _mm256_xor_ps(dot(Q, d), sign);
+        __m256 t = _mm256_xor_ps(dot(Q, e2), sign);
+
+        __m256 l = _mm256_load_ps(L);
+        __m256 err = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(ray_err), l), _mm256_add_ps(_mm256_set1_ps(r.origin_scale), _mm256_load_ps(R)));
+        __m256 neg_err = _mm256_xor_ps(err, sign_mask);
+        __m256 tm = _mm256_set1_ps(t_max);
+
+        __m256 reject = _mm256_or_ps(_mm256_cmp_ps(u, neg_err, _CMP_LT_OQ), _mm256_cmp_ps(v, neg_err, _CMP_LT_OQ));
+        reject = _mm256_or_ps(reject, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_add_ps(abs_det, _mm256_add_ps(err, err)), _CMP_GT_OQ));
+        reject = _mm256_or_ps(reject, _mm256_cmp_ps(t, _mm256_mul_ps(neg_err, l), _CMP_LT_OQ));
+        reject = _mm256_or_ps(reject, _mm256_cmp_ps(t, _mm256_add_ps(_mm256_mul_ps(tm, abs_det), _mm256_mul_ps(err, _mm256_add_ps(l, tm))), _CMP_GT_OQ));
+
+        return ~(uint32_t)_mm256_movemask_ps(reject) & 0xFF;
+    }
+#endif
+    uint32_t mask = 0;
+    for (size_t i = 0; i < W; i++)
+    {
+        float T[3], P[3], Q[3];
+        for (int a = 0; a < 3; a++)
+        {
+            T[a] = r.origin[a] - v0[a][i];
+        }
+
+        P[0] = r.direction[1] * E2[2][i] - r.direction[2] * E2[1][i];
+        P[1] = r.direction[2] * E2[0][i] - r.direction[0] * E2[2][i];
+        P[2] = r.direction[0] * E2[1][i] - r.direction[1] * E2[0][i];
+
+        Q[0] = T[1] * E1[2][i] - T[2] * E1[1][i];
+        Q[1] = T[2] * E1[0][i] - T[0] * E1[2][i];
+        Q[2] = T[0] * E1[1][i] - T[1] * E1[0][i];
+
+        float det = P[0] * E1[0][i] + P[1] * E1[1][i] + P[2] * E1[2][i];
+        float u = P[0] * T[0] + P[1] * T[1] + P[2] * T[2];
+        float v = Q[0] * r.direction[0] + Q[1] * r.direction[1] + Q[2] * r.direction[2];
+        float t = Q[0] * E2[0][i] + Q[1] * E2[1][i] + Q[2] * E2[2][i];
+
+        if (std::signbit(det))
+        {
+            u = -u; v = -v; t = -t;
+        }
+        float abs_det = std::abs(det);
+        float err = ray_err * L[i] * (r.origin_scale + R[i]);
+
+        bool reject = u < -err || v < -err || u + v > abs_det + 2.0f * err || 
+                      t < -err * L[i] || t > t_max * abs_det + err * (L[i] + t_max);
+
+        if (!reject) mask |= 1u << i;
+    }
+    return mask;
+}
+
+/**************************************************************************
+Builds the BVH top-down from the octree subdivision of the node cube. Each
+node is split into its non-empty octants if it contains more than 
+leaf_surfaces centroids, which results in the same hierarchy as inserting
+the centroids one by one into an Octree.
+**************************************************************************/
+void BVH::recursiveBuildOctree(BuildNode *bvh_node, const BoundingBox &cube_BB)
+{
+    if (bvh_node->size() <= leaf_surfaces)
+    {
+        bvh_node->BB = BoundingBox();
+        for (uint32_t i = bvh_node->begin; i < bvh_node->end; i++)
+        {
+            bvh_node->BB.merge(build_surfaces[build_indices[i]]->BB());
+        }
+        return;
+    }
+
+    glm::dvec3 origin = cube_BB.centroid();
+    glm::dvec3 half_size = cube_BB.dimensions() / 2.0;
+
+    auto getOctant = [&](const glm::dvec3 &centroid)
+    {
+        uint8_t octant = 0;
+        for (uint8_t c = 0; c < 3; c++)
+        {
+            if (centroid[c] >= origin[c]) octant |= (0b100 >> c);
+        }
+        return octant;
+    };
+
+    partition(bvh_node, 8, getOctant);
+
+    // Empty octants are discarded, so the octant of a child is given by any of its surfaces
+    Parallel::TaskGroup tasks;
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
+    {
+        BuildNode *child = bvh_node->children + i;
+        uint8_t octant = getOctant(build_surfaces[build_indices[child->begin]]->BB().centroid());
+
+        glm::dvec3 new_origin = origin;
+        for (uint8_t c = 0; c < 3; c++)
+        {
+            new_origin[c] += half_size[c] * (octant & (0b100 >> c) ? 0.5 : -0.5);
+        }
+        BoundingBox child_cube(new_origin - half_size * 0.5, new_origin + half_size * 0.5);
+
+        if (child->size() >= task_size)
+        {
+            tasks.spawn([this, child, child_cube]() { recursiveBuildOctree(child, child_cube); });
+        }
+        else
+        {
+            recursiveBuildOctree(child, child_cube);
+        }
+    }
+    tasks.wait();
+
+    bvh_node->BB = BoundingBox();
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
+    {
+        bvh_node->BB.merge(bvh_node->children[i].BB);
+    }
+}
+
+void BVH::recursiveBuildBinarySAH(BuildNode *bvh_node)
+{
+    const uint32_t *S = build_indices.data() + bvh_node->begin;
+    size_t num_surfaces = bvh_node->size();
+
+    if (num_surfaces <= leaf_surfaces)
+    {
+        return;
+    }
+
+    BoundingBox centroid_extent = centroidExtent(bvh_node->begin, bvh_node->end);
+    glm::dvec3 extent_dims = centroid_extent.dimensions();
+
+    uint8_t split_axis = extent_dims.x > extent_dims.y ? 
+                        (extent_dims.x > extent_dims.z ? 0 : 2) : 
+                        (extent_dims.y > extent_dims.z ? 1 : 2);
+
+    if (extent_dims[split_axis] < C::EPSILON)
+    {
+        if (num_surfaces > max_leaf_surfaces)
+        {
+            arbitrarySplit(bvh_node, 2);
+            buildChildren(bvh_node, &BVH::recursiveBuildBinarySAH);
+        }
+        return;
+    }
+
+    auto getIdx = [&](const glm::dvec3 &centroid)
+    {
+        double f = (centroid[split_axis] - centroid_extent.min[split_axis]) / extent_dims[split_axis];
+        int idx = (int)glm::floor(f * bins_per_axis);
+        return glm::min(idx, bins_per_axis - 1);
+    };
+
+    // Bins are filled per chunk in parallel and then reduced, which gives the 
+    // same result as serial binning since counts and bounding boxes are merged.
+    std::vector<std::vector<std::pair<size_t, BoundingBox>>> chunk_bins(Parallel::numThreads());
+    Parallel::forChunks(num_surfaces, parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        auto &bins = chunk_bins[chunk];
+        bins.resize(bins_per_axis, { 0, BoundingBox() });
+        for (size_t i = begin; i < end; i++)
+        {
+            BoundingBox BB = build_surfaces[S[i]]->BB();
+            int idx = getIdx(BB.centroid());
+            bins[idx].first++;
+            bins[idx].second.merge(BB);
+        }
+    });
+
+    std::vector<std::pair<size_t, BoundingBox>> bins(bins_per_axis, { 0, BoundingBox() });
+    for (const auto &c_bins : chunk_bins)
+    {
+        for (size_t i = 0; i < c_bins.size(); i++)
+        {
+            bins[i].first += c_bins[i].first;
+            bins[i].second.merge(c_bins[i].second);
+        }
+    }
+
+    double min_cost = std::numeric_limits<double>::max();
+    size_t split_bin = 0;
+
+    for (size_t i = 0; i < bins_per_axis - 1; i++)
+    {
+        size_t A_count = 0;
+        BoundingBox A_BB;
+        for (size_t j = 0; j < i + 1; j++)
+        {
+            A_count += bins[j].first;
+            A_BB.merge(bins[j].second);
+        }
+
+        size_t B_count = 0;
+        BoundingBox B_BB;
+        for (size_t j = i + 1; j < bins_per_axis; j++)
+        {
+            B_count += bins[j].first;
+            B_BB.merge(bins[j].second);
+        }
+
+        double cost = 1.0 + (A_count * A_BB.area() + B_count * B_BB.area()) / bvh_node->BB.area();
+
+        if (cost < min_cost)
+        {
+            split_bin = i;
+            min_cost = cost;
+        }
+    }
+
+    if (min_cost > num_surfaces)
+    {
+        if (num_surfaces > max_leaf_surfaces)
+        {
+            arbitrarySplit(bvh_node, 2);
+            buildChildren(bvh_node, &BVH::recursiveBuildBinarySAH);
+        }
+        return;
+    }
+
+    partition(bvh_node, 2, [&](const glm::dvec3 &centroid)
+    {
+        return getIdx(centroid) <= split_bin ? 0 : 1;
+    });
+
+    buildChildren(bvh_node, &BVH::recursiveBuildBinarySAH);
+}
+
+void BVH::recursiveBuildQuaternarySAH(BuildNode *bvh_node)
+{
+    glm::ivec2 num_bins(bins_per_axis);
+
+    const uint32_t *S = build_indices.data() + bvh_node->begin;
+    size_t num_surfaces = bvh_node->size();
+
+    if (num_surfaces <= leaf_surfaces)
+    {
+        return;
+    }
+
+    BoundingBox centroid_extent = centroidExtent(bvh_node->begin, bvh_node->end);
+    glm::dvec3 extent_dims = centroid_extent.dimensions();
+
+    glm::ivec2 axes = extent_dims.x > extent_dims.y ?
+                     (extent_dims.y > extent_dims.z ? glm::ivec2(0, 1) : glm::ivec2(0, 2)) :
+                     (extent_dims.x > extent_dims.z ? glm::ivec2(0, 1) : glm::ivec2(1, 2));
+    
+    if (extent_dims[axes.x] < C::EPSILON || extent_dims[axes.y] < C::EPSILON)
+    {
+        recursiveBuildBinarySAH(bvh_node);
+        return;
+    }
+
+    glm::dvec2 axes_min(centroid_extent.min[axes.x], centroid_extent.min[axes.y]);
+    glm::dvec2 axes_dim(extent_dims[axes.x], extent_dims[axes.y]);
+
+    auto getIdx = [&](const glm::dvec3 &centroid)
+    {
+        glm::dvec2 f = (glm::dvec2(centroid[axes.x], centroid[axes.y]) - axes_min) / axes_dim;
+        glm::ivec2 idx = glm::floor(f * glm::dvec2(num_bins));
+        return glm::min(idx, num_bins - 1);
+    };
+
+    using Bins = std::vector<std::vector<std::pair<size_t, BoundingBox>>>;
+
+    std::vector<Bins> chunk_bins(Parallel::numThreads());
+    Parallel::forChunks(num_surfaces, parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        auto &bins = chunk_bins[chunk];
+        bins.resize(num_bins.x, std::vector<std::pair<size_t, BoundingBox>>(num_bins.y, { 0, BoundingBox() }));
+        for (size_t i = begin; i < end; i++)
+        {
+            BoundingBox BB = build_surfaces[S[i]]->BB();
+            glm::ivec2 idx = getIdx(BB.centroid());
+            bins[idx.x][idx.y].first++;
+            bins[idx.x][idx.y].second.merge(BB);
+        }
+    });
+
+    Bins bins(num_bins.x, std::vector<std::pair<size_t, BoundingBox>>(num_bins.y, { 0, BoundingBox() }));
+    for (const auto &c_bins : chunk_bins)
+    {
+        for (size_t x = 0; x < c_bins.size(); x++)
+        {
+            for (size_t y = 0; y < c_bins[x].size(); y++)
+            {
+                bins[x][y].first += c_bins[x][y].first;
+                bins[x][y].second.merge(c_bins[x][y].second);
+            }
+        }
+    }
+
+    double min_cost = std::numeric_limits<double>::max();
+    glm::ivec2 split_bin(0);
+
+    for (size_t i = 0; i < num_bins.x - 1; i++)
+    {
+        for (size_t j = 0; j < num_bins.y - 1; j++)
+        {
+            std::array<BoundingBox, 4> BBs;
+            std::array<size_t, 4> counts{};
+
+            for (uint8_t v = 0b00; v <= 0b11; v++)
+            {
+                glm::ivec2 range[2];
+                range[0] = v & 0b01 ? glm::ivec2(i + 1, num_bins.x) : glm::ivec2(0, i + 1);
+                range[1] = v & 0b10 ? glm::ivec2(j + 1, num_bins.y) : glm::ivec2(0, j + 1);
+
+                for (size_t x = range[0][0]; x < range[0][1]; x++)
+                {
+                    for (size_t y = range[1][0]; y < range[1][1]; y++)
+                    {
+                        counts[v] += bins[x][y].first;
+                        BBs[v].merge(bins[x][y].second);
+                    }
+                }
+            }
+
+            double cost = 0.0;
+            for (uint8_t v = 0b00; v <= 0b11; v++)
+            {
+                cost += BBs[v].area() * counts[v];
+            }
+
+            cost = 1.0 + cost / bvh_node->BB.area();
+
+            if (cost < min_cost)
+            {
+                split_bin = glm::ivec2(i, j);
+                min_cost = cost;
+            }
+        }
+    }
+
+    if (min_cost > num_surfaces)
+    {
+        if (num_surfaces > max_leaf_surfaces)
+        {
+            arbitrarySplit(bvh_node, 4);
+            buildChildren(bvh_node, &BVH::recursiveBuildQuaternarySAH);
+        }
+        return;
+    }
+
+    partition(bvh_node, 4, [&](const glm::dvec3 &centroid)
+    {
+        glm::ivec2 idx = getIdx(centroid);
+
+        uint8_t child_idx = 0b00;
+        if (idx.x > split_bin.x) child_idx |= 0b01;
+        if (idx.y > split_bin.y) child_idx |= 0b10;
+        return child_idx;
+    });
+
+    buildChildren(bvh_node, &BVH::recursiveBuildQuaternarySAH);
+}
+
+/**************************************************************************
+Builds a binary BVH with spatial splits (SBVH), see Stich et al. 2009. Both
+object splits and spatial splits are evaluated using binned SAH. Spatial 
+splits are only evaluated if the children of the best object split overlap,
+and references that straddle the split plane are then duplicated with their
+bounds clipped to each side. The number of duplicated references in the 
+subtree is capped by split_budget, and the remaining budget is distributed
+to the children in proportion to their number of references.
+**************************************************************************/
+void BVH::recursiveBuildSBVH(BuildNode *bvh_node, std::vector<Reference> refs, size_t split_budget)
+{
+    struct Extents
+    {
+        BoundingBox BB, centroid;
+    };
+
+    std::vector<Extents> chunk_extents(Parallel::numThreads());
+    Parallel::forChunks(refs.size(), parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            chunk_extents[chunk].BB.merge(refs[i].BB);
+            chunk_extents[chunk].centroid.merge(refs[i].BB.centroid());
+        }
+    });
+
+    BoundingBox centroid_extent;
+    bvh_node->BB = BoundingBox();
+    for (const auto &extents : chunk_extents)
+    {
+        bvh_node->BB.merge(extents.BB);
+        centroid_extent.merge(extents.centroid);
+    }
+
+    auto makeLeaf = [&]()
+    {
+        std::lock_guard<std::mutex> lock(build_mutex);
+        bvh_node->begin = (uint32_t)build_indices.size();
+        for (const auto &r : refs)
+        {
+            build_indices.push_back(r.surface);
+        }
+        bvh_node->end = (uint32_t)build_indices.size();
+    };
+
+    if (refs.size() <= leaf_surfaces)
+    {
+        makeLeaf();
+        return;
+    }
+
+    double node_area = bvh_node->BB.area();
+
+    // Finds the split with the lowest SAH-cost among the bins. Entries are counted to the left
+    // of the split and exits to the right, which are equal for object splits.
+    auto sweep = [&](const std::vector<std::pair<size_t, size_t>> &counts, const std::vector<BoundingBox> &BBs,
+                     size_t &split_bin, size_t &A_count, size_t &B_count, BoundingBox &A_BB, BoundingBox &B_BB)
+    {
+        std::vector<std::pair<size_t, BoundingBox>> B_bins(bins_per_axis);
+        for (int i = bins_per_axis - 1; i > 0; i--)
+        {
+            B_bins[i - 1] = B_bins[i];
+            B_bins[i - 1].first += counts[i].second;
+            B_bins[i - 1].second.merge(BBs[i]);
+        }
+
+        double min_cost = std::numeric_limits<double>::max();
+        size_t count = 0;
+        BoundingBox BB;
+        for (size_t i = 0; i < bins_per_axis - 1; i++)
+        {
+            count += counts[i].first;
+            BB.merge(BBs[i]);
+
+            double cost = 1.0 + (count * BB.area() + B_bins[i].first * B_bins[i].second.area()) / node_area;
+
+            if (cost < min_cost)
+            {
+                min_cost = cost;
+                split_bin = i;
+                A_count = count;
+                B_count = B_bins[i].first;
+                A_BB = BB;
+                B_BB = B_bins[i].second;
+            }
+        }
+        return min_cost;
+    };
+
+    // Object split
+    glm::dvec3 extent_dims = centroid_extent.dimensions();
+    uint8_t object_axis = extent_dims.x > extent_dims.y ? 
+                         (extent_dims.x > extent_dims.z ? 0 : 2) : 
+                         (extent_dims.y > extent_dims.z ? 1 : 2);
+
+    auto getObjectIdx = [&](const glm::dvec3 &centroid)
+    {
+        double f = (centroid[object_axis] - centroid_extent.min[object_axis]) / extent_dims[object_axis];
+        int idx = (int)glm::floor(f * bins_per_axis);
+        return glm::min(idx, bins_per_axis - 1);
+    };
+
+    double object_cost = std::numeric_limits<double>::max();
+    size_t object_bin = 0, A_count, B_count;
+    BoundingBox A_BB, B_BB;
+
+    if (extent_dims[object_axis] >= C::EPSILON)
+    {
+        std::vector<std::vector<std::pair<size_t, BoundingBox>>> chunk_bins(Parallel::numThreads());
+        Parallel::forChunks(refs.size(), parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+        {
+            auto &bins = chunk_bins[chunk];
+            bins.resize(bins_per_axis, { 0, BoundingBox() });
+            for (size_t i = begin; i < end; i++)
+            {
+                int idx = getObjectIdx(refs[i].BB.centroid());
+                bins[idx].first++;
+                bins[idx].second.merge(refs[i].BB);
+            }
+        });
+
+        std::vector<std::pair<size_t, size_t>> counts(bins_per_axis, { 0, 0 });
+        std::vector<BoundingBox> BBs(bins_per_axis);
+        for (const auto &c_bins : chunk_bins)
+        {
+            for (size_t i = 0; i < c_bins.size(); i++)
+            {
+                counts[i].first += c_bins[i].first;
+                counts[i].second += c_bins[i].first;
+                BBs[i].merge(c_bins[i].second);
+            }
+        }
+
+        object_cost = sweep(counts, BBs, object_bin, A_count, B_count, A_BB, B_BB);
+    }
+
+    // Spatial split
+    glm::dvec3 node_dims = bvh_node->BB.dimensions();
+    uint8_t spatial_axis = node_dims.x > node_dims.y ? 
+                          (node_dims.x > node_dims.z ? 0 : 2) : 
+                          (node_dims.y > node_dims.z ? 1 : 2);
+
+    double bin_size = node_dims[spatial_axis] / bins_per_axis;
+
+    auto getSpatialIdx = [&](double position)
+    {
+        int idx = (int)glm::floor((position - bvh_node->BB.min[spatial_axis]) / bin_size);
+        return glm::clamp(idx, 0, bins_per_axis - 1);
+    };
+
+    auto binPlane = [&](size_t bin)
+    {
+        return bvh_node->BB.min[spatial_axis] + (bin + 1) * bin_size;
+    };
+
+    double spatial_cost = std::numeric_limits<double>::max();
+    size_t spatial_bin = 0, A_spatial_count = 0, B_spatial_count = 0;
+    BoundingBox A_spatial_BB, B_spatial_BB;
+
+    BoundingBox overlap = A_BB;
+    overlap.clip(B_BB);
+
+    if (split_budget > 0 && bin_size >= C::EPSILON && overlap.area() / root_area > spatial_split_alpha)
+    {
+        struct SpatialBins
+        {
+            std::vector<std::pair<size_t, size_t>> counts; // entries, exits
+            std::vector<BoundingBox> BBs;
+        };
+
+        std::vector<SpatialBins> chunk_bins(Parallel::numThreads());
+        Parallel::forChunks(refs.size(), parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+        {
+            auto &bins = chunk_bins[chunk];
+            bins.counts.resize(bins_per_axis, { 0, 0 });
+            bins.BBs.resize(bins_per_axis);
+            for (size_t i = begin; i < end; i++)
+            {
+                const auto &r = refs[i];
+                int entry = getSpatialIdx(r.BB.min[spatial_axis]);
+                int exit = getSpatialIdx(r.BB.max[spatial_axis]);
+
+                // Clip the reference to each bin that it overlaps
+                BoundingBox remaining = r.BB, left, right;
+                for (int b = entry; b < exit; b++)
+                {
+                    build_surfaces[r.surface]->splitBB(spatial_axis, binPlane(b), remaining, left, right);
+                    bins.BBs[b].merge(left);
+                    remaining = right;
+                }
+                bins.BBs[exit].merge(remaining);
+                bins.counts[entry].first++;
+                bins.counts[exit].second++;
+            }
+        });
+
+        SpatialBins bins{ std::vector<std::pair<size_t, size_t>>(bins_per_axis, { 0, 0 }), std::vector<BoundingBox>(bins_per_axis) };
+        for (const auto &c_bins : chunk_bins)
+        {
+            for (size_t i = 0; i < c_bins.counts.size(); i++)
+            {
+                bins.counts[i].first += c_bins.counts[i].first;
+                bins.counts[i].second += c_bins.counts[i].second;
+                bins.BBs[i].merge(c_bins.BBs[i]);
+            }
+        }
+
+        spatial_cost = sweep(bins.counts, bins.BBs, spatial_bin, A_spatial_count, B_spatial_count, A_spatial_BB, B_spatial_BB);
+
+        if (A_spatial_count + B_spatial_count - refs.size() > split_budget)
+        {
+            spatial_cost = std::numeric_limits<double>::max();
+        }
+    }
+
+    double min_cost = std::min(object_cost, spatial_cost);
+
+    std::vector<Reference> A_refs, B_refs;
+
+    if (min_cost > refs.size())
+    {
+        if (refs.size() <= max_leaf_surfaces)
+        {
+            makeLeaf();
+            return;
+        }
+        A_refs.assign(refs.begin(), refs.begin() + refs.size() / 2);
+        B_refs.assign(refs.begin() + refs.size() / 2, refs.end());
+    }
+    else if (spatial_cost < object_cost)
+    {
+        double plane = binPlane(spatial_bin);
+
+        // References are only unsplit to a side if the other side keeps some references
+        size_t A_contained = 0, B_contained = 0;
+        for (const auto &r : refs)
+        {
+            if (getSpatialIdx(r.BB.max[spatial_axis]) <= (int)spatial_bin) A_contained++;
+            else if (getSpatialIdx(r.BB.min[spatial_axis]) > (int)spatial_bin) B_contained++;
+        }
+
+        for (auto &r : refs)
+        {
+            int entry = getSpatialIdx(r.BB.min[spatial_axis]);
+            int exit = getSpatialIdx(r.BB.max[spatial_axis]);
+
+            if (exit <= (int)spatial_bin)
+            {
+                A_refs.push_back(std::move(r));
+            }
+            else if (entry > (int)spatial_bin)
+            {
+                B_refs.push_back(std::move(r));
+            }
+            else
+            {
+                BoundingBox left, right;
+                build_surfaces[r.surface]->splitBB(spatial_axis, plane, r.BB, left, right);
+
+                // Reference unsplitting, keep the reference on one side if that is cheaper than duplicating it
+                BoundingBox A_merged = A_spatial_BB, B_merged = B_spatial_BB;
+                A_merged.merge(r.BB);
+                B_merged.merge(r.BB);
+
+                double split_cost = A_spatial_BB.area() * A_spatial_count + B_spatial_BB.area() * B_spatial_count;
+                double A_cost = A_merged.area() * A_spatial_count + B_spatial_BB.area() * (B_spatial_count - 1);
+                double B_cost = A_spatial_BB.area() * (A_spatial_count - 1) + B_merged.area() * B_spatial_count;
+
+                if (!right.valid() || (B_contained && A_cost < split_cost && A_cost <= B_cost))
+                {
+                    A_refs.push_back(std::move(r));
+                }
+                else if (!left.valid() || (A_contained && B_cost < split_cost))
+                {
+                    B_refs.push_back(std::move(r));
+                }
+                else
+                {
+                    A_refs.push_back({ r.surface, left });
+                    B_refs.push_back({ r.surface, right });
+                }
+            }
+        }
+    }
+    else
+    {
+        for (auto &r : refs)
+        {
+            if (getObjectIdx(r.BB.centroid()) <= object_bin)
+            {
+                A_refs.push_back(std::move(r));
+            }
+            else
+            {
+                B_refs.push_back(std::move(r));
+            }
+        }
+    }
+
+    // Guard against degenerate splits that would leave a child without references
+    if (A_refs.empty() || B_refs.empty())
+    {
+        std::vector<Reference> all = A_refs.empty() ? std::move(B_refs) : std::move(A_refs);
+        A_refs.assign(all.begin(), all.begin() + all.size() / 2);
+        B_refs.assign(all.begin() + all.size() / 2, all.end());
+    }
+
+    size_t num_refs = A_refs.size() + B_refs.size();
+    split_budget -= std::min(split_budget, num_refs - refs.size());
+    size_t A_budget = (size_t)((double)split_budget * A_refs.size() / num_refs);
+    size_t B_budget = split_budget - A_budget;
+
+    refs.clear();
+    refs.shrink_to_fit();
+
+    bvh_node->children = build_arena.allocate(2);
+    bvh_node->num_children = 2;
+    BuildNode *A = bvh_node->children, *B = bvh_node->children + 1;
+
+    Parallel::TaskGroup tasks;
+    if (A_refs.size() >= task_size)
+    {
+        tasks.spawn([this, A, A_refs = std::move(A_refs), A_budget]() mutable { recursiveBuildSBVH(A, std::move(A_refs), A_budget); });
+    }
+    else
+    {
+        recursiveBuildSBVH(A, std::move(A_refs), A_budget);
+    }
+    recursiveBuildSBVH(B, std::move(B_refs), B_budget);
+    tasks.wait();
+}
+
+/**************************************************************************
+Builds a linear BVH (LBVH), see Lauterbach et al. 2009. The surfaces are 
+sorted by the 63-bit Morton codes of their centroids using a parallel radix
+sort, after which each node is split where the highest Morton code bit that
+differs within its range changes from 0 to 1, which is found by binary 
+search. If hlbvh is set, the surfaces are first grouped into clusters that
+share the top lbvh_cluster_bits bits, i.e. lie in the same cell of a coarse
+grid. The subtree of each cluster is built from the Morton codes, and the 
+top levels are then built over the clusters using binned SAH, which is the
+HLBVH method of Pantaleoni and Luebke 2010.
+**************************************************************************/
+void BVH::buildLBVH(BuildNode *root, bool hlbvh)
+{
+    size_t N = root->size();
+    if (N == 0)
+    {
+        return;
+    }
+
+    BoundingBox centroid_extent = centroidExtent(root->begin, root->end);
+    uint32_t *S = build_indices.data() + root->begin;
+
+    struct MortonSurface
+    {
+        uint64_t code;
+        uint32_t idx;
+    };
+
+    std::vector<MortonSurface> morton(N);
+    Parallel::forChunks(N, parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            morton[i] = { Morton::encode(build_surfaces[S[i]]->BB().centroid(), centroid_extent), S[i] };
+        }
+    });
+
+    Parallel::radixSort(morton, 3 * Morton::axis_bits, parallel_binning_size, [](const MortonSurface &m) { return m.code; });
+
+    std::vector<uint64_t> codes(N);
+    Parallel::forChunks(N, parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            S[i] = morton[i].idx;
+            codes[i] = morton[i].code;
+        }
+    });
+    morton.clear();
+    morton.shrink_to_fit();
+
+    size_t offset = root->begin;
+    if (!hlbvh)
+    {
+        recursiveBuildLBVH(root, codes, offset, 0, N);
+        return;
+    }
+
+    size_t shift = 3 * Morton::axis_bits - lbvh_cluster_bits;
+    std::vector<Cluster> clusters;
+    for (size_t begin = 0, end = 1; begin < N; begin = end++)
+    {
+        while (end < N && (codes[end] >> shift) == (codes[begin] >> shift)) end++;
+        clusters.push_back({ build_arena.allocate(1), begin, end });
+    }
+
+    Parallel::TaskGroup tasks;
+    for (const auto &c : clusters)
+    {
+        if (c.end - c.begin >= task_size)
+        {
+            tasks.spawn([this, &codes, offset, c]() { recursiveBuildLBVH(c.node, codes, offset, c.begin, c.end); });
+        }
+        else
+        {
+            recursiveBuildLBVH(c.node, codes, offset, c.begin, c.end);
+        }
+    }
+    tasks.wait();
+
+    recursiveBuildUpperSAH(root, clusters, 0, clusters.size());
+}
+
+// The node range is [offset + begin, offset + end) of build_indices, and codes holds the codes of the range starting at offset
+void BVH::recursiveBuildLBVH(BuildNode *bvh_node, const std::vector<uint64_t> &codes, size_t offset, size_t begin, size_t end)
+{
+    bvh_node->begin = (uint32_t)(offset + begin);
+    bvh_node->end = (uint32_t)(offset + end);
+
+    if (end - begin <= leaf_surfaces)
+    {
+        for (uint32_t i = bvh_node->begin; i < bvh_node->end; i++)
+        {
+            bvh_node->BB.merge(build_surfaces[build_indices[i]]->BB());
+        }
+        return;
+    }
+
+    // The codes in the range share all bits above the highest differing bit. 
+    // Ranges of identical codes are split in the middle.
+    size_t split = (begin + end) / 2;
+    uint64_t diff = codes[begin] ^ codes[end - 1];
+    if (diff)
+    {
+        uint64_t bit = uint64_t(1) << highestSetBit(diff);
+        split = std::partition_point(codes.begin() + begin, codes.begin() + end, [bit](uint64_t code)
+        {
+            return !(code & bit);
+        }) - codes.begin();
+    }
+
+    bvh_node->children = build_arena.allocate(2);
+    bvh_node->num_children = 2;
+    BuildNode *A = bvh_node->children, *B = bvh_node->children + 1;
+
+    Parallel::TaskGroup tasks;
+    if (split - begin >= task_size)
+    {
+        tasks.spawn([this, A, &codes, offset, begin, split]() { recursiveBuildLBVH(A, codes, offset, begin, split); });
+    }
+    else
+    {
+        recursiveBuildLBVH(A, codes, offset, begin, split);
+    }
+    recursiveBuildLBVH(B, codes, offset, split, end);
+    tasks.wait();
+
+    bvh_node->BB = A->BB;
+    bvh_node->BB.merge(B->BB);
+}
+
+/**************************************************************************
+Builds the top levels of the HLBVH over the clusters in [begin, end) using 
+binned SAH, where the cluster subtrees become the leaves of the top levels.
+The clusters are binned by their bounding box centroids along the axis with
+the largest centroid extent, and each cluster is weighted by its number of 
+surfaces. Clusters that can't be separated by a bin are split in the middle.
+**************************************************************************/
+void BVH::recursiveBuildUpperSAH(BuildNode *bvh_node, std::vector<Cluster> &clusters, size_t begin, size_t end)
+{
+    if (end - begin == 1)
+    {
+        *bvh_node = *clusters[begin].node;
+        return;
+    }
+
+    BoundingBox centroid_extent;
+    for (size_t i = begin; i < end; i++)
+    {
+        bvh_node->BB.merge(clusters[i].node->BB);
+        centroid_extent.merge(clusters[i].node->BB.centroid());
+    }
+
+    glm::dvec3 extent_dims = centroid_extent.dimensions();
+    uint8_t split_axis = extent_dims.x > extent_dims.y ? 
+                        (extent_dims.x > extent_dims.z ? 0 : 2) : 
+                        (extent_dims.y > extent_dims.z ? 1 : 2);
+
+    auto getIdx = [&](const Cluster &c)
+    {
+        double f = (c.node->BB.centroid()[split_axis] - centroid_extent.min[split_axis]) / extent_dims[split_axis];
+        int idx = (int)glm::floor(f * bins_per_axis);
+        return glm::min(idx, bins_per_axis - 1);
+    };
+
+    size_t split = (begin + end) / 2;
+    if (extent_dims[split_axis] >= C::EPSILON)
+    {
+        struct Bin
+        {
+            size_t num_clusters = 0;
+            size_t num_surfaces = 0;
+            BoundingBox BB;
+        };
+
+        std::vector<Bin> bins(bins_per_axis);
+        for (size_t i = begin; i < end; i++)
+        {
+            auto &bin = bins[getIdx(clusters[i])];
+            bin.num_clusters++;
+            bin.num_surfaces += clusters[i].end - clusters[i].begin;
+            bin.BB.merge(clusters[i].node->BB);
+        }
+
+        // Surface area costs of the bins above each split, swept from the top
+        std::vector<double> B_costs(bins_per_axis, 0.0);
+        Bin B;
+        for (int i = bins_per_axis - 1; i > 0; i--)
+        {
+            B.num_surfaces += bins[i].num_surfaces;
+            B.BB.merge(bins[i].BB);
+            B_costs[i - 1] = B.num_surfaces * B.BB.area();
+        }
+
+        double min_cost = std::numeric_limits<double>::max();
+        int split_bin = -1;
+        Bin A;
+        for (int i = 0; i < bins_per_axis - 1; i++)
+        {
+            A.num_clusters += bins[i].num_clusters;
+            A.num_surfaces += bins[i].num_surfaces;
+            A.BB.merge(bins[i].BB);
+
+            if (A.num_clusters == 0 || A.num_clusters == end - begin) continue;
+
+            double cost = A.num_surfaces * A.BB.area() + B_costs[i];
+            if (cost < min_cost)
+            {
+                split_bin = i;
+                min_cost = cost;
+            }
+        }
+
+        if (split_bin >= 0)
+        {
+            split = std::partition(clusters.begin() + begin, clusters.begin() + end, [&](const Cluster &c)
+            {
+                return getIdx(c) <= split_bin;
+            }) - clusters.begin();
+        }
+    }
+
+    bvh_node->children = build_arena.allocate(2);
+    bvh_node->num_children = 2;
+    recursiveBuildUpperSAH(bvh_node->children, clusters, begin, split);
+    recursiveBuildUpperSAH(bvh_node->children + 1, clusters, split, end);
+}
+
+BoundingBox BVH::centroidExtent(size_t begin, size_t end) const
+{
+    const uint32_t *S = build_indices.data() + begin;
+
+    std::vector<BoundingBox> chunk_extents(Parallel::numThreads());
+    Parallel::forChunks(end - begin, parallel_binning_size, [&](size_t chunk, size_t chunk_begin, size_t chunk_end)
+    {
+        for (size_t i = chunk_begin; i < chunk_end; i++)
+        {
+            chunk_extents[chunk].merge(build_surfaces[S[i]]->BB().centroid());
+        }
+    });
+
+    BoundingBox centroid_extent;
+    for (const auto &extent : chunk_extents)
+    {
+        centroid_extent.merge(extent);
+    }
+    return centroid_extent;
+}
+
+/**************************************************************************
+Partitions the node range in place into up to N children based on the child
+index returned by getChild for each surface centroid. The surfaces of each 
+chunk are counted per child in parallel, and the chunks are then scattered 
+in parallel to build_scratch at offsets given by the prefix sum of the 
+counts, and copied back. The child indices are kept in build_child_indices
+between the passes. This keeps the surface order within each child, so the
+result is the same as a serial stable partition. Empty children are 
+discarded, and the remaining children are allocated together.
+**************************************************************************/
+template<class F>
+void BVH::partition(BuildNode *bvh_node, size_t N, F&& getChild)
+{
+    uint32_t *S = build_indices.data() + bvh_node->begin;
+    uint32_t *scratch = build_scratch.data() + bvh_node->begin;
+    uint8_t *child_indices = build_child_indices.data() + bvh_node->begin;
+    size_t num_surfaces = bvh_node->size();
+
+    struct Child
+    {
+        size_t count = 0; // offset after the counts are summed
+        BoundingBox BB;
+    };
+    using Children = std::array<Child, max_branching>;
 
-        double half_max = glm::compMax(root->BB.dimensions()) / 2.0;
-        BoundingBox cube_BB(root->BB.centroid() - half_max, root->BB.centroid() + half_max);
+    std::vector<Children> chunk_children(Parallel::numThreads());
+    Parallel::forChunks(num_surfaces, parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        auto &children = chunk_children[chunk];
+        for (size_t i = begin; i < end; i++)
+        {
+            BoundingBox BB = build_surfaces[S[i]]->BB();
+            child_indices[i] = (uint8_t)getChild(BB.centroid());
+            auto &child = children[child_indices[i]];
+            child.count++;
+            child.BB.merge(BB);
+        }
+    });
 
-        Octree<SurfaceCentroid> hierarchy(cube_BB, leaf_surfaces);
+    std::array<BuildNode, max_branching> children;
+    size_t offset = 0;
+    for (size_t i = 0; i < N; i++)
+    {
+        children[i].begin = (uint32_t)(bvh_node->begin + offset);
+        for (auto &c_children : chunk_children)
+        {
+            auto &c = c_children[i];
+            children[i].BB.merge(c.BB);
+            size_t count = c.count;
+            c.count = offset;
+            offset += count;
+        }
+        children[i].end = (uint32_t)(bvh_node->begin + offset);
+    }
 
-        for (const auto &s : surfaces)
+    Parallel::forChunks(num_surfaces, parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        auto &children = chunk_children[chunk];
+        for (size_t i = begin; i < end; i++)
         {
-            hierarchy.insert(SurfaceCentroid(s));
+            scratch[children[child_indices[i]].count++] = S[i];
         }
+    });
 
-        recursiveBuildFromOctree(hierarchy, root);
-    }
+    Parallel::forChunks(num_surfaces, parallel_binning_size, [&](size_t chunk, size_t begin, size_t end)
+    {
+        std::copy(scratch + begin, scratch + end, S + begin);
+    });
+
+    auto nonEmpty = [](const BuildNode &c) { return c.size() > 0; };
+    size_t num_children = std::count_if(children.begin(), children.begin() + N, nonEmpty);
+    bvh_node->children = build_arena.allocate(num_children);
+    bvh_node->num_children = (uint32_t)num_children;
+    std::copy_if(children.begin(), children.begin() + N, bvh_node->children, nonEmpty);
+}
 
-    size_t num_nodes = 1;
-    double num_branchings = 0.0;
-    for (const auto &b : branching)
+// Builds the subtrees of the node children, spawning tasks for large children.
+void BVH::buildChildren(BuildNode *bvh_node, void (BVH::*build)(BuildNode*))
+{
+    Parallel::TaskGroup tasks;
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
     {
-        num_branchings += b.second;
-        num_nodes += b.first * b.second;
+        BuildNode *child = bvh_node->children + i;
+        if (child->size() >= task_size)
+        {
+            tasks.spawn([this, build, child]() { (this->*build)(child); });
+        }
+        else
+        {
+            (this->*build)(child);
+        }
     }
+    tasks.wait();
+}
 
-    ordered_surfaces = std::vector<std::shared_ptr<Surface::Base>>(surfaces.size(), nullptr);
-
-    linear_tree = std::vector<LinearNode>(num_nodes, LinearNode());
+/**************************************************************************
+Assigns depth-first indices once the tree is built, which makes them 
+independent of the build order. Returns the stack size needed for the 
+ordered stack traversal of the subtree, which pushes all children of a 
+node before visiting them.
+**************************************************************************/
+size_t BVH::assignIndices(BuildNode *bvh_node)
+{
+    bvh_node->df_idx = df_idx++;
 
-    uint32_t surface_idx = 0;
-    compact(root, 0, surface_idx);
+    if (bvh_node->leaf())
+    {
+        num_references += bvh_node->size();
+        return 1;
+    }
 
-    auto end = std::chrono::high_resolution_clock::now();
-    size_t msec_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    branching[bvh_node->num_children]++;
 
-    std::cout << "BVH constructed in " + Format::timeDuration(msec_duration)
-              << ". Branching factor of tree: " << (num_nodes - 1) / num_branchings << std::endl;
+    size_t stack_size = 0;
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
+    {
+        stack_size = std::max(stack_size, assignIndices(bvh_node->children + i));
+    }
+    return stack_size + bvh_node->num_children - 1;
 }
 
-Intersection BVH::intersect(const Ray& ray) const
+// Returns the depth-first index of the last descendant of the node
+uint32_t BVH::compact(BuildNode *bvh_node)
 {
-    thread_local AccessiblePQ<LinearNode::NodeIntersection> to_visit; to_visit.clear();
+    auto &node = linear_tree[bvh_node->df_idx];
 
-    Intersection intersect;
-    double t;
-    if (linear_tree[0].BB.intersect(ray, t))
+    setBounds(node.bounds, bvh_node->BB);
+    node.num_surfaces = bvh_node->leaf() ? (uint8_t)bvh_node->size() : 0;
+
+    if (bvh_node->leaf())
     {
-        uint32_t node_idx = 0;
-        while (true)
-        {
-            const auto &node = linear_tree[node_idx];
-            if (node.num_surfaces)
-            {
-                uint32_t end_idx = node.start_surface + node.num_surfaces;
-                for (uint32_t i = node.start_surface; i < end_idx; i++)
-                {
-                    Intersection t_intersect;
-                    if (ordered_surfaces[i]->intersect(ray, t_intersect))
-                    {
-                        if (t_intersect.t < intersect.t)
-                        {
-                            intersect = t_intersect;
-                            intersect.surface = ordered_surfaces[i];
-                        }
-                    }
-                }
-            }
-            else
-            {
-                uint32_t child_idx = node_idx + 1;
-                while (child_idx != 0)
-                {
-                    if (linear_tree[child_idx].BB.intersect(ray, t) && t < intersect.t)
-                    {
-                        to_visit.push({ t, child_idx });
-                    }
-                    child_idx = linear_tree[child_idx].next_sibling;
-                }
-            }
-            if (to_visit.empty() || to_visit.top().t >= intersect.t)
-            {
-                break;
-            }
-            node_idx = to_visit.top().node; 
-            to_visit.pop();
-        }
+        node.start_surface = packLeaf(bvh_node);
+        return bvh_node->df_idx;
     }
-    return intersect;
+
+    uint32_t last_descendant = bvh_node->df_idx;
+    for (uint32_t i = 0; i < bvh_node->num_children; i++)
+    {
+        last_descendant = compact(bvh_node->children + i);
+    }
+    node.last_descendant = last_descendant;
+    return last_descendant;
 }
 
-void BVH::recursiveBuildFromOctree(const Octree<SurfaceCentroid> &octree_node, std::shared_ptr<BuildNode> bvh_node)
+/**************************************************************************
+Packs the leaf triangles into new triangle blocks and returns the index of
+the first leaf surface, which is always the first lane of a block. Leaf 
+instances are not packed and are only appended to the ordered surfaces.
+**************************************************************************/
+uint32_t BVH::packLeaf(BuildNode *bvh_node)
 {
-    bvh_node->df_idx = df_idx++;
+    constexpr size_t W = triangle_block_width;
 
-    BoundingBox BB;
+    uint32_t start_surface = (uint32_t)ordered_surfaces.size();
+    const uint32_t *S = build_indices.data() + bvh_node->begin;
+    size_t num_surfaces = bvh_node->size();
 
-    if (octree_node.leaf())
+    if (instance_leaves)
     {
-        bvh_node->surfaces.resize(octree_node.data_vec.size());
-        for (size_t i = 0; i < bvh_node->surfaces.size(); i++)
+        for (size_t i = 0; i < num_surfaces; i++)
         {
-            bvh_node->surfaces[i] = octree_node.data_vec[i].surface;
-            BB.merge(bvh_node->surfaces[i]->BB());
+            ordered_surfaces.push_back(build_surfaces[S[i]]);
         }
+        return start_surface;
     }
-    else
+
+    for (size_t i = 0; i < num_surfaces; i += W)
     {
-        size_t num_children = 0;
-        for (size_t i = 0; i < octree_node.octants.size(); i++)
+        TriangleBlock block;
+        for (size_t lane = 0; lane < W && i + lane < num_surfaces; lane++)
         {
-            if (!(octree_node.octants[i]->leaf() && octree_node.octants[i]->data_vec.empty()))
+            const auto *triangle = static_cast<const Surface::Triangle*>(build_surfaces[S[i + lane]].get());
+
+            glm::dvec3 v[3] = { triangle->vertex0(), triangle->vertex0() + triangle->edge1(), triangle->vertex0() + triangle->edge2() };
+            glm::dvec3 E1 = triangle->edge1(), E2 = triangle->edge2();
+            for (int a = 0; a < 3; a++)
             {
-                num_children++;
-                std::shared_ptr<BuildNode> child = std::make_shared<BuildNode>();
-                bvh_node->children.push_back(child);
-                recursiveBuildFromOctree(*octree_node.octants[i], child);
-                BB.merge(child->BB);
+                block.v0[a][lane] = (float)v[0][a];
+                block.E1[a][lane] = (float)E1[a];
+                block.E2[a][lane] = (float)E2[a];
             }
+            block.R[lane] = (float)glm::max(glm::compMax(glm::abs(v[0])), glm::max(glm::compMax(glm::abs(v[1])), glm::compMax(glm::abs(v[2]))));
+            block.L[lane] = (float)glm::max(glm::compMax(glm::abs(E1)), glm::compMax(glm::abs(E2)));
+        }
+        triangle_blocks.push_back(block);
+
+        for (size_t lane = 0; lane < W; lane++)
+        {
+            ordered_surfaces.push_back(i + lane < num_surfaces ? build_surfaces[S[i + lane]] : nullptr);
         }
-        branching[num_children]++;
     }
-    bvh_node->BB = BB;
+    return start_surface;
 }
 
-void BVH::recursiveBuildBinarySAH(std::shared_ptr<BuildNode> bvh_node)
+// Moves surface i of the node to child i % N, which keeps the surface order within each child
+void BVH::arbitrarySplit(BuildNode *bvh_node, size_t N)
 {
-    bvh_node->df_idx = df_idx++;
+    uint32_t *S = build_indices.data() + bvh_node->begin;
+    uint32_t *scratch = build_scratch.data() + bvh_node->begin;
+    size_t num_surfaces = bvh_node->size();
 
-    auto &S = bvh_node->surfaces;
+    N = std::min(N, num_surfaces);
 
-    if (S.size() <= leaf_surfaces)
-    {
-        return;
-    }
+    bvh_node->children = build_arena.allocate(N);
+    bvh_node->num_children = (uint32_t)N;
 
-    BoundingBox centroid_extent;
-    for (const auto &s : S)
+    size_t offset = 0;
+    for (size_t c = 0; c < N; c++)
     {
-        centroid_extent.merge(s->BB().centroid());
+        BuildNode &child = bvh_node->children[c];
+        child.begin = (uint32_t)(bvh_node->begin + offset);
+        for (size_t i = c; i < num_surfaces; i += N)
+        {
+            scratch[offset++] = S[i];
+            child.BB.merge(build_surfaces[S[i]]->BB());
+        }
+        child.end = (uint32_t)(bvh_node->begin + offset);
     }
-    glm::dvec3 extent_dims = centroid_extent.dimensions();
 
-    uint8_t split_axis = extent_dims.x > extent_dims.y ? 
-                        (extent_dims.x > extent_dims.z ? 0 : 2) : 
-                        (extent_dims.y > extent_dims.z ? 1 : 2);
+    std::copy(scratch, scratch + num_surfaces, S);
+}
 
-    if (extent_dims[split_axis] < C::EPSILON)
+/**************************************************************************
+Collapses the build tree into W-wide nodes. The largest inner children are 
+repeatedly replaced by their own children until the node is filled, and the 
+resulting children are stored as SoA lanes in a single wide node.
+**************************************************************************/
+template<size_t W>
+uint32_t BVH::collapse(BuildNode *bvh_node, std::vector<WideNode<W>> &wide_tree, size_t depth)
+{
+    wide_depth = std::max(wide_depth, depth);
+
+    std::vector<BuildNode*> children;
+    if (bvh_node->leaf())
+    {
+        children.push_back(bvh_node);
+    }
+    else
     {
-        if (S.size() > max_leaf_surfaces)
+        for (uint32_t i = 0; i < bvh_node->num_children; i++)
         {
-            arbitrarySplit(bvh_node, 2);
-            for (const auto& child : bvh_node->children) recursiveBuildBinarySAH(child);
+            children.push_back(bvh_node->children + i);
         }
-        return;
     }
 
-    auto getIdx = [&](const glm::dvec3 &centroid)
-    {
-        double f = (centroid[split_axis] - centroid_extent.min[split_axis]) / extent_dims[split_axis];
-        int idx = (int)glm::floor(f * bins_per_axis);
-        return glm::min(idx, bins_per_axis - 1);
-    };
-
-    std::vector<std::pair<size_t, BoundingBox>> bins(bins_per_axis, { 0, BoundingBox() });
-    for (const auto &s : S)
+    // Children of nodes with a larger branching factor than W are grouped into intermediate 
+    // nodes, which refer to contiguous runs of the children
+    std::array<BuildNode, W> groups;
+    if (children.size() > W)
     {
-        int idx = getIdx(s->BB().centroid());
-        bins[idx].first++;
-        bins[idx].second.merge(s->BB());
+        size_t group_size = (children.size() + W - 1) / W;
+        std::vector<BuildNode*> grouped;
+        for (size_t i = 0; i < children.size(); i += group_size)
+        {
+            BuildNode &group = groups[grouped.size()];
+            group.children = children[i];
+            group.num_children = (uint32_t)std::min(group_size, children.size() - i);
+            for (uint32_t c = 0; c < group.num_children; c++)
+            {
+                group.BB.merge(group.children[c].BB);
+            }
+            grouped.push_back(group.num_children > 1 ? &group : group.children);
+        }
+        children = grouped;
     }
 
-    std::shared_ptr<BuildNode> A = std::make_shared<BuildNode>();
-    std::shared_ptr<BuildNode> B = std::make_shared<BuildNode>();
-
-    double min_cost = std::numeric_limits<double>::max();
-    size_t split_bin = 0;
-
-    for (size_t i = 0; i < bins_per_axis - 1; i++)
+    while (true)
     {
-        size_t A_count = 0;
-        BoundingBox A_BB;
-        for (size_t j = 0; j < i + 1; j++)
+        size_t pull_up = children.size();
+        double max_area = -1.0;
+        for (size_t i = 0; i < children.size(); i++)
         {
-            A_count += bins[j].first;
-            A_BB.merge(bins[j].second);
+            const auto &c = children[i];
+            if (!c->leaf() && children.size() + c->num_children - 1 <= W && c->BB.area() > max_area)
+            {
+                pull_up = i;
+                max_area = c->BB.area();
+            }
         }
 
-        size_t B_count = 0;
-        BoundingBox B_BB;
-        for (size_t j = i + 1; j < bins_per_axis; j++)
+        if (pull_up == children.size())
         {
-            B_count += bins[j].first;
-            B_BB.merge(bins[j].second);
+            break;
         }
 
-        double cost = 1.0 + (A_count * A_BB.area() + B_count * B_BB.area()) / bvh_node->BB.area();
-
-        if (cost < min_cost)
+        BuildNode *c = children[pull_up];
+        children.erase(children.begin() + pull_up);
+        for (uint32_t i = 0; i < c->num_children; i++)
         {
-            split_bin = i;
-            min_cost = cost;
+            children.insert(children.begin() + pull_up + i, c->children + i);
         }
     }
 
-    if (min_cost > S.size())
+    uint32_t node_idx = (uint32_t)wide_tree.size();
+    wide_tree.emplace_back();
+
+    for (size_t i = 0; i < children.size(); i++)
     {
-        if (S.size() > max_leaf_surfaces)
+        const auto &c = children[i];
+        for (int a = 0; a < 3; a++)
         {
-            arbitrarySplit(bvh_node, 2);
-            for (const auto& child : bvh_node->children) recursiveBuildBinarySAH(child);
+            wide_tree[node_idx].bounds[a][i] = roundDown(c->BB.min[a]);
+            wide_tree[node_idx].bounds[a + 3][i] = roundUp(c->BB.max[a]);
         }
-        return;
-    }
 
-    for (const auto &s : S)
-    {
-        int idx = getIdx(s->BB().centroid());
-        if (idx <= split_bin)
+        if (c->leaf())
         {
-            A->surfaces.push_back(s);
-            A->BB.merge(s->BB());
+            wide_tree[node_idx].child[i] = packLeaf(c);
+            wide_tree[node_idx].num_surfaces[i] = (uint8_t)c->size();
         }
         else
         {
-            B->surfaces.push_back(s);
-            B->BB.merge(s->BB());
+            uint32_t child_idx = collapse(c, wide_tree, depth + 1);
+            wide_tree[node_idx].child[i] = child_idx;
         }
     }
 
-    S.clear();
-   
-    size_t num_children = 0;
-
-    if (!A->surfaces.empty())
-    {
-        num_children++;
-        bvh_node->children.push_back(A);
-        recursiveBuildBinarySAH(A);
-    }
-    if (!B->surfaces.empty())
-    {
-        num_children++;
-        bvh_node->children.push_back(B);
-        recursiveBuildBinarySAH(B);
-    }
-
-    branching[num_children]++;
+    return node_idx;
 }
 
-void BVH::recursiveBuildQuaternarySAH(std::shared_ptr<BuildNode> bvh_node)
+namespace
 {
-    bvh_node->df_idx = df_idx++;
-
-    glm::ivec2 num_bins(bins_per_axis);
-
-    auto &S = bvh_node->surfaces;
-
-    if (S.size() <= leaf_surfaces)
+    // Surface area of the box of a lane of a wide node, 0 for unused lanes
+    template<size_t W>
+    double laneArea(const float (&bounds)[6][W], size_t lane)
     {
-        return;
-    }
+        if (bounds[0][lane] > bounds[3][lane]) return 0.0;
 
-    BoundingBox centroid_extent;
-    for (const auto &s : S)
-    {
-        centroid_extent.merge(s->BB().centroid());
+        glm::dvec3 d(bounds[3][lane] - bounds[0][lane], bounds[4][lane] - bounds[1][lane], bounds[5][lane] - bounds[2][lane]);
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
     }
-    glm::dvec3 extent_dims = centroid_extent.dimensions();
+}
 
-    glm::ivec2 axes = extent_dims.x > extent_dims.y ?
-                     (extent_dims.y > extent_dims.z ? glm::ivec2(0, 1) : glm::ivec2(0, 2)) :
-                     (extent_dims.x > extent_dims.z ? glm::ivec2(0, 1) : glm::ivec2(1, 2));
-    
-    if (extent_dims[axes.x] < C::EPSILON || extent_dims[axes.y] < C::EPSILON)
+/**************************************************************************
+Reorders the wide nodes according to node_layout, keeping the root first, 
+and remaps the child indices. The depth-first order of collapse is kept for
+DEPTH_FIRST.
+
+In van Emde Boas order, the tree is recursively split at half its height, 
+and the top tree is stored before the bottom trees. Subtrees of any height 
+then occupy few contiguous blocks, whatever the cache line or page size.
+
+In treelet order, the nodes are grouped into treelets that fill a page.
+Each treelet is grown from its root by adding the child of the treelet with
+the largest surface area, i.e. the node that a random ray that reaches the 
+treelet is most likely to visit. The children left outside become the roots
+of later treelets, which are laid out breadth-first, so the top levels of 
+the tree are stored together.
+**************************************************************************/
+template<size_t W>
+void BVH::reorder(std::vector<WideNode<W>> &wide_tree) const
+{
+    if (node_layout == DEPTH_FIRST || wide_tree.empty())
     {
-        df_idx--;
-        recursiveBuildBinarySAH(bvh_node);
         return;
     }
 
-    glm::dvec2 axes_min(centroid_extent.min[axes.x], centroid_extent.min[axes.y]);
-    glm::dvec2 axes_dim(extent_dims[axes.x], extent_dims[axes.y]);
-
-    auto getIdx = [&](const glm::dvec3 &centroid)
-    {
-        glm::dvec2 f = (glm::dvec2(centroid[axes.x], centroid[axes.y]) - axes_min) / axes_dim;
-        glm::ivec2 idx = glm::floor(f * glm::dvec2(num_bins));
-        return glm::min(idx, num_bins - 1);
-    };
-
-    std::vector<std::vector<std::pair<size_t, BoundingBox>>> bins(num_bins.x,
-        std::vector<std::pair<size_t, BoundingBox>>(num_bins.y, { 0, BoundingBox() })
-    );
+    std::vector<uint32_t> order;
+    order.reserve(wide_tree.size());
 
-    for (const auto &s : S)
+    if (node_layout == VAN_EMDE_BOAS)
     {
-        glm::ivec2 idx = getIdx(s->BB().centroid());
-        bins[idx.x][idx.y].first++;
-        bins[idx.x][idx.y].second.merge(s->BB());
+        std::vector<uint32_t> cut;
+        vanEmdeBoasOrder(wide_tree, 0, wide_depth, order, cut);
     }
+    else // TREELET
+    {
+        // The nodes are reordered before they are quantized
+        size_t node_size = quantized ? sizeof(QuantizedWideNode<W>) : sizeof(WideNode<W>);
+        size_t treelet_size = std::max(page_size / node_size, size_t(1));
 
-    double min_cost = std::numeric_limits<double>::max();
-    glm::ivec2 split_bin(0);
+        std::queue<uint32_t> roots;
+        roots.push(0);
 
-    for (size_t i = 0; i < num_bins.x - 1; i++)
-    {
-        for (size_t j = 0; j < num_bins.y - 1; j++)
+        // Max-heap of the children of the treelet by area
+        std::vector<std::pair<double, uint32_t>> frontier;
+        while (!roots.empty())
         {
-            std::vector<BoundingBox> BBs(4, BoundingBox());
-            std::vector<size_t> counts(4, 0);
+            frontier.assign(1, { 0.0, roots.front() });
+            roots.pop();
 
-            for (uint8_t v = 0b00; v <= 0b11; v++)
+            for (size_t i = 0; i < treelet_size && !frontier.empty(); i++)
             {
-                std::vector<glm::ivec2> range(2, glm::ivec2(0));
-                range[0] = v & 0b01 ? glm::ivec2(i + 1, num_bins.x) : glm::ivec2(0, i + 1);
-                range[1] = v & 0b10 ? glm::ivec2(j + 1, num_bins.y) : glm::ivec2(0, j + 1);
+                std::pop_heap(frontier.begin(), frontier.end());
+                uint32_t node_idx = frontier.back().second;
+                frontier.pop_back();
+                order.push_back(node_idx);
 
-                for (size_t x = range[0][0]; x < range[0][1]; x++)
+                const auto &node = wide_tree[node_idx];
+                for (size_t lane = 0; lane < W; lane++)
                 {
-                    for (size_t y = range[1][0]; y < range[1][1]; y++)
-                    {
-                        counts[v] += bins[x][y].first;
-                        BBs[v].merge(bins[x][y].second);
-                    }
+                    if (node.num_surfaces[lane] || !node.child[lane]) continue;
+                    frontier.emplace_back(laneArea(node.bounds, lane), node.child[lane]);
+                    std::push_heap(frontier.begin(), frontier.end());
                 }
             }
 
-            double cost = 0.0;
-            for (uint8_t v = 0b00; v <= 0b11; v++)
+            std::sort(frontier.rbegin(), frontier.rend());
+            for (const auto &f : frontier)
             {
-                cost += BBs[v].area() * counts[v];
+                roots.push(f.second);
             }
+        }
+    }
 
-            cost = 1.0 + cost / bvh_node->BB.area();
+    std::vector<uint32_t> new_idx(wide_tree.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        new_idx[order[i]] = (uint32_t)i;
+    }
 
-            if (cost < min_cost)
-            {
-                split_bin = glm::ivec2(i, j);
-                min_cost = cost;
-            }
+    std::vector<WideNode<W>> reordered(wide_tree.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        auto &node = reordered[i];
+        node = wide_tree[order[i]];
+        for (size_t lane = 0; lane < W; lane++)
+        {
+            if (node.num_surfaces[lane] || !node.child[lane]) continue;
+            node.child[lane] = new_idx[node.child[lane]];
         }
     }
+    wide_tree.swap(reordered);
+}
+
+template<size_t W>
+void BVH::vanEmdeBoasOrder(const std::vector<WideNode<W>> &wide_tree, uint32_t node_idx, size_t height, 
+                           std::vector<uint32_t> &order, std::vector<uint32_t> &cut)
+{
+    const auto &node = wide_tree[node_idx];
 
-    if (min_cost > S.size())
+    if (height <= 1)
     {
-        if (S.size() > max_leaf_surfaces)
+        order.push_back(node_idx);
+        for (size_t lane = 0; lane < W; lane++)
         {
-            arbitrarySplit(bvh_node, 4);
-            for (const auto& child : bvh_node->children) recursiveBuildQuaternarySAH(child);
+            if (node.num_surfaces[lane] || !node.child[lane]) continue;
+            cut.push_back(node.child[lane]);
         }
         return;
     }
 
-    std::vector<std::shared_ptr<BuildNode>> new_nodes(4, nullptr);
-
-    for (const auto &s : S)
+    size_t top_height = height / 2;
+    std::vector<uint32_t> bottom_roots;
+    vanEmdeBoasOrder(wide_tree, node_idx, top_height, order, bottom_roots);
+    for (uint32_t root : bottom_roots)
     {
-        glm::ivec2 idx = getIdx(s->BB().centroid());
+        vanEmdeBoasOrder(wide_tree, root, height - top_height, order, cut);
+    }
+}
 
-        uint8_t child_idx = 0b00;
-        if (idx.x > split_bin.x) child_idx |= 0b01;
-        if (idx.y > split_bin.y) child_idx |= 0b10;
+/**************************************************************************
+Prints how well the node layout keeps the traversal within pages. Parents 
+are stored before their children in all layouts, so the number of pages on
+the path from the root to each node is found in a single pass. Random rays 
+that intersect the root visit each node with a probability of its area 
+relative to the root area, so the sum of these probabilities over the nodes
+that are stored in another page than their parent is the expected number 
+of page crossings per ray.
+**************************************************************************/
+template<class Node>
+void BVH::printLayoutStats(const std::vector<Node> &wide_tree) const
+{
+    constexpr size_t W = Node::num_lanes;
+    constexpr size_t nodes_per_page = std::max(page_size / sizeof(Node), size_t(1));
 
-        if (!new_nodes[child_idx])
-        {
-            new_nodes[child_idx] = std::make_shared<BuildNode>();
-        }
+    alignas(32) LaneBounds<W> decoded;
 
-        new_nodes[child_idx]->surfaces.push_back(s);
-        new_nodes[child_idx]->BB.merge(s->BB());
+    const auto &root_bounds = childBounds(wide_tree.front(), decoded);
+    BoundingBox root_BB;
+    for (size_t lane = 0; lane < W; lane++)
+    {
+        if (root_bounds[0][lane] > root_bounds[3][lane]) continue;
+        root_BB.merge(glm::dvec3(root_bounds[0][lane], root_bounds[1][lane], root_bounds[2][lane]));
+        root_BB.merge(glm::dvec3(root_bounds[3][lane], root_bounds[4][lane], root_bounds[5][lane]));
     }
+    double root_area = root_BB.area();
 
-    S.clear();
-
-    size_t num_children = 0;
-    for (const auto &child : new_nodes)
+    std::vector<uint32_t> path_pages(wide_tree.size(), 1);
+    size_t num_links = 0, num_page_links = 0, num_leaves = 0, leaf_path_pages = 0;
+    double crossings = 0.0;
+    for (size_t i = 0; i < wide_tree.size(); i++)
     {
-        if (child)
+        const auto &node = wide_tree[i];
+        const auto &bounds = childBounds(node, decoded);
+        for (size_t lane = 0; lane < W; lane++)
         {
-            num_children++;
-            bvh_node->children.push_back(child);
-            recursiveBuildQuaternarySAH(child);
+            if (node.num_surfaces[lane])
+            {
+                num_leaves++;
+                leaf_path_pages += path_pages[i];
+                continue;
+            }
+            if (!node.child[lane]) continue;
+
+            bool same_page = i / nodes_per_page == node.child[lane] / nodes_per_page;
+            path_pages[node.child[lane]] = path_pages[i] + !same_page;
+            num_links++;
+            num_page_links += same_page;
+            if (!same_page && root_area > 0.0) crossings += laneArea(bounds, lane) / root_area;
         }
     }
-    branching[num_children]++;
+
+    const char *names[] = { "depth-first", "van Emde Boas", "treelet" };
+    std::cout << "\nNode layout: " << names[node_layout] << ", " << nodes_per_page << " nodes per " << page_size / 1024 << " KB page. "
+              << "Child links within a page: " << 100.0 * num_page_links / std::max(num_links, size_t(1)) << "%. "
+              << "Pages per root-to-leaf path: " << (double)leaf_path_pages / std::max(num_leaves, size_t(1)) << ". "
+              << "Expected page crossings per ray: " << crossings << ".\n";
 }
 
-void BVH::compact(std::shared_ptr<BuildNode> bvh_node, uint32_t next_sibling, uint32_t &surface_idx)
+namespace
 {
-    linear_tree[bvh_node->df_idx].BB = bvh_node->BB;
-    linear_tree[bvh_node->df_idx].next_sibling = next_sibling;
-    linear_tree[bvh_node->df_idx].start_surface = surface_idx;
-    linear_tree[bvh_node->df_idx].num_surfaces = (uint8_t)bvh_node->surfaces.size();
-
-    for (const auto &surface : bvh_node->surfaces)
+    // 2^e for exponents of normal floats
+    float exp2i(int e)
     {
-        ordered_surfaces[surface_idx] = surface;
-        surface_idx++;
+        uint32_t bits = (uint32_t)(e + 127) << 23;
+        float f;
+        std::memcpy(&f, &bits, sizeof(float));
+        return f;
     }
+}
 
-    if (!bvh_node->children.empty())
+template<size_t W>
+BVH::QuantizedWideNode<W>::QuantizedWideNode(const WideNode<W> &node)
+{
+    for (int a = 0; a < 3; a++)
     {
-        for (size_t i = 0; i < bvh_node->children.size() - 1; i++)
+        float lo = std::numeric_limits<float>::infinity();
+        float hi = -std::numeric_limits<float>::infinity();
+        for (size_t i = 0; i < W; i++)
         {
-            compact(bvh_node->children[i], bvh_node->children[i + 1]->df_idx, surface_idx);
+            if (node.bounds[a][i] > node.bounds[a + 3][i]) continue;
+            lo = std::min(lo, node.bounds[a][i]);
+            hi = std::max(hi, node.bounds[a + 3][i]);
         }
-        compact(bvh_node->children.back(), 0, surface_idx);
-    }
-}
+        if (lo > hi) lo = hi = 0.0f;
 
-void BVH::arbitrarySplit(std::shared_ptr<BuildNode> bvh_node, size_t N)
-{
-    auto& S = bvh_node->surfaces;
+        origin[a] = lo;
 
-    N = std::min(N, S.size());
+        // Smallest power of two step such that the 255 steps cover the node. The steps 
+        // also have to be large enough for unused lanes to be decoded as inverted bounds.
+        int e;
+        std::frexp((double(hi) - double(lo)) / 255.0, &e);
+        e = std::clamp(e, -100, 119);
+        auto decode = [&](uint32_t q) { return origin[a] + (float)q * exp2i(e); };
+        while (e < 119 && (decode(255) < hi || decode(255) == origin[a])) e++;
+        exponent[a] = (int8_t)e;
 
-    for (int i = 0; i < N; i++)
-    {
-        bvh_node->children.push_back(std::make_shared<BuildNode>());
+        double step = exp2i(e);
+        for (size_t i = 0; i < W; i++)
+        {
+            float min = node.bounds[a][i], max = node.bounds[a + 3][i];
+            if (min > max)
+            {
+                bounds[a][i] = 255;
+                bounds[a + 3][i] = 0;
+                continue;
+            }
+
+            // Rounded outwards, and adjusted since the decoded sum is rounded to the nearest float
+            uint32_t q_min = (uint32_t)std::clamp(std::floor((double(min) - lo) / step), 0.0, 255.0);
+            uint32_t q_max = (uint32_t)std::clamp(std::ceil((double(max) - lo) / step), 0.0, 255.0);
+            while (q_min > 0 && decode(q_min) > min) q_min--;
+            while (q_max < 255 && decode(q_max) < max) q_max++;
+
+            bounds[a][i] = (uint8_t)q_min;
+            bounds[a + 3][i] = (uint8_t)q_max;
+        }
     }
 
-    for (size_t i = 0; i < S.size(); i++)
+    for (size_t i = 0; i < W; i++)
     {
-        size_t idx = i % N;
-
-        bvh_node->children[idx]->surfaces.push_back(S[i]);
-        bvh_node->children[idx]->BB.merge(S[i]->BB());
+        child[i] = node.child[i];
+        num_surfaces[i] = node.num_surfaces[i];
     }
+}
 
-    S.clear();
+template<size_t W>
+const BVH::LaneBounds<W> &BVH::childBounds(const WideNode<W> &node, LaneBounds<W> &buffer)
+{
+    return node.bounds;
+}
 
-    branching[N]++;
+template<size_t W>
+const BVH::LaneBounds<W> &BVH::childBounds(const QuantizedWideNode<W> &node, LaneBounds<W> &buffer)
+{
+    // The products are exact, so the SIMD and scalar decodings are identical
+    for (int a = 0; a < 3; a++)
+    {
+        float origin = node.origin[a];
+        float step = exp2i(node.exponent[a]);
+#if defined(__AVX2__)
+        if constexpr (W == 8)
+        {
+            __m256 o = _mm256_set1_ps(origin);
+            __m256 s = _mm256_set1_ps(step);
+            for (int k : { a, a + 3 })
+            {
+                __m256i q = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.bounds[k])));
+                _mm256_store_ps(buffer[k], _mm256_add_ps(o, _mm256_mul_ps(_mm256_cvtepi32_ps(q), s)));
+            }
+            continue;
+        }
+#endif
+#if defined(__SSE4_1__)
+        if constexpr (W == 4)
+        {
+            __m128 o = _mm_set1_ps(origin);
+            __m128 s = _mm_set1_ps(step);
+            for (int k : { a, a + 3 })
+            {
+                uint32_t packed;
+                std::memcpy(&packed, node.bounds[k], sizeof(packed));
+                __m128i q = _mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)packed));
+                _mm_store_ps(buffer[k], _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(q), s)));
+            }
+            continue;
+        }
+#endif
+        for (size_t i = 0; i < W; i++)
+        {
+            buffer[a][i] = origin + (float)node.bounds[a][i] * step;
+            buffer[a + 3][i] = origin + (float)node.bounds[a + 3][i] * step;
+        }
+    }
+    return buffer;
 }
 
-BVH::SurfaceCentroid::SurfaceCentroid(std::shared_ptr<Surface::Base> surface)
-    : surface(surface), centroid(surface->BB().centroid()) { }
\ No newline at end of file
+template<size_t W>
+BVH::WideNode<W>::WideNode()
+{
+    for (size_t i = 0; i < W; i++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            bounds[a][i] = std::numeric_limits<float>::infinity();
+            bounds[a + 3][i] = -std::numeric_limits<float>::infinity();
+        }
+        child[i] = 0;
+        num_surfaces[i] = 0;
+    }
+}
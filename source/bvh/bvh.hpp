@@ -1,112 +1,411 @@
 #pragma once
 
+#include <map>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <filesystem>
+
 #include <nlohmann/json.hpp>
 
+#include "../ray/ray.hpp"
 #include "../ray/intersection.hpp"
-#include "../octree/octree.hpp"
+#include "../common/bounding-box.hpp"
+#include "../common/arena.hpp"
 
 namespace Surface { class Base; }
 
 class BVH
 {
-    struct SurfaceCentroid
+    /********************************************************************************
+     Node of the build tree. Nodes are allocated from build_arena, and the children of
+     a node are allocated together, so they are contiguous. The surfaces of a node are 
+     the range [begin, end) of build_indices, which holds indices into build_surfaces. 
+     The builders partition the range of a node in place into the ranges of its 
+     children, except the SBVH builder, which appends the leaf ranges. The range of an
+     inner node is therefore only used during construction.
+    ********************************************************************************/
+    struct BuildNode
     {
-        SurfaceCentroid(std::shared_ptr<Surface::Base> surface);
+        BuildNode() { }
 
-        glm::dvec3 pos() const
+        bool leaf() const
         {
-            return centroid;
+            return num_children == 0;
         }
 
-        glm::dvec3 centroid;
-        std::shared_ptr<Surface::Base> surface;
-    };
-
-    struct BuildNode
-    {
-        BuildNode() { }
-
-        bool leaf()
+        uint32_t size() const
         {
-            return children.empty();
+            return end - begin;
         }
 
         BoundingBox BB;
-        std::vector<std::shared_ptr<BuildNode>> children;
-        std::vector<std::shared_ptr<Surface::Base>> surfaces;
+        BuildNode *children = nullptr;
+        uint32_t num_children = 0;
+        uint32_t begin = 0, end = 0;
         uint32_t df_idx; // depth-first index in tree
+        double cost, build_cost; // SAH cost relative to the node area after the last refit and when built
+    };
+
+    // Surface reference with bounds that are clipped by spatial splits
+    struct Reference
+    {
+        uint32_t surface; // index into build_surfaces
+        BoundingBox BB;
+    };
+
+    // Range of Morton-sorted surfaces in the same cell of the coarse HLBVH grid
+    struct Cluster
+    {
+        BuildNode *node;
+        size_t begin, end;
     };
 
     /********************************************************************************
-     Linear array node for N-ary trees. Currently 57B padded to 64B.
-
-     For future reference, it's possible to get this to 29B and pad to 32B by:
-
-     1. Using float instead of double vectors for the bounding box.
-     2. Store the last descendant index (in depth first order) instead of next
-        sibling index and set this to be union the surface offset (since leaves have
-        no descendants and inner nodes have no surfaces).
-
-     Traversal of a parents child nodes would then work like:
-
-     if parent is not a leaf
-         current_child = parent + 1
-         while true
-            [do stuff with current node]
-            if current_child is a leaf
-                if current_child is parents last descendant
-                    break
-                else
-                    current_child = current_child + 1
+     Linear array node for N-ary trees, 29B padded to 32B.
+
+     The bounding box is stored as conservative single-precision bounds, i.e. min 
+     is rounded down and max is rounded up, so a box intersection is never missed. 
+     Only the final refinement, the surface intersection in the leaves, is then 
+     performed in double precision. bounds[0..2] is min and bounds[3..5] is max.
+
+     Nodes are stored in depth-first order, so the first child of an inner node 
+     is the next node. Inner nodes store the index of their last descendant, which
+     is unioned with the surface offset since leaves have no descendants and inner 
+     nodes have no surfaces. Traversal of a parents child nodes works like:
+
+     current_child = parent + 1
+     while true
+        [do stuff with current node]
+        if current_child is a leaf
+            if current_child is parents last descendant
+                break
             else
-                if current_childs last descendant is parents last descendant
-                    break
-                else
-                    current_child = current_childs last descendant + 1
+                current_child = current_child + 1
+        else
+            if current_childs last descendant is parents last descendant
+                break
+            else
+                current_child = current_childs last descendant + 1
 
     ********************************************************************************/
-    struct alignas(64) LinearNode
+    struct alignas(32) LinearNode
     {
-        BoundingBox BB;
-        uint32_t start_surface;
+        float bounds[6];
+        union
+        {
+            uint32_t start_surface;   // leaf
+            uint32_t last_descendant; // inner node
+        };
         uint8_t num_surfaces;
-        uint32_t next_sibling; // 0 if there is none
 
         // Used for priority queue
-        struct alignas(16) NodeIntersection
+        struct alignas(8) NodeIntersection
         {
             bool operator< (const NodeIntersection& i) const { return i.t < t; };
-            double t;
+            float t;
             uint32_t node;
         };
     };
+    static_assert(sizeof(LinearNode) == 32, "LinearNode should be 32 bytes.");
+
+    // Largest number of children of a node in the linear tree, from the octree builder
+    static constexpr size_t max_branching = 8;
+
+    /********************************************************************************
+     Node of a W-wide BVH (W = 4 or 8) collapsed from the build tree. The child 
+     bounding boxes are stored as conservative single-precision SoA lanes, where 
+     bounds[0..2] are the min x, y, z lanes and bounds[3..5] are the max x, y, z 
+     lanes. This allows all children of a node to be slab-tested at once using 
+     SSE/AVX. Unused lanes have inverted infinite bounds and are never intersected.
+    ********************************************************************************/
+    template<size_t W>
+    struct alignas(64) WideNode
+    {
+        static constexpr size_t num_lanes = W;
+
+        WideNode();
+
+        float bounds[6][W];
+        uint32_t child[W];       // wide node index of inner child, start surface of leaf child
+        uint8_t num_surfaces[W]; // 0 for inner children
+    };
+
+    /********************************************************************************
+     Wide node with the child bounding boxes quantized to 8-bit offsets relative to
+     the union of the children, as in compressed wide BVHs. Each axis is divided 
+     into 255 steps of size 2^exponent starting at origin, so a lane is decoded as 
+     origin + q * 2^exponent, which is exact up to a single rounding of the sum. 
+     The offsets are rounded outwards and then checked against the decoded float
+     bounds, so the decoded box always encloses the single-precision child box.
+     This halves the size of the nodes (128B for W = 8, 64B for W = 4), at the cost
+     of looser child bounds. Unused lanes have inverted bounds.
+    ********************************************************************************/
+    template<size_t W>
+    struct alignas(64) QuantizedWideNode
+    {
+        static constexpr size_t num_lanes = W;
+
+        QuantizedWideNode() { }
+        QuantizedWideNode(const WideNode<W> &node);
+
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t bounds[6][W];
+        uint32_t child[W];
+        uint8_t num_surfaces[W];
+    };
+    static_assert(sizeof(QuantizedWideNode<8>) == 128, "QuantizedWideNode<8> should be 128 bytes.");
+    static_assert(sizeof(QuantizedWideNode<4>) == 64, "QuantizedWideNode<4> should be 64 bytes.");
+
+    // Single-precision child bounds of a wide node, quantized bounds are decoded into buffer
+    template<size_t W>
+    using LaneBounds = float[6][W];
+
+    template<size_t W>
+    static const LaneBounds<W> &childBounds(const WideNode<W> &node, LaneBounds<W> &buffer);
+    template<size_t W>
+    static const LaneBounds<W> &childBounds(const QuantizedWideNode<W> &node, LaneBounds<W> &buffer);
+
+#if defined(__AVX__)
+    static constexpr size_t triangle_block_width = 8;
+#else
+    static constexpr size_t triangle_block_width = 4;
+#endif
+
+    // Single-precision ray data for the batched triangle test
+    struct TriangleRay
+    {
+        TriangleRay() { }
+        TriangleRay(const Ray &ray);
+
+        float origin[3], direction[3];
+        float origin_scale, direction_scale; // largest absolute coordinates
+    };
+
+    /********************************************************************************
+     Block of triangle_block_width leaf triangles stored as single-precision SoA 
+     lanes, which are intersected at once by a batched Möller-Trumbore test. 
+
+     The test is conservative, i.e. a lane is only rejected if the triangle is 
+     missed by a margin that is larger than a bound of the single-precision rounding
+     errors. R and L are the largest absolute vertex and edge coordinates of each 
+     triangle, which are used to compute the bound. The remaining candidates are 
+     then refined in double precision using the original triangle.
+    ********************************************************************************/
+    struct alignas(32) TriangleBlock
+    {
+        static constexpr size_t W = triangle_block_width;
+
+        TriangleBlock();
+
+        // Returns a bit mask of the candidate lanes that may be hit closer than t_max
+        uint32_t intersect(const TriangleRay &r, float t_max) const;
+
+        float v0[3][W], E1[3][W], E2[3][W];
+        float R[W], L[W];
+    };
 
 public:
     BVH(const BoundingBox &BB, 
         const std::vector<std::shared_ptr<Surface::Base>> &surfaces, 
-        const nlohmann::json &j);
+        const nlohmann::json &j,
+        bool animated = false);
 
     Intersection intersect(const Ray& ray) const;
 
+    // Refits the tree to surfaces that have moved since the last build or update, 
+    // rebuilding subtrees whose SAH cost has degraded. Only used by animated BVHs.
+    void update();
+
+    // Settings of nested BVHs, i.e. instance and mesh BVHs, which are neither cached nor benchmarked
+    static nlohmann::json nestedSettings(const nlohmann::json &j);
+
+    // Intersects a packet of up to max_packet_size coherent rays
+    void intersect(const Ray *rays, Intersection *intersects, size_t num_rays) const;
+
+    // Returns true if any surface except ignore_surface is intersected closer than t_max
+    bool occluded(const Ray& ray, double t_max, const std::shared_ptr<Surface::Base> &ignore_surface) const;
+
     static constexpr size_t leaf_surfaces = 8;
     static constexpr size_t max_leaf_surfaces = 0xFF;
+
+    // Nodes with at least this many surfaces are built as parallel tasks
+    static constexpr size_t task_size = 4096;
+
+    // Nodes with at least this many surfaces are binned and partitioned in parallel
+    static constexpr size_t parallel_binning_size = 65536;
     std::map<size_t, size_t> branching;
 
     int bins_per_axis = 16;
 
+    // Spatial splits are only evaluated if the overlap of the best object split 
+    // children, relative to the root surface area, is larger than this.
+    static constexpr double spatial_split_alpha = 1e-5;
+
+    // Number of top Morton code bits that define the HLBVH clusters, 5 per axis
+    static constexpr size_t lbvh_cluster_bits = 15;
+
+    // Width of the collapsed tree. 0 if the N-ary linear tree is used.
+    size_t width = 8;
+
+    // Child bounds of the collapsed tree are stored as quantized 8-bit offsets
+    bool quantized = false;
+
+    // Order of the nodes of the collapsed tree in memory, see reorder
+    enum NodeLayout { DEPTH_FIRST, VAN_EMDE_BOAS, TREELET };
+    NodeLayout node_layout = DEPTH_FIRST;
+
+    static constexpr size_t max_packet_size = 16;
+
+    // Size of the fixed traversal stacks
+    static constexpr size_t max_stack_size = 512;
+
+    // Ordered stack traversal of the linear tree, the priority queue traversal is used otherwise
+    bool stack_traversal = false;
+
+    // Subtrees are rebuilt on update if their SAH cost relative to the cost when they were built is larger than this
+    double rebuild_threshold = 1.5;
+
 private:
-    void recursiveBuildFromOctree(const Octree<SurfaceCentroid> &octree_node, std::shared_ptr<BuildNode> bvh_node);
-    void recursiveBuildBinarySAH(std::shared_ptr<BuildNode> bvh_node);
-    void recursiveBuildQuaternarySAH(std::shared_ptr<BuildNode> bvh_node);
-    void compact(std::shared_ptr<BuildNode> bvh_node, uint32_t next_sibling, uint32_t &surface_idx);
+    BVH(const std::vector<std::shared_ptr<Surface::Base>> &surfaces, const nlohmann::json &j, bool instance_leaves, bool animated);
+
+    // Builds the tree over the surfaces in the range [begin, end) of build_indices
+    BuildNode* buildTree(size_t begin, size_t end, 
+                         const BoundingBox &BB, 
+                         const nlohmann::json &j,
+                         bool print);
+
+    // Frees the build tree and the construction data
+    void clearBuildData();
+
+    // Emits the wide or linear tree and the triangle blocks from the build tree, returns the traversal stack size
+    size_t layout(BuildNode *root, size_t requested_width);
+
+    // Size in bytes of the traversal data, i.e. the nodes, triangle blocks and ordered surfaces
+    size_t memoryUsage() const;
+
+    double refit(BuildNode *bvh_node);
+    void rebuildDegraded(BuildNode *bvh_node, size_t &num_rebuilt);
+    void setBuildCosts(BuildNode *bvh_node);
+    void rebuild(BuildNode *bvh_node);
+
+    // Copies the subtree to dst, allocating the descendants from arena and appending the leaf ranges to indices
+    void copyBuildTree(const BuildNode *src, BuildNode *dst, Arena<BuildNode> &arena, std::vector<uint32_t> &indices) const;
+
+    // Hash of the triangle geometry and the settings that affect the tree
+    uint64_t cacheHash(const std::vector<std::shared_ptr<Surface::Base>> &triangles, const nlohmann::json &j) const;
+    bool readCache(const std::filesystem::path &path, uint64_t hash, 
+                   const std::vector<std::shared_ptr<Surface::Base>> &triangles, size_t &stack_size);
+    void writeCache(const std::filesystem::path &path, uint64_t hash, 
+                    const std::vector<std::shared_ptr<Surface::Base>> &triangles, size_t stack_size) const;
+
+    void recursiveBuildOctree(BuildNode *bvh_node, const BoundingBox &cube_BB);
+    void recursiveBuildBinarySAH(BuildNode *bvh_node);
+    void recursiveBuildQuaternarySAH(BuildNode *bvh_node);
+    void recursiveBuildSBVH(BuildNode *bvh_node, std::vector<Reference> refs, size_t split_budget);
+    void buildLBVH(BuildNode *root, bool hlbvh);
+    void recursiveBuildLBVH(BuildNode *bvh_node, const std::vector<uint64_t> &codes, size_t offset, size_t begin, size_t end);
+    void recursiveBuildUpperSAH(BuildNode *bvh_node, std::vector<Cluster> &clusters, size_t begin, size_t end);
+    void buildChildren(BuildNode *bvh_node, void (BVH::*build)(BuildNode*));
+    size_t assignIndices(BuildNode *bvh_node);
 
-    void arbitrarySplit(std::shared_ptr<BuildNode> bvh_node, size_t N);
+    BoundingBox centroidExtent(size_t begin, size_t end) const;
+
+    template<class F>
+    void partition(BuildNode *bvh_node, size_t N, F&& getChild);
+    uint32_t compact(BuildNode *bvh_node);
+    uint32_t packLeaf(BuildNode *bvh_node);
+
+    void arbitrarySplit(BuildNode *bvh_node, size_t N);
+
+    template<size_t W>
+    uint32_t collapse(BuildNode *bvh_node, std::vector<WideNode<W>> &wide_tree, size_t depth);
+
+    // Size of the memory pages that the treelets are fitted to
+    static constexpr size_t page_size = 4096;
+
+    template<size_t W>
+    void reorder(std::vector<WideNode<W>> &wide_tree) const;
+
+    // Appends the nodes of the subtree above the given height in van Emde Boas order, and the nodes at the height to cut
+    template<size_t W>
+    static void vanEmdeBoasOrder(const std::vector<WideNode<W>> &wide_tree, uint32_t node_idx, size_t height, 
+                                 std::vector<uint32_t> &order, std::vector<uint32_t> &cut);
+
+    template<class Node>
+    void printLayoutStats(const std::vector<Node> &wide_tree) const;
+
+    // Node visit counter used by the traversal benchmark
+    struct TraversalStats
+    {
+        size_t nodes = 0;
+    };
+
+    void intersectPriorityQueue(const Ray& ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats = nullptr) const;
+    void intersectStack(const Ray& ray, Intersection &intersect, uint32_t &hit, TraversalStats *stats = nullptr) const;
+
+    template<class Node>
+    void intersectWide(const Ray& ray, const std::vector<Node> &wide_tree, Intersection &intersect, uint32_t &hit, TraversalStats *stats = nullptr) const;
+
+    template<class Node>
+    void intersectWidePacket(const Ray *rays, size_t num_rays, const std::vector<Node> &wide_tree, Intersection *intersects, uint32_t *hits) const;
+
+    void benchmark(const BoundingBox &BB, size_t num_rays, bool stack) const;
+
+    template<class Node>
+    bool occludedWide(const Ray& ray, const std::vector<Node> &wide_tree, double t_max, const Surface::Base *ignore_surface) const;
+
+    bool occludedLeaf(const Ray& ray, const TriangleRay &triangle_ray, uint32_t start_surface, uint32_t num_surfaces, 
+                      double t_max, const Surface::Base *ignore_surface) const;
+
+    void intersectLeaf(const Ray& ray, const TriangleRay &triangle_ray, uint32_t start_surface, uint32_t num_surfaces, Intersection &intersect, uint32_t &hit) const;
 
     // Nodes stored in depth-first order
     std::vector<LinearNode> linear_tree;
 
+    // Root is stored first, used instead of linear_tree if width is 4 or 8
+    std::vector<WideNode<4>> wide4_tree;
+    std::vector<WideNode<8>> wide8_tree;
+    size_t wide_depth = 0;
+
+    // Used instead of wide4_tree and wide8_tree if quantized is set
+    std::vector<QuantizedWideNode<4>> quantized4_tree;
+    std::vector<QuantizedWideNode<8>> quantized8_tree;
+
+    // Leaf triangles packed in blocks, ordered_surfaces holds the corresponding triangles and nullptr for unused lanes
+    std::vector<TriangleBlock> triangle_blocks;
     std::vector<std::shared_ptr<Surface::Base>> ordered_surfaces;
 
+    // Top-level BVH over the mesh instances
+    std::shared_ptr<BVH> instance_bvh;
+
+    // Leaves reference instances instead of triangle blocks
+    const bool instance_leaves;
+
+    // Surfaces other than triangles and instances, which are few and intersected linearly
+    std::vector<std::shared_ptr<Surface::Base>> other_surfaces;
+
+    // Number of leaf surface references, larger than the number of surfaces if references are duplicated
+    size_t num_references = 0;
+
+    double root_area;
+
     // Depth first index used during construction
     uint32_t df_idx;
+
+    // Construction data, see BuildNode. build_scratch and build_child_indices are used
+    // to partition the ranges of build_indices in place. The SBVH builder appends leaf
+    // ranges under build_mutex.
+    Arena<BuildNode> build_arena;
+    std::vector<std::shared_ptr<Surface::Base>> build_surfaces;
+    std::vector<uint32_t> build_indices, build_scratch;
+    std::vector<uint8_t> build_child_indices;
+    std::mutex build_mutex;
+
+    // Build tree and build settings retained by animated BVHs for updates
+    BuildNode *build_root = nullptr;
+    nlohmann::json build_settings;
+    size_t requested_width = 8;
+    bool requested_stack_traversal = false;
 };
\ No newline at end of file
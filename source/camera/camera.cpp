@@ -8,8 +8,10 @@
 #include <sstream>
 
 #include "../ray/ray.hpp"
+#include "../bvh/bvh.hpp"
 #include "../integrator/path-tracer/path-tracer.hpp"
 #include "../integrator/photon-mapper/photon-mapper.hpp"
+#include "../integrator/sppm/sppm.hpp"
 #include "../sampling/sampling.hpp"
 #include "../sampling/sampler.hpp"
 #include "../common/util.hpp"
@@ -21,7 +23,15 @@ Camera::Camera(const nlohmann::json &j, const Option &option)
 {
     if (option.photon_map)
     {
-        integrator = std::make_shared<PhotonMapper>(j);
+        const nlohmann::json& pm = j.at("photon_map");
+        if (pm.find("sppm") != pm.end())
+        {
+            integrator = std::make_shared<SPPM>(j);
+        }
+        else
+        {
+            integrator = std::make_shared<PhotonMapper>(j);
+        }
     }
     else
     {
@@ -38,6 +48,7 @@ Camera::Camera(const nlohmann::json &j, const Option &option)
     savename = c.at("savename");
     aperture_radius = (focal_length / getOptional(c, "f_stop", -1.0)) / 2.0;
     focus_distance = getOptional(c, "focus_distance", -1.0);
+    packet_size = std::clamp(getOptional(c, "packet_size", BVH::max_packet_size), size_t(1), BVH::max_packet_size);
 
     if (c.find("look_at") != c.end())
     {
@@ -56,47 +67,83 @@ Camera::Camera(const nlohmann::json &j, const Option &option)
     }
 
     thin_lens = aperture_radius > 0.0 && focus_distance > 0.0;
+
+    integrator->camera_ray = [this](const glm::dvec2& uv)
+    {
+        return cameraRay(uv * glm::dvec2(image.width, image.height));
+    };
 }
 
 void Camera::samplePixel(size_t x, size_t y)
 {
-    auto& pixel = image(x, y);
-
-    double pixel_size = sensor_width / image.width;
     size_t spp = pow2(sqrtspp);
+    size_t pixel = y * image.width + x;
 
-    glm::dvec2 half_dim = glm::dvec2(image.width, image.height) * 0.5;
+    // Each pass continues the sample sequence of the pixel
+    size_t first_index = pass * spp;
 
-    Sampler::initiate(static_cast<uint32_t>(y * image.width + x));
+    Sampler::initiate(static_cast<uint32_t>(pixel));
+    integrator->beginPixel(pixel);
+
+    thread_local std::vector<Ray> rays;
+    thread_local std::vector<Intersection> intersections;
 
     glm::dvec3 value(0.0);
-    for(int i = 0; i < spp; i++)
-    { 
-        Sampler::setIndex(i);
+    for (size_t first = 0; first < spp; first += packet_size)
+    {
+        size_t num_rays = std::min(packet_size, spp - first);
 
-        auto u = Sampler::get<Dim::PIXEL, 2>();
-        glm::dvec2 local = pixel_size * (half_dim - glm::dvec2(x + u[0], y + u[1]));
-        glm::dvec3 direction = glm::normalize(forward * focal_length + left * local.x + up * local.y);
+        rays.clear();
+        for (size_t i = first; i < first + num_rays; i++)
+        {
+            Sampler::setIndex(static_cast<uint32_t>(first_index + i));
+            rays.push_back(cameraRay(x, y));
+        }
 
-        // Pinhole camera ray
-        Ray ray(eye, direction, integrator->scene.ior);
+        // The first intersections of the camera rays are found together as a packet
+        intersections.resize(num_rays);
+        integrator->scene.intersect(rays.data(), intersections.data(), num_rays);
 
-        if (thin_lens)
+        for (size_t i = 0; i < num_rays; i++)
         {
-            // Thin lens camera ray for depth of field
-            auto u = Sampler::get<Dim::LENS, 2>();
-            glm::dvec3 focus_point = ray(focus_distance / glm::dot(ray.direction, forward));
-            glm::dvec2 aperture_sample = Sampling::uniformDisk(u[0], u[1]) * aperture_radius;
-            ray.start += left * aperture_sample.x + up * aperture_sample.y;
-            ray.direction = glm::normalize(focus_point - ray.start);
+            Sampler::setIndex(static_cast<uint32_t>(first_index + first + i));
+            value += integrator->sampleRay(rays[i], intersections[i]);
         }
-
-        value += integrator->sampleRay(ray);
     }
-    image(x, y) = value / static_cast<double>(spp);
+    image(x, y) = integrator->endPixel(pixel, value / static_cast<double>(spp));
     num_sampled_pixels++;
 }
 
+Ray Camera::cameraRay(size_t x, size_t y) const
+{
+    auto u = Sampler::get<Dim::PIXEL, 2>();
+    return cameraRay(glm::dvec2(x + u[0], y + u[1]));
+}
+
+Ray Camera::cameraRay(const glm::dvec2& image_position) const
+{
+    double pixel_size = sensor_width / image.width;
+    glm::dvec2 half_dim = glm::dvec2(image.width, image.height) * 0.5;
+
+    glm::dvec2 local = pixel_size * (half_dim - image_position);
+    glm::dvec3 direction = glm::normalize(forward * focal_length + left * local.x + up * local.y);
+
+    // Pinhole camera ray
+    Ray ray(eye, direction, integrator->scene.ior);
+
+    if (thin_lens)
+    {
+        // Thin lens camera ray for depth of field
+        auto u = Sampler::get<Dim::LENS, 2>();
+        glm::dvec3 focus_point = ray(focus_distance / glm::dot(ray.direction, forward));
+        glm::dvec2 aperture_sample = Sampling::uniformDisk(u[0], u[1]) * aperture_radius;
+        ray.start += left * aperture_sample.x + up * aperture_sample.y;
+        ray.direction = glm::normalize(focus_point - ray.start);
+    }
+
+    return ray;
+}
+
 void Camera::sampleImage()
 {
     std::vector<Bucket> buckets_vec;
@@ -160,15 +207,57 @@ void Camera::lookAt(const glm::dvec3& p)
 
 void Camera::capture()
 {
-    std::cout << std::endl << std::string(28, '-') << "| MAIN RENDERING PASS |" << std::string(28, '-') << std::endl;
-    std::cout << std::endl << "Samples per pixel: " << pow2(static_cast<double>(sqrtspp)) << std::endl << std::endl;
-    auto before = std::chrono::system_clock::now();
-    sampleImage();
-    saveImage();
-    auto now = std::chrono::system_clock::now();
-    std::cout << "\r" + std::string(100, ' ') + "\r";
-    std::cout << "Render Completed: " << Format::date(now);
-    std::cout << ", Elapsed Time: " << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(now - before).count()) << std::endl;
+    size_t num_frames = integrator->scene.num_frames;
+    for (size_t frame = 0; frame < num_frames; frame++)
+    {
+        if (frame > 0)
+        {
+            std::cout << std::endl << "Moving scene to frame " << frame + 1 << " of " << num_frames << "." << std::endl;
+            integrator->setFrame(frame);
+        }
+
+        // Frames are numbered from 1 and zero padded, e.g. savename_0001
+        std::stringstream frame_name;
+        frame_name << savename << "_" << std::setw(4) << std::setfill('0') << frame + 1;
+
+        auto before = std::chrono::system_clock::now();
+        size_t num_passes = integrator->num_passes;
+        for (pass = 0; pass < num_passes; pass++)
+        {
+            integrator->beginPass(pass, image.num_pixels);
+
+            if (pass == 0)
+            {
+                std::cout << std::endl << std::string(28, '-') << "| MAIN RENDERING PASS |" << std::string(28, '-') << std::endl;
+                std::cout << std::endl << "Samples per pixel: " << pow2(static_cast<double>(sqrtspp)) * num_passes << std::endl << std::endl;
+            }
+            if (num_passes > 1)
+            {
+                std::cout << "\r" + std::string(100, ' ') + "\r" << "Pass " << pass + 1 << " of " << num_passes << std::endl;
+            }
+
+            num_sampled_pixels = 0;
+            last_num_sampled_pixels = 0;
+            last_update = std::chrono::steady_clock::now();
+            times.clear();
+
+            sampleImage();
+
+            // The image is saved after each pass of progressive integrators, so that the render can be stopped at any time
+            if (num_frames > 1)
+            {
+                image.save(frame_name.str());
+            }
+            else
+            {
+                saveImage();
+            }
+        }
+        auto now = std::chrono::system_clock::now();
+        std::cout << "\r" + std::string(100, ' ') + "\r";
+        std::cout << "Render Completed: " << Format::date(now);
+        std::cout << ", Elapsed Time: " << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(now - before).count()) << std::endl;
+    }
 }
 
 void Camera::printInfoThread(WorkQueue<Bucket>& buckets)
@@ -212,6 +301,11 @@ void Camera::printInfoThread(WorkQueue<Bucket>& buckets)
             last_update = now;
             last_num_sampled_pixels = num_sampled_pixels;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+        // Sleeps in short steps to not delay the next pass of progressive integrators
+        for (int i = 0; i < 20 && !buckets.empty(); i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
     }
 }
\ No newline at end of file
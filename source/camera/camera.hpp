@@ -12,6 +12,7 @@
 #include "image.hpp"
 
 #include "../scene/scene.hpp"
+#include "../ray/ray.hpp"
 #include "../common/work-queue.hpp"
 #include "../common/option.hpp"
 
@@ -39,6 +40,9 @@ public:
 
     size_t sqrtspp;
 
+    // Number of camera rays of a pixel that are traced together through the BVH
+    size_t packet_size;
+
     glm::dvec3 eye;
     glm::dvec3 forward, left, up;
 
@@ -59,6 +63,8 @@ private:
     };
 
     void samplePixel(size_t x, size_t y);
+    Ray cameraRay(size_t x, size_t y) const;
+    Ray cameraRay(const glm::dvec2& image_position) const;
     void sampleImageThread(WorkQueue<Bucket>& buckets);
 
     void printInfoThread(WorkQueue<Bucket>& buckets);
@@ -67,6 +73,9 @@ private:
 
     std::shared_ptr<Integrator> integrator;
 
+    // Current pass of progressive integrators
+    size_t pass = 0;
+
     std::atomic_size_t num_sampled_pixels = 0;
     size_t last_num_sampled_pixels = 0;
     std::chrono::time_point<std::chrono::steady_clock> last_update = std::chrono::steady_clock::now();
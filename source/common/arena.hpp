@@ -0,0 +1,65 @@
+/***************************************************
+A thread safe arena that allocates objects in large
+blocks, so that many small objects can be allocated
+without a heap allocation each. Objects are default
+constructed when their block is allocated, and are
+only destroyed together when the arena is cleared.
+***************************************************/
+
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+template <class T>
+class Arena
+{
+public:
+    Arena(size_t block_size = 4096) : block_size(block_size) { }
+    Arena(const Arena&) = delete;
+
+    // Returns n contiguous objects
+    T* allocate(size_t n)
+    {
+        std::lock_guard<std::mutex> lock(m);
+
+        if (blocks.empty() || used + n > blocks.back().size)
+        {
+            size_t size = std::max(block_size, n);
+            blocks.push_back({ std::make_unique<T[]>(size), size });
+            used = 0;
+        }
+
+        T* objects = blocks.back().objects.get() + used;
+        used += n;
+        return objects;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        blocks.clear();
+        used = 0;
+    }
+
+    void swap(Arena &other)
+    {
+        std::scoped_lock lock(m, other.m);
+        blocks.swap(other.blocks);
+        std::swap(used, other.used);
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<T[]> objects;
+        size_t size;
+    };
+
+    const size_t block_size;
+    std::vector<Block> blocks;
+    size_t used = 0; // objects used in the last block
+    std::mutex m;
+};
@@ -0,0 +1,82 @@
+/***************************************************
+Helpers for reading and writing trivially copyable
+values and vectors of them as raw binary data, and
+for hashing raw data to key cached files.
+***************************************************/
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <type_traits>
+
+namespace BinaryFile
+{
+    constexpr uint64_t hash_seed = 0xcbf29ce484222325;
+
+    // splitmix64 finalizer, where every input bit affects every output bit
+    inline uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111eb;
+        x ^= x >> 31;
+        return x;
+    }
+
+    // Hash of 64-bit words of data, continued from h. Each word is mixed into all bits of the hash, so
+    // changes of different words can't cancel, and the size is mixed in last.
+    inline uint64_t hash(const void *data, size_t size, uint64_t h = hash_seed)
+    {
+        const char *bytes = static_cast<const char*>(data);
+        for (size_t i = 0; i < size; i += 8)
+        {
+            uint64_t word = 0;
+            std::memcpy(&word, bytes + i, std::min(size - i, size_t(8)));
+            h = mix(h ^ word);
+        }
+        return mix(h ^ size);
+    }
+
+    template<class T>
+    void write(std::ostream &out, const T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be written.");
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    // Writes the size of the vector followed by its elements
+    template<class T>
+    void write(std::ostream &out, const std::vector<T> &values)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be written.");
+        write(out, (uint64_t)values.size());
+        out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+
+    template<class T>
+    bool read(std::istream &in, T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be read.");
+        return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    }
+
+    // Reads a vector written by write, fails if it has more than max_size elements
+    template<class T>
+    bool read(std::istream &in, std::vector<T> &values, size_t max_size)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be read.");
+        uint64_t size;
+        if (!read(in, size) || size > max_size)
+        {
+            return false;
+        }
+        values.resize(size);
+        return (bool)in.read(reinterpret_cast<char*>(values.data()), size * sizeof(T));
+    }
+}
@@ -90,6 +90,16 @@ void BoundingBox::merge(const glm::dvec3 &p)
     }
 }
 
+// Shrinks the bounding box to its intersection with BB
+void BoundingBox::clip(const BoundingBox &BB)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (min[i] < BB.min[i]) min[i] = BB.min[i];
+        if (max[i] > BB.max[i]) max[i] = BB.max[i];
+    }
+}
+
 bool BoundingBox::valid() const
 {
     for (int i = 0; i < 3; i++)
@@ -0,0 +1,54 @@
+/***************************************************
+Morton codes (Z-order curve) of 3D points. Points
+that are close along the curve are close in space,
+so sorting by code clusters points spatially.
+***************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+#include <glm/common.hpp>
+
+#include "bounding-box.hpp"
+
+namespace Morton
+{
+    // Number of bits per axis of the 63-bit codes
+    constexpr uint32_t axis_bits = 21;
+
+    // Spreads the lower 21 bits of x so that there are two zero bits between each bit
+    inline uint64_t expandBits(uint64_t x)
+    {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffff;
+        x = (x | x << 16) & 0x1f0000ff0000ff;
+        x = (x | x << 8)  & 0x100f00f00f00f00f;
+        x = (x | x << 4)  & 0x10c30c30c30c30c3;
+        x = (x | x << 2)  & 0x1249249249249249;
+        return x;
+    }
+
+    inline uint64_t encode(uint32_t x, uint32_t y, uint32_t z)
+    {
+        return expandBits(x) << 2 | expandBits(y) << 1 | expandBits(z);
+    }
+
+    // 63-bit code of point p quantized to a 2^21 grid over BB
+    inline uint64_t encode(const glm::dvec3 &p, const BoundingBox &BB)
+    {
+        constexpr double cells = double(1u << axis_bits);
+
+        glm::dvec3 dims = BB.dimensions();
+        glm::uvec3 q(0);
+        for (int a = 0; a < 3; a++)
+        {
+            if (dims[a] > 0.0)
+            {
+                q[a] = (uint32_t)glm::clamp((p[a] - BB.min[a]) / dims[a] * cells, 0.0, cells - 1.0);
+            }
+        }
+        return encode(q.x, q.y, q.z);
+    }
+}
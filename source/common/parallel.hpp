@@ -0,0 +1,155 @@
+/***************************************************
+Helpers for fork-join parallelism. forChunks splits
+a range into contiguous chunks that are processed
+concurrently, and TaskGroup runs recursive tasks on
+new threads while there are idle hardware threads.
+radixSort is a chunk-parallel sort of integer keys.
+***************************************************/
+
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Parallel
+{
+    inline size_t numThreads()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    /**************************************************************************
+    Calls f(chunk, begin, end) for up to numThreads() contiguous chunks of the
+    range [0, n) concurrently, where chunk is in [0, numThreads()). Chunks are
+    at least min_chunk_size large, so small ranges are processed serially.
+    **************************************************************************/
+    template<class F>
+    void forChunks(size_t n, size_t min_chunk_size, F&& f)
+    {
+        size_t num_chunks = std::clamp(n / std::max(min_chunk_size, size_t(1)), size_t(1), numThreads());
+        size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+
+        std::vector<std::thread> threads;
+        for (size_t c = 1; c < num_chunks; c++)
+        {
+            size_t begin = std::min(c * chunk_size, n);
+            size_t end = std::min(begin + chunk_size, n);
+            threads.emplace_back([&f, c, begin, end]() { f(c, begin, end); });
+        }
+        f(size_t(0), size_t(0), std::min(chunk_size, n));
+
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    /**************************************************************************
+    Stable LSD radix sort of v by the lowest key_bits bits of key(v[i]), using 
+    8-bit digits. Each pass counts the digits of every chunk in parallel, and 
+    then scatters the same chunks in parallel to offsets given by the prefix 
+    sum of the counts. Passes where all keys share the same digit are skipped.
+    **************************************************************************/
+    template<class T, class Key>
+    void radixSort(std::vector<T> &v, size_t key_bits, size_t min_chunk_size, Key&& key)
+    {
+        constexpr size_t radix = 256;
+
+        std::vector<T> sorted(v.size());
+        std::vector<std::array<size_t, radix>> chunk_offsets(numThreads());
+
+        for (size_t shift = 0; shift < key_bits; shift += 8)
+        {
+            for (auto &offsets : chunk_offsets)
+            {
+                offsets.fill(0);
+            }
+
+            forChunks(v.size(), min_chunk_size, [&](size_t chunk, size_t begin, size_t end)
+            {
+                auto &counts = chunk_offsets[chunk];
+                for (size_t i = begin; i < end; i++)
+                {
+                    counts[(key(v[i]) >> shift) & (radix - 1)]++;
+                }
+            });
+
+            // Chunks are scattered in order within each digit, which keeps the sort stable
+            bool single_digit = false;
+            size_t offset = 0;
+            for (size_t d = 0; d < radix; d++)
+            {
+                size_t digit_count = 0;
+                for (auto &offsets : chunk_offsets)
+                {
+                    size_t count = offsets[d];
+                    offsets[d] = offset;
+                    offset += count;
+                    digit_count += count;
+                }
+                single_digit |= digit_count == v.size();
+            }
+
+            if (single_digit) continue;
+
+            forChunks(v.size(), min_chunk_size, [&](size_t chunk, size_t begin, size_t end)
+            {
+                auto &offsets = chunk_offsets[chunk];
+                for (size_t i = begin; i < end; i++)
+                {
+                    sorted[offsets[(key(v[i]) >> shift) & (radix - 1)]++] = v[i];
+                }
+            });
+
+            v.swap(sorted);
+        }
+    }
+
+    class TaskGroup
+    {
+    public:
+        TaskGroup() { }
+        TaskGroup(const TaskGroup&) = delete;
+
+        ~TaskGroup()
+        {
+            wait();
+        }
+
+        // Runs the task on a new thread if there are idle hardware threads, and inline otherwise.
+        template<class F>
+        void spawn(F&& f)
+        {
+            if (running.fetch_add(1) + 1 < numThreads())
+            {
+                threads.emplace_back([task = std::forward<F>(f)]() mutable
+                {
+                    task();
+                    running--;
+                });
+            }
+            else
+            {
+                running--;
+                f();
+            }
+        }
+
+        void wait()
+        {
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+            threads.clear();
+        }
+
+    private:
+        std::vector<std::thread> threads;
+
+        inline static std::atomic<size_t> running = 0;
+    };
+}
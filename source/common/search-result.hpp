@@ -0,0 +1,26 @@
+/***************************************************
+Result of a nearest neighbor or radius search in a
+spatial data structure, ordered by squared distance
+to the query point.
+***************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+template <class Data>
+struct SearchResult
+{
+    SearchResult(const Data& data, double distance2) : data(data), distance2(distance2) { }
+    bool operator< (const SearchResult& rhs) const { return distance2 < rhs.distance2; };
+    Data data;
+    double distance2;
+};
+
+// Refers to the element by its index in the data of the structure instead of copying it
+struct SearchIndex
+{
+    bool operator< (const SearchIndex& rhs) const { return distance2 < rhs.distance2; };
+    uint64_t index;
+    double distance2;
+};
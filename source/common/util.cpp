@@ -2,6 +2,7 @@
 #include <iostream>
 
 #include <glm/gtx/transform.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
 
 #include "util.hpp"
 #include "format.hpp"
@@ -26,11 +27,20 @@ Transform::Transform(const glm::dvec3 &p, const glm::dvec3 &s, const glm::dvec3
     matrix = glm::translate(glm::dmat4(1.0), p) *
              rotation_matrix *
              glm::scale(glm::dmat4(1.0), s);
+
+    normal_matrix = glm::dmat3(rotation_matrix) * glm::dmat3(glm::scale(glm::dmat4(1.0), 1.0 / s));
+}
+
+Transform::Transform(const glm::dmat4 &m)
+    : matrix(m), rotation_matrix(1.0), position(m[3]), scale(1.0), rotation(0.0)
+{
+    negative_determinant = glm::determinant(glm::dmat3(m)) < 0.0;
+    normal_matrix = glm::inverseTranspose(glm::dmat3(m));
 }
 
 glm::dvec3 Transform::transformNormal(const glm::dvec3& n) const
 {
-    return rotation_matrix * glm::dvec4(glm::normalize(n / scale), 1.0);
+    return glm::normalize(normal_matrix * n);
 }
 
 void waitForInput()
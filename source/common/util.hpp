@@ -1,12 +1,19 @@
 #pragma once
 
 #include <queue>
+#include <vector>
+#include <algorithm>
 
 #include <glm/vec3.hpp>
+#include <glm/mat3x3.hpp>
 #include <glm/mat4x4.hpp>
 
 #include <nlohmann/json.hpp>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 inline std::ostream& operator<<(std::ostream& out, const glm::dvec3& v)
 {
     return out << std::string("( " + std::to_string(v.x) + ", " + std::to_string(v.y) + ", " + std::to_string(v.z) + " )");
@@ -25,9 +32,14 @@ struct Transform
 {
     Transform(const glm::dvec3 &position, const glm::dvec3 &scale, const glm::dvec3 &rotation);
 
+    // General affine transform. The scale and rotation are unknown and set to 1 and 0, 
+    // so it should only be applied to surfaces that are transformed using the matrices.
+    explicit Transform(const glm::dmat4 &matrix);
+
     glm::dvec3 transformNormal(const glm::dvec3& normal) const;
 
     glm::dmat4 matrix, rotation_matrix;
+    glm::dmat3 normal_matrix; // inverse transpose
     const glm::dvec3 position, scale, rotation;
     bool negative_determinant;
 };
@@ -88,6 +100,30 @@ inline double powerHeuristic(double a_pdf, double b_pdf)
     return a_pdf2 / (a_pdf2 + b_pdf * b_pdf);
 }
 
+// Index of the lowest set bit, x must be non-zero.
+inline uint32_t countTrailingZeros(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward(&idx, x);
+    return (uint32_t)idx;
+#else
+    return (uint32_t)__builtin_ctz(x);
+#endif
+}
+
+// Index of the highest set bit, x must be non-zero.
+inline uint32_t highestSetBit(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanReverse64(&idx, x);
+    return (uint32_t)idx;
+#else
+    return 63u - (uint32_t)__builtin_clzll(x);
+#endif
+}
+
 template<class T>
 inline std::priority_queue<T> reservedPriorityQueue(size_t size)
 {
@@ -100,4 +136,57 @@ struct AccessiblePQ : public std::priority_queue<T, std::vector<T>, std::less<T>
 {
     void clear() { this->c.clear(); }
     const std::vector<T>& container() const { return this->c; }
+};
+
+/**************************************************************************
+Max-heap of at most capacity elements in a reserved vector, for k-nearest 
+neighbor searches. Once the heap is full, an element that is smaller than 
+the top replaces it with a single sift-down, so pushing never reallocates.
+**************************************************************************/
+template<class T>
+class FixedMaxHeap
+{
+public:
+    void reset(size_t capacity)
+    {
+        heap.clear();
+        heap.reserve(capacity);
+        this->capacity = capacity;
+    }
+
+    // Returns false if the heap is full and the element is not smaller than the top
+    bool push(const T& element)
+    {
+        if (heap.size() < capacity)
+        {
+            heap.push_back(element);
+            std::push_heap(heap.begin(), heap.end());
+            return true;
+        }
+
+        if (heap.empty() || !(element < heap.front())) return false;
+
+        size_t i = 0, n = heap.size();
+        while (true)
+        {
+            size_t child = 2 * i + 1;
+            if (child >= n) break;
+            if (child + 1 < n && heap[child] < heap[child + 1]) child++;
+            if (!(element < heap[child])) break;
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = element;
+        return true;
+    }
+
+    const T& top() const { return heap.front(); }
+    bool full() const { return heap.size() == capacity; }
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    const std::vector<T>& container() const { return heap; }
+
+private:
+    std::vector<T> heap;
+    size_t capacity = 0;
 };
\ No newline at end of file
@@ -65,14 +65,14 @@ glm::dvec3 Integrator::sampleDirect(const Interaction& interaction, LightSample&
         }
     }
 
-    Intersection shadow_intersection = scene.intersect(shadow_ray);
+    double light_distance = glm::distance(shadow_ray.start, light_pos);
 
-    if (!shadow_intersection || shadow_intersection.surface != ls.light)
+    if (scene.occluded(shadow_ray, light_distance, ls.light))
     {
         return glm::dvec3(0.0);
     }    
 
-    double light_pdf = pow2(shadow_intersection.t) / (ls.light->area() * cos_light_theta);
+    double light_pdf = pow2(light_distance) / (ls.light->area() * cos_light_theta);
 
     double bsdf_pdf;
     glm::dvec3 bsdf_absIdotN;
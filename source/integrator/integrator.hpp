@@ -1,5 +1,8 @@
 #pragma once
 
+#include <functional>
+
+#include <glm/vec2.hpp>
 #include <nlohmann/json.hpp>
 
 #include "../scene/scene.hpp"
@@ -17,12 +20,35 @@ public:
         std::shared_ptr<Surface::Base> light;
     };
 
-    virtual glm::dvec3 sampleRay(Ray ray) = 0;
+    // The first intersection of the ray is found by the caller, which allows camera rays to be traced in packets
+    virtual glm::dvec3 sampleRay(Ray ray, Intersection intersection) = 0;
     glm::dvec3 sampleDirect(const Interaction& interaction, LightSample& ls) const;
     glm::dvec3 sampleEmissive(const Interaction& interaction, const LightSample& ls) const;
     bool absorb(const Ray& ray, glm::dvec3& throughput) const;
 
+    // Moves the scene to the animation frame, integrators override this to update data that depends on the scene
+    virtual void setFrame(size_t frame)
+    {
+        scene.setFrame(frame);
+    }
+
+    // Called before each pass over the image. Progressive integrators render each frame in num_passes passes.
+    virtual void beginPass(size_t pass, size_t num_pixels) { }
+
+    // Called before and after the camera rays of a pixel are sampled in a pass. The mean radiance of the rays
+    // is passed to endPixel, which returns the value of the pixel, e.g. combined with the previous passes.
+    virtual void beginPixel(size_t pixel) { }
+    virtual glm::dvec3 endPixel(size_t pixel, const glm::dvec3& radiance)
+    {
+        return radiance;
+    }
+
+    // Samples a camera ray through a point of the image, given in [0, 1)^2. Set by the camera, so that
+    // integrators can trace paths from the camera before the image is rendered.
+    std::function<Ray(const glm::dvec2&)> camera_ray;
+
     size_t num_threads;
+    size_t num_passes = 1;
     Scene scene;
 
     const uint8_t min_ray_depth = 3;
@@ -11,7 +11,7 @@
 #include "../../common/constexpr-math.hpp"
 #include "../../surface/surface.hpp"
 
-glm::dvec3 PathTracer::sampleRay(Ray ray)
+glm::dvec3 PathTracer::sampleRay(Ray ray, Intersection intersection)
 {
     glm::dvec3 radiance(0.0), throughput(1.0);
     RefractionHistory refraction_history(ray);
@@ -22,8 +22,6 @@ glm::dvec3 PathTracer::sampleRay(Ray ray)
     {
         Sampler::nextSequence();
 
-        Intersection intersection = scene.intersect(ray);
-
         if (!intersection)
         {
             return radiance + scene.skyColor(ray) * throughput;
@@ -47,5 +45,7 @@ glm::dvec3 PathTracer::sampleRay(Ray ray)
         }
 
         refraction_history.update(ray);
+
+        intersection = scene.intersect(ray);
     }
 }
\ No newline at end of file
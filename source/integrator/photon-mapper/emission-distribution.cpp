@@ -0,0 +1,69 @@
+#include "emission-distribution.hpp"
+
+#include <algorithm>
+
+EmissionDistribution::EmissionDistribution(const std::vector<double>& weights)
+{
+    constexpr size_t n = resolution;
+
+    double total = 0.0;
+    for (double w : weights) total += w;
+    if (!(total > 0.0)) return;
+
+    density.resize(n * n);
+    for (size_t i = 0; i < n * n; i++)
+    {
+        density[i] = (1.0 - uniform_fraction) * weights[i] * (n * n) / total + uniform_fraction;
+    }
+
+    marginal_cdf.resize(n);
+    conditional_cdf.resize(n * n);
+    double column_sum = 0.0;
+    for (size_t c = 0; c < n; c++)
+    {
+        double row_sum = 0.0;
+        for (size_t r = 0; r < n; r++)
+        {
+            row_sum += density[c * n + r];
+            conditional_cdf[c * n + r] = row_sum;
+        }
+        for (size_t r = 0; r < n; r++)
+        {
+            conditional_cdf[c * n + r] /= row_sum;
+        }
+        column_sum += row_sum;
+        marginal_cdf[c] = column_sum;
+    }
+    for (auto& cdf : marginal_cdf)
+    {
+        cdf /= column_sum;
+    }
+}
+
+size_t EmissionDistribution::cell(double u, double v)
+{
+    size_t c = std::min(static_cast<size_t>(u * resolution), resolution - 1);
+    size_t r = std::min(static_cast<size_t>(v * resolution), resolution - 1);
+    return c * resolution + r;
+}
+
+double EmissionDistribution::sample(double& u, double& v) const
+{
+    if (density.empty()) return 1.0;
+
+    constexpr size_t n = resolution;
+
+    // Remaps the sample within the CDF interval of the chosen cell to a position within the cell
+    auto warp = [](double& x, const double* cdf)
+    {
+        size_t i = 0;
+        while (i < n - 1 && cdf[i] <= x) i++;
+        double begin = i == 0 ? 0.0 : cdf[i - 1];
+        x = std::min((i + (x - begin) / (cdf[i] - begin)) / n, 1.0 - 0x1p-53);
+        return i;
+    };
+
+    size_t c = warp(u, marginal_cdf.data());
+    size_t r = warp(v, conditional_cdf.data() + c * n);
+    return density[c * n + r];
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**************************************************************************
+Piecewise constant distribution of the 2D samples that are warped into
+emission directions of a light, with the weights of a grid of cells over
+the unit square mixed with a uniform distribution. The samples are warped
+by inverting the marginal and conditional CDFs, which keeps their
+stratification, and the density of the warped samples is returned so that
+the flux of the photons can be divided by it.
+**************************************************************************/
+class EmissionDistribution
+{
+public:
+    // Uniform distribution
+    EmissionDistribution() { }
+
+    // The weights of the resolution x resolution cells, indexed by cell(u, v)
+    EmissionDistribution(const std::vector<double>& weights);
+
+    // Warps the uniform sample (u, v) and returns its density relative to the uniform distribution
+    double sample(double& u, double& v) const;
+
+    static size_t cell(double u, double v);
+
+    static constexpr size_t resolution = 16;
+
+private:
+    std::vector<double> marginal_cdf;    // of the columns u
+    std::vector<double> conditional_cdf; // of the rows v in each column
+    std::vector<double> density;
+
+    // Fraction of the samples that are distributed uniformly, so that every direction is sampled
+    static constexpr double uniform_fraction = 0.25;
+};
@@ -0,0 +1,69 @@
+#include "importance-map.hpp"
+
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+ImportanceMap::ImportanceMap(const BoundingBox& BB)
+    : origin(BB.min)
+{
+    glm::dvec3 cell_size = BB.dimensions() / static_cast<double>(resolution);
+    for (int c = 0; c < 3; c++)
+    {
+        if (cell_size[c] > 0.0) inv_cell_size[c] = 1.0 / cell_size[c];
+    }
+}
+
+size_t ImportanceMap::cell(const glm::dvec3& p) const
+{
+    glm::dvec3 q = glm::clamp((p - origin) * inv_cell_size, 0.0, static_cast<double>(resolution - 1));
+    return ((size_t)q.x * resolution + (size_t)q.y) * resolution + (size_t)q.z;
+}
+
+/**************************************************************************
+Each cell takes the largest importance of its 3x3x3 neighbourhood, since
+the importons only sample the visible surfaces sparsely and the photons
+just outside of a visible cell are still found by searches inside it.
+**************************************************************************/
+void ImportanceMap::set(const std::vector<double>& deposited)
+{
+    double total = 0.0;
+    size_t num_reached = 0;
+    for (double d : deposited)
+    {
+        total += d;
+        if (d > 0.0) num_reached++;
+    }
+
+    if (num_reached == 0)
+    {
+        importance.clear();
+        return;
+    }
+
+    double inv_mean = num_reached / total;
+
+    const int n = static_cast<int>(resolution);
+    importance.assign(numCells(), 0.0f);
+    for (int x = 0; x < n; x++)
+    {
+        for (int y = 0; y < n; y++)
+        {
+            for (int z = 0; z < n; z++)
+            {
+                double max_deposited = 0.0;
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, n - 1); nx++)
+                {
+                    for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, n - 1); ny++)
+                    {
+                        for (int nz = std::max(z - 1, 0); nz <= std::min(z + 1, n - 1); nz++)
+                        {
+                            max_deposited = std::max(max_deposited, deposited[(nx * n + ny) * n + nz]);
+                        }
+                    }
+                }
+                importance[(x * n + y) * n + z] = (float)std::clamp(max_deposited * inv_mean, min_importance, 1.0);
+            }
+        }
+    }
+}
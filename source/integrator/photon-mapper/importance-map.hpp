@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "../../common/bounding-box.hpp"
+
+/**************************************************************************
+Coarse grid of the visual importance of the scene, i.e. how much light
+arriving in each region contributes to the image, estimated by tracing
+importons from the camera as in Peter and Pietrek, Importance Driven
+Construction of Photon Maps. The importance is relative to the mean of
+the cells that importons reached and clamped to [min_importance, 1], so
+it can be used directly as the probability of storing or continuing a
+photon, which keeps every region reachable.
+**************************************************************************/
+class ImportanceMap
+{
+public:
+    ImportanceMap() { }
+
+    ImportanceMap(const BoundingBox& BB);
+
+    // Index of the cell that contains p, which is clamped to the grid
+    size_t cell(const glm::dvec3& p) const;
+
+    // Sets the importance from the importance deposited in each cell by the importons
+    void set(const std::vector<double>& deposited);
+
+    // 1 everywhere if the importance is not set
+    double operator()(const glm::dvec3& p) const
+    {
+        return importance.empty() ? 1.0 : importance[cell(p)];
+    }
+
+    size_t numCells() const
+    {
+        return resolution * resolution * resolution;
+    }
+
+    static constexpr double min_importance = 0.05;
+
+private:
+    static constexpr size_t resolution = 32;
+
+    glm::dvec3 origin = glm::dvec3(0.0);
+    glm::dvec3 inv_cell_size = glm::dvec3(0.0);
+    std::vector<float> importance;
+};
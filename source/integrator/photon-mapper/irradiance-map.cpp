@@ -0,0 +1,30 @@
+#include "irradiance-map.hpp"
+
+#include <glm/glm.hpp>
+
+#include "../../kd-tree/kd-tree.cpp"
+
+IrradianceMap::IrradianceMap(std::vector<Record> &&records) 
+    : kd_tree(std::move(records)) { }
+
+bool IrradianceMap::lookup(const glm::dvec3& p, const glm::dvec3& normal, glm::dvec3& irradiance) const
+{
+    thread_local FixedMaxHeap<SearchResult<Record>> records;
+    kd_tree.knnSearch(p, num_candidates, records);
+
+    const SearchResult<Record>* nearest = nullptr;
+    for (const auto& r : records.container())
+    {
+        if (glm::dot(glm::dvec3(r.data.normal), normal) >= min_cos_normal && (!nearest || r.distance2 < nearest->distance2))
+        {
+            nearest = &r;
+        }
+    }
+
+    if (!nearest)
+    {
+        return false;
+    }
+    irradiance = nearest->data.irradiance;
+    return true;
+}
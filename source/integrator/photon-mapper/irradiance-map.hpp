@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "../../kd-tree/kd-tree.hpp"
+
+/**************************************************************************
+Irradiance precomputed at a subset of the global photons, as described by
+Christensen in Faster Photon Map Global Illumination. The radiance of a 
+Lambertian surface is then given by its reflectance and the irradiance of
+the single nearest record on the same side of the surface, instead of by 
+a search for the k nearest photons and one BSDF evaluation per photon.
+**************************************************************************/
+class IrradianceMap
+{
+public:
+    struct Record
+    {
+        Record() { }
+        Record(const glm::dvec3& position, const glm::dvec3& normal, const glm::dvec3& irradiance)
+            : position(position), normal(normal), irradiance(irradiance) { }
+
+        glm::dvec3 pos() const
+        {
+            return position;
+        }
+
+        glm::dvec3 position;
+        glm::vec3 normal;     // oriented towards the side the photons arrived from
+        glm::vec3 irradiance;
+    };
+
+    IrradianceMap() { }
+
+    // Takes ownership of the records, which are reordered in place into the search structure.
+    IrradianceMap(std::vector<Record> &&records);
+
+    // Finds the irradiance of the nearest record with a normal similar to the normal, returns false if none is found
+    bool lookup(const glm::dvec3& p, const glm::dvec3& normal, glm::dvec3& irradiance) const;
+
+    size_t size() const
+    {
+        return kd_tree.heap_data.size();
+    }
+
+private:
+    KDTree<Record> kd_tree;
+
+    // Nearest records considered by lookup, of which the closest one with a similar normal is used
+    static constexpr size_t num_candidates = 4;
+
+    // Minimum cosine of the angle between the normals of a record and the looked up surface
+    static constexpr double min_cos_normal = 0.9;
+};
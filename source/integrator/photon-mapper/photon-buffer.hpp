@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "photon.hpp"
+
+/*************************************************************************
+Photons stored by one thread during emission. The photons are appended
+to fixed-size chunks, so the buffer grows without reallocating and
+copying the stored photons, and each chunk is freed as soon as it has
+been moved into a photon map. All buffers draw their chunks from a
+shared Budget, which bounds the memory of the stored photons.
+*************************************************************************/
+class PhotonBuffer
+{
+public:
+    static constexpr size_t chunk_size = 1 << 14; // 256 KiB
+
+    class Budget
+    {
+    public:
+        // Unlimited if max_bytes is 0. Chunks are only counted once they are full, so the reserved
+        // chunks are the chunks that the threads are filling when the budget is reached.
+        void reset(size_t max_bytes, size_t reserved_chunks)
+        {
+            max_chunks = max_bytes / (chunk_size * sizeof(Photon));
+            reserved = reserved_chunks;
+            filled = 0;
+        }
+
+        bool reached() const
+        {
+            return max_chunks != 0 && filled.load(std::memory_order_relaxed) + reserved >= max_chunks;
+        }
+
+        void fill()
+        {
+            filled.fetch_add(1, std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<size_t> filled{ 0 };
+        size_t max_chunks = 0;
+        size_t reserved = 0;
+    };
+
+    template <class... Args>
+    void emplace_back(Budget &budget, Args&&... args)
+    {
+        if (num_photons == chunks.size() * chunk_size)
+        {
+            chunks.push_back(std::make_unique<Photon[]>(chunk_size));
+        }
+        chunks.back()[num_photons % chunk_size] = Photon(std::forward<Args>(args)...);
+        num_photons++;
+        if (num_photons % chunk_size == 0)
+        {
+            budget.fill();
+        }
+    }
+
+    size_t size() const
+    {
+        return num_photons;
+    }
+
+    // Appends the photons to dst and frees each chunk once it is copied
+    void moveTo(std::vector<Photon> &dst)
+    {
+        size_t remaining = num_photons;
+        for (auto &chunk : chunks)
+        {
+            size_t n = std::min(remaining, chunk_size);
+            dst.insert(dst.end(), chunk.get(), chunk.get() + n);
+            chunk.reset();
+            remaining -= n;
+        }
+        chunks.clear();
+        num_photons = 0;
+    }
+
+private:
+    std::vector<std::unique_ptr<Photon[]>> chunks;
+    size_t num_photons = 0;
+};
@@ -0,0 +1,140 @@
+#include "photon-map.hpp"
+
+#include <algorithm>
+
+#include "../../common/binary-file.hpp"
+
+#include "../../octree/linear-octree.cpp"
+#include "../../kd-tree/kd-tree.cpp"
+
+PhotonMap::PhotonMap(std::vector<Photon> &&photons, const BoundingBox &BB, Structure structure, size_t max_node_data)
+    : structure(structure)
+{
+    if (structure == KD_TREE)
+    {
+        kd_tree = KDTree<Photon>(std::move(photons));
+    }
+    else
+    {
+        octree = LinearOctree<Photon>(std::move(photons), BB, max_node_data);
+    }
+}
+
+void PhotonMap::knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchIndex>& result) const
+{
+    if (structure == KD_TREE)
+    {
+        kd_tree.knnSearch(p, k, result);
+    }
+    else
+    {
+        octree.knnSearch(p, k, result);
+    }
+}
+
+void PhotonMap::radiusSearch(const glm::dvec3& p, double radius, std::vector<SearchIndex>& result) const
+{
+    if (structure == KD_TREE)
+    {
+        kd_tree.radiusSearch(p, radius, result);
+    }
+    else
+    {
+        octree.radiusSearch(p, radius, result);
+    }
+}
+
+// The kd-tree has no shared traversal, so it searches the points one by one
+void PhotonMap::knnSearch(const glm::dvec3* points, size_t num_points, size_t k, FixedMaxHeap<SearchIndex>* results) const
+{
+    if (structure == KD_TREE)
+    {
+        for (size_t i = 0; i < num_points; i++) kd_tree.knnSearch(points[i], k, results[i]);
+    }
+    else
+    {
+        octree.knnSearch(points, num_points, k, results);
+    }
+}
+
+void PhotonMap::radiusSearch(const glm::dvec3* points, size_t num_points, double radius, std::vector<SearchIndex>* results) const
+{
+    if (structure == KD_TREE)
+    {
+        for (size_t i = 0; i < num_points; i++) kd_tree.radiusSearch(points[i], radius, results[i]);
+    }
+    else
+    {
+        octree.radiusSearch(points, num_points, radius, results);
+    }
+}
+
+size_t PhotonMap::size() const
+{
+    return structure == KD_TREE ? kd_tree.heap_data.size() : octree.ordered_data.size();
+}
+
+const std::vector<Photon>& PhotonMap::photons() const
+{
+    return structure == KD_TREE ? kd_tree.heap_data : octree.ordered_data;
+}
+
+void PhotonMap::write(std::ostream &out) const
+{
+    BinaryFile::write(out, (uint64_t)structure);
+    BinaryFile::write(out, octree.linear_tree);
+    BinaryFile::write(out, octree.ordered_data);
+    BinaryFile::write(out, kd_tree.heap_data);
+    BinaryFile::write(out, kd_tree.split_axes);
+    BinaryFile::write(out, kd_tree.BB);
+}
+
+/**************************************************************************
+Reads a photon map written by write. Returns false and leaves the photon 
+map unchanged if the data is truncated or doesn't form a valid structure.
+**************************************************************************/
+bool PhotonMap::read(std::istream &in, size_t max_bytes)
+{
+    using Octant = LinearOctree<Photon>::LinearOctant;
+
+    uint64_t file_structure;
+    LinearOctree<Photon> file_octree;
+    KDTree<Photon> file_kd_tree;
+
+    bool valid =
+        BinaryFile::read(in, file_structure) &&
+        BinaryFile::read(in, file_octree.linear_tree, max_bytes / sizeof(Octant)) &&
+        BinaryFile::read(in, file_octree.ordered_data, max_bytes / sizeof(Photon)) &&
+        BinaryFile::read(in, file_kd_tree.heap_data, max_bytes / sizeof(Photon)) &&
+        BinaryFile::read(in, file_kd_tree.split_axes, max_bytes) &&
+        BinaryFile::read(in, file_kd_tree.BB);
+
+    valid = valid && (file_structure == OCTREE || file_structure == KD_TREE) &&
+            file_kd_tree.split_axes.size() == file_kd_tree.heap_data.size() &&
+            std::all_of(file_kd_tree.split_axes.begin(), file_kd_tree.split_axes.end(), [](uint8_t axis)
+            {
+                return axis < 3;
+            });
+
+    // Each inner node of the octree is followed by its first child
+    const auto &nodes = file_octree.linear_tree;
+    for (size_t i = 0; valid && i < nodes.size(); i++)
+    {
+        const Octant &node = nodes[i];
+        valid = node.start_data <= file_octree.ordered_data.size() &&
+                node.contained_data <= file_octree.ordered_data.size() - node.start_data &&
+                (node.leaf || i + 1 < nodes.size()) &&
+                (node.next_sibling == 0xFFFFFFFFu || (node.next_sibling > i && node.next_sibling < nodes.size()));
+    }
+
+    if (!valid)
+    {
+        return false;
+    }
+
+    structure = static_cast<Structure>(file_structure);
+    octree = std::move(file_octree);
+    octree.computeScanPositions();
+    kd_tree = std::move(file_kd_tree);
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <istream>
+#include <ostream>
+
+#include <glm/vec3.hpp>
+
+#include "photon.hpp"
+#include "../../octree/linear-octree.hpp"
+#include "../../kd-tree/kd-tree.hpp"
+
+/**************************************************************************
+Photon map with a selectable search structure. The octree adapts the size
+of its leaves to the local photon density, while the left-balanced kd-tree 
+splits each node along the axis of largest extent, which keeps searches 
+tight for anisotropic distributions such as caustics on thin surfaces.
+**************************************************************************/
+class PhotonMap
+{
+public:
+    enum Structure { OCTREE, KD_TREE };
+
+    PhotonMap() { }
+
+    // Takes ownership of the photons, which are reordered in place into the search structure.
+    PhotonMap(std::vector<Photon> &&photons, const BoundingBox &BB, Structure structure, size_t max_node_data);
+
+    // The results are indices into photons()
+    void knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchIndex>& result) const;
+    void radiusSearch(const glm::dvec3& p, double radius, std::vector<SearchIndex>& result) const;
+
+    // Batched searches for query points that are close to each other, e.g. sorted in Morton order
+    void knnSearch(const glm::dvec3* points, size_t num_points, size_t k, FixedMaxHeap<SearchIndex>* results) const;
+    void radiusSearch(const glm::dvec3* points, size_t num_points, double radius, std::vector<SearchIndex>* results) const;
+
+    size_t size() const;
+
+    // Photons in the order of the search structure
+    const std::vector<Photon>& photons() const;
+
+    // Writes the search structure as raw data, which is read back without constructing it again.
+    // The photon positions are relative to the photon bounds, which must be the same when read.
+    void write(std::ostream &out) const;
+    bool read(std::istream &in, size_t max_bytes);
+
+private:
+    Structure structure = OCTREE;
+
+    LinearOctree<Photon> octree;
+    KDTree<Photon> kd_tree;
+};
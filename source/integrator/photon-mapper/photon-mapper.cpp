@@ -4,6 +4,10 @@
 #include <iomanip>
 #include <thread>
 #include <atomic>
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <stdexcept>
 
 #include <glm/gtx/component_wise.hpp>
 
@@ -13,30 +17,157 @@
 #include "../../common/work-queue.hpp"
 #include "../../common/constants.hpp"
 #include "../../common/format.hpp"
+#include "../../common/binary-file.hpp"
+#include "../../common/parallel.hpp"
 #include "../../material/material.hpp"
 #include "../../surface/surface.hpp"
 #include "../../ray/interaction.hpp"
 
-#include "../../octree/octree.cpp"
-#include "../../octree/linear-octree.cpp"
-
 PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
 {
-    constexpr bool print = true;
-
     const nlohmann::json& pm = j.at("photon_map");
 
     double caustic_factor = pm.at("caustic_factor");
-    size_t photon_emissions = pm.at("emissions");
+    photon_emissions = pm.at("emissions");
 
     k_nearest_photons = getOptional(pm, "k_nearest_photons", 50);
     non_caustic_reject = 1.0 / caustic_factor;
     max_node_data = getOptional(pm, "max_photons_per_octree_leaf", 200);
+
+    std::string structure = getOptional<std::string>(pm, "structure", "OCTREE");
+    std::transform(structure.begin(), structure.end(), structure.begin(), toupper);
+    map_structure = structure == "KD_TREE" ? PhotonMap::KD_TREE : PhotonMap::OCTREE;
     direct_visualization = getOptional(pm, "direct_visualization", false);
+    precompute_irradiance = getOptional(pm, "precompute_irradiance", false);
+    memory_budget = getOptional(pm, "memory_budget_mb", size_t(0)) << 20;
+    num_importons = getOptional(pm, "importons", size_t(0));
+
+    // The budget must leave room for at least one full chunk per light beyond the chunks that the threads are filling
+    size_t min_memory_budget = (reserved_chunks_per_thread * num_threads + scene.emissives.size()) * PhotonBuffer::chunk_size * sizeof(Photon);
+    if (memory_budget != 0 && memory_budget < min_memory_budget)
+    {
+        throw std::runtime_error("The photon map memory_budget_mb must be at least " + std::to_string((min_memory_budget + (1 << 20) - 1) >> 20) +
+                                 " with " + std::to_string(num_threads) + " threads and " + std::to_string(scene.emissives.size()) + " light sources.");
+    }
 
     photon_emissions = static_cast<size_t>(photon_emissions * caustic_factor);
 
-    // Emissions per work
+    // The cache is not used when animating, since the photon maps are emitted again for each frame,
+    // or with importons, since the photon maps then depend on the camera
+    cache = scene.num_frames > 1 || num_importons != 0 ? "" : getOptional<std::string>(pm, "cache", "");
+    if (!cache.empty())
+    {
+        cache_hash = cacheHash(j);
+    }
+}
+
+void PhotonMapper::beginPass(size_t pass, size_t num_pixels)
+{
+    std::filesystem::path cache_path = Scene::path / cache;
+    if (cache.empty() || !readCache(cache_path))
+    {
+        emitPhotons();
+
+        if (!cache.empty())
+        {
+            writeCache(cache_path);
+        }
+    }
+
+    if (precompute_irradiance)
+    {
+        precomputeIrradiance();
+    }
+}
+
+/**************************************************************************
+Estimates the irradiance at every irradiance_record_spacing:th photon of
+the global photon map in parallel. The normal of the surface each record
+lies on is found by tracing a ray back along the photon direction, which 
+lets the irradiance estimate skip photons that arrived from the other side.
+**************************************************************************/
+void PhotonMapper::precomputeIrradiance()
+{
+    auto before = std::chrono::high_resolution_clock::now();
+
+    irradiance_map = IrradianceMap();
+
+    const std::vector<Photon>& photons = global_map.photons();
+    std::vector<IrradianceMap::Record> records((photons.size() + irradiance_record_spacing - 1) / irradiance_record_spacing);
+
+    // Larger than the error of the quantized photon positions
+    double offset = glm::length(scene.BB().dimensions()) * 1e-5;
+
+    Parallel::forChunks(records.size(), 1024, [&](size_t chunk, size_t begin, size_t end)
+    {
+        // The photons are in the order of the search structure, so consecutive records are close to
+        // each other and are searched in batches
+        constexpr size_t batch_size = 64;
+        std::array<glm::dvec3, batch_size> positions;
+        std::array<FixedMaxHeap<SearchIndex>, batch_size> nearest;
+
+        for (size_t batch = begin; batch < end; batch += batch_size)
+        {
+            size_t batch_end = std::min(batch + batch_size, end);
+            for (size_t i = batch; i < batch_end; i++)
+            {
+                positions[i - batch] = photons[i * irradiance_record_spacing].pos();
+            }
+            global_map.knnSearch(positions.data(), batch_end - batch, k_nearest_photons, nearest.data());
+
+            for (size_t i = batch; i < batch_end; i++)
+            {
+                const glm::dvec3& position = positions[i - batch];
+                glm::dvec3 direction = photons[i * irradiance_record_spacing].dir();
+
+                glm::dvec3 normal = direction;
+                Ray ray(position + direction * offset, -direction, scene.ior);
+                Intersection intersection = scene.intersect(ray);
+                if (intersection && intersection.t < 2.0 * offset)
+                {
+                    normal = intersection.surface->normal(intersection, ray(intersection.t));
+                    if (glm::dot(normal, direction) < 0.0)
+                    {
+                        normal = -normal;
+                    }
+                }
+
+                glm::dvec3 irradiance(0.0);
+                const auto& found = nearest[i - batch];
+                if (!found.empty())
+                {
+                    for (const auto& r : found.container())
+                    {
+                        const Photon& photon = photons[r.index];
+                        if (glm::dot(photon.dir(), normal) > 0.0)
+                        {
+                            irradiance += photon.flux();
+                        }
+                    }
+                    irradiance /= found.top().distance2 * C::PI;
+                }
+                records[i] = IrradianceMap::Record(position, normal, irradiance);
+            }
+        }
+    });
+
+    size_t num_records = records.size();
+    irradiance_map = IrradianceMap(std::move(records));
+
+    auto now = std::chrono::high_resolution_clock::now();
+    std::cout << "Irradiance precomputed at " << Format::largeNumber(num_records) << " photons in "
+              << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(now - before).count()) << "." << std::endl;
+}
+
+void PhotonMapper::emitPhotons(size_t pass, bool print)
+{
+    // The importance is traced again for each frame, but not for each pass of progressive integrators
+    if (num_importons != 0 && pass == 0 && camera_ray)
+    {
+        traceImportance();
+    }
+
+    // Maximum emissions per work
     constexpr size_t EPW = 100000;
 
     double total_add_flux = 0.0;
@@ -58,6 +189,8 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
     };
 
     std::vector<EmissionWork> work_vec;
+    std::vector<size_t> light_emissions(scene.emissives.size());
+    std::vector<glm::dvec3> light_fluxes(scene.emissives.size());
 
     for(size_t i = 0; i < scene.emissives.size(); i++)
     {
@@ -70,37 +203,82 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
         }
         double photon_emissions_share = glm::compAdd(light_flux) / total_add_flux;
         size_t num_light_emissions = static_cast<size_t>(photon_emissions * photon_emissions_share);
-        glm::dvec3 photon_flux = light_flux / static_cast<double>(num_light_emissions);
+        light_emissions[i] = num_light_emissions;
+        light_fluxes[i] = light_flux / static_cast<double>(num_light_emissions);
+    }
+
+    // The emissions of every light are split into the same number of rounds, which are queued one after
+    // the other, so that all lights advance at the same relative rate if the memory budget stops the
+    // emission. The work within a round is shuffled.
+    size_t num_rounds = 1;
+    for (size_t num_light_emissions : light_emissions)
+    {
+        num_rounds = std::max(num_rounds, (num_light_emissions + EPW - 1) / EPW);
+    }
+
+    // With a memory budget, a round emits at most about as many photons as fit in half of the full chunks 
+    // allowed by the budget, so that every light emits in the first round before the budget is reached
+    if (memory_budget != 0)
+    {
+        size_t max_chunks = memory_budget / (PhotonBuffer::chunk_size * sizeof(Photon));
+        size_t round_emissions = std::max((max_chunks - reserved_chunks_per_thread * Integrator::num_threads) * PhotonBuffer::chunk_size / 2, size_t(1));
+        num_rounds = std::max(num_rounds, (photon_emissions + round_emissions - 1) / round_emissions);
+    }
 
-        size_t count = 0;
-        while (count != num_light_emissions)
+    for (size_t round = 0; round < num_rounds; round++)
+    {
+        size_t round_begin = work_vec.size();
+        for (size_t i = 0; i < scene.emissives.size(); i++)
         {
-            size_t emissions = count + EPW > num_light_emissions ? num_light_emissions - count : EPW;
-            work_vec.emplace_back(i, count, emissions, photon_flux);
-            count += emissions;
+            size_t begin = light_emissions[i] * round / num_rounds;
+            size_t end = light_emissions[i] * (round + 1) / num_rounds;
+            if (end > begin)
+            {
+                work_vec.emplace_back(i, begin, end - begin, light_fluxes[i]);
+            }
         }
+        std::shuffle(work_vec.begin() + round_begin, work_vec.end(), Random::engine);
     }
 
-    std::shuffle(work_vec.begin(), work_vec.end(), Random::engine);
     WorkQueue<EmissionWork> work_queue(work_vec);
 
     std::vector<std::unique_ptr<std::thread>> threads(Integrator::num_threads);
 
-    caustic_vecs.resize(threads.size());
-    global_vecs.resize(threads.size());
+    // The maps of the previous frame are released first, since photon positions are stored relative to the scene bounds
+    global_map = PhotonMap();
+    caustic_map = PhotonMap();
+    Photon::setBounds(scene.BB());
+
+    caustic_buffers.resize(threads.size());
+    global_buffers.resize(threads.size());
+
+    photon_budget.reset(memory_budget, reserved_chunks_per_thread * threads.size());
+
+    // Emissions of each work of a thread and the photons they stored, which are rescaled if the
+    // memory budget stops the emission before all work is done
+    struct EmittedWork
+    {
+        size_t light_index;
+        size_t num_emissions;
+        size_t caustic_begin, caustic_end;
+        size_t global_begin, global_end;
+    };
+    std::vector<std::vector<EmittedWork>> emitted_work(threads.size());
 
     for (size_t thread = 0; thread < threads.size(); thread++)
     {
         threads[thread] = std::make_unique<std::thread>
         (
-            [this, &work_queue, thread]()
+            [this, &work_queue, &emitted_work, thread, pass]()
             {
                 EmissionWork work;
-                while (work_queue.getWork(work))
+                while (!photon_budget.reached() && work_queue.getWork(work))
                 {
+                    EmittedWork emitted{ work.light_index, 0, caustic_buffers[thread].size(), 0, global_buffers[thread].size(), 0 };
+
                     auto light = scene.emissives[work.light_index];
-                    Sampler::initiate(static_cast<uint32_t>(work.light_index));
-                    for (size_t i = 0; i < work.num_emissions; i++)
+                    Sampler::initiate(static_cast<uint32_t>(pass * scene.emissives.size() + work.light_index));
+                    for (size_t i = 0; i < work.num_emissions && !photon_budget.reached(); i++)
                     {
                         Sampler::setIndex(static_cast<uint32_t>(work.emissions_offset + i));
 
@@ -108,15 +286,26 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
                         glm::dvec3 pos = (*light)(u[0], u[1]);
                         glm::dvec3 normal = light->normal(pos);
                         glm::dvec3 dir;
+                        glm::dvec3 flux = work.photon_flux;
                         if (light->material->isLaser) {
                             dir = light->material->laserDirection;
                         } else {
+                            // Directions towards important regions are sampled more often, with less flux each
+                            if (!emission_distributions.empty())
+                            {
+                                flux /= emission_distributions[work.light_index].sample(u[2], u[3]);
+                            }
                             dir = CoordinateSystem::from(Sampling::cosWeightedHemi(u[2], u[3]), normal);
                         }
                         pos += normal * C::EPSILON;
 
-                        emitPhoton(Ray(pos, dir, scene.ior), work.photon_flux, thread);
+                        emitPhoton(Ray(pos, dir, scene.ior), flux, thread);
+                        emitted.num_emissions++;
                     }
+
+                    emitted.caustic_end = caustic_buffers[thread].size();
+                    emitted.global_end = global_buffers[thread].size();
+                    emitted_work[thread].push_back(emitted);
                 }
             }
         );
@@ -124,15 +313,15 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
 
     auto begin = std::chrono::high_resolution_clock::now();
     std::unique_ptr<std::thread> print_thread;
-    if constexpr(print)
+    if (print)
     {
         std::cout << std::endl << std::string(28, '-') << "| PHOTON MAPPING PASS |" << std::string(28, '-') 
                   << std::endl << std::endl << "Total number of photon emissions from light sources: " 
                   << Format::largeNumber(photon_emissions) << std::endl << std::endl;
 
-        print_thread = std::make_unique<std::thread>([&work_queue]()
+        print_thread = std::make_unique<std::thread>([this, &work_queue]()
         {
-            while (!work_queue.empty())
+            while (!work_queue.empty() && !photon_budget.reached())
             {
                 double progress = work_queue.progress();
                 std::cout << std::string("\rPhotons emitted: " + Format::progress(progress));
@@ -147,20 +336,59 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
         thread->join();
     }
 
-    std::atomic<bool> done_constructing_octrees = false;
+    // The flux of each photon is that of its light divided by the planned emissions of the light, so if
+    // the memory budget stopped the emission, the photons of each light are scaled by the planned over
+    // the completed emissions to keep the total flux of the light
+    std::vector<size_t> completed_emissions(scene.emissives.size(), 0);
+    for (const auto& thread_work : emitted_work)
+    {
+        for (const auto& emitted : thread_work)
+        {
+            completed_emissions[emitted.light_index] += emitted.num_emissions;
+        }
+    }
+
+    std::vector<double> flux_scale(scene.emissives.size(), 1.0);
+    bool stopped_by_budget = false;
+    for (size_t i = 0; i < scene.emissives.size(); i++)
+    {
+        if (completed_emissions[i] != 0 && completed_emissions[i] < light_emissions[i])
+        {
+            flux_scale[i] = static_cast<double>(light_emissions[i]) / completed_emissions[i];
+        }
+        stopped_by_budget = stopped_by_budget || completed_emissions[i] < light_emissions[i];
+
+        // Only possible if the budget is reached in the first round, in which case the scene is missing light
+        if (completed_emissions[i] == 0 && light_emissions[i] != 0)
+        {
+            std::string error = "Error: The photon memory budget was reached before light source " + std::to_string(i) +
+                                " emitted any photons, so its light is missing. Increase memory_budget_mb.";
+            std::cout << std::endl << error << std::endl;
+            Log(error);
+        }
+    }
+
+    std::atomic<bool> done_constructing_maps = false;
     auto end = std::chrono::high_resolution_clock::now();
     std::string duration = Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count());
-    if constexpr(print)
+    if (print)
     {
-        std::string info = "\rPhotons emitted in " + duration + ". Constructing octrees";
+        if (stopped_by_budget)
+        {
+            size_t num_completed = 0;
+            for (size_t emissions : completed_emissions) num_completed += emissions;
+            std::cout << "\rPhoton memory budget reached after " << Format::largeNumber(num_completed) << " emissions." << std::endl;
+        }
+
+        std::string info = "\rPhotons emitted in " + duration + ". Constructing photon maps";
         std::cout << info;
         begin = std::chrono::high_resolution_clock::now();
             
-        print_thread = std::make_unique<std::thread>([&done_constructing_octrees, info]()
+        print_thread = std::make_unique<std::thread>([&done_constructing_maps, info]()
         {
             std::string dots("");
             int i = 0;
-            while (!done_constructing_octrees)
+            while (!done_constructing_maps)
             {
                 std::cout << "\r" + std::string(60, ' ') + info + dots;
                 dots += ".";
@@ -174,54 +402,53 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
     size_t num_global_photons = 0;
     size_t num_caustic_photons = 0;
 
-    auto insertAndPop = [](auto& pvec, auto& pmap)
+    // Moves the photons of all threads into one vector, freeing each chunk once copied so that the 
+    // photons are never stored twice, and rescales the flux if the emission was stopped
+    auto gather = [&](std::vector<PhotonBuffer>& buffers, size_t EmittedWork::*work_begin, size_t EmittedWork::*work_end)
     {
-        size_t removed_bytes = 0;
-        auto i = pvec.end();
-        while (i > pvec.begin())
+        size_t size = 0;
+        for (const auto& buffer : buffers) size += buffer.size();
+
+        std::vector<Photon> photons;
+        photons.reserve(size);
+        for (size_t thread = 0; thread < buffers.size(); thread++)
         {
-            if (removed_bytes > size_t(1e7))
+            size_t offset = photons.size();
+            buffers[thread].moveTo(photons);
+
+            if (!stopped_by_budget) continue;
+
+            for (const auto& emitted : emitted_work[thread])
             {
-                pvec.shrink_to_fit();
-                i = pvec.end();
-                removed_bytes = 0;
+                double scale = flux_scale[emitted.light_index];
+                for (size_t i = offset + emitted.*work_begin; i < offset + emitted.*work_end; i++)
+                {
+                    photons[i].setFlux(photons[i].flux() * scale);
+                }
             }
-            i--;
-            pmap.insert(*i);
-            i = pvec.erase(i);
-            removed_bytes += sizeof(Photon);
         }
-        pvec.clear();
-        pvec.shrink_to_fit();
+        return photons;
     };
 
     BoundingBox BB = scene.BB();
 
-    // Intermediate octrees that are converted to linear octrees once constructed.
-    Octree<Photon> caustic_map_t(BB, max_node_data);
-    Octree<Photon> global_map_t(BB, max_node_data);
+    // The photons are sorted in place into the photon maps, so only one photon array per map is allocated
+    std::vector<Photon> global_photons = gather(global_buffers, &EmittedWork::global_begin, &EmittedWork::global_end);
+    num_global_photons = global_photons.size();
+    global_map = PhotonMap(std::move(global_photons), BB, map_structure, max_node_data);
 
-    for (size_t thread = 0; thread < threads.size(); thread++)
-    {
-        num_global_photons += global_vecs[thread].size();
-        insertAndPop(global_vecs[thread], global_map_t);
+    std::vector<Photon> caustic_photons = gather(caustic_buffers, &EmittedWork::caustic_begin, &EmittedWork::caustic_end);
+    num_caustic_photons = caustic_photons.size();
+    caustic_map = PhotonMap(std::move(caustic_photons), BB, map_structure, max_node_data);
 
-        num_caustic_photons += caustic_vecs[thread].size();
-        insertAndPop(caustic_vecs[thread], caustic_map_t);
-    }
+    done_constructing_maps = true;
 
-    // Convert octrees to linear array representation
-    caustic_map = LinearOctree<Photon>(caustic_map_t);
-    global_map  = LinearOctree<Photon>(global_map_t);
-
-    done_constructing_octrees = true;
-
-    if constexpr(print)
+    if (print)
     {
         print_thread->join();
         end = std::chrono::high_resolution_clock::now();
         std::string duration2 = Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count());
-        std::cout << "\rPhotons emitted in " + duration + ". Octrees constructed in " + duration2 + "." << std::endl << std::endl
+        std::cout << "\rPhotons emitted in " + duration + ". Photon maps constructed in " + duration2 + "." << std::endl << std::endl
                   << "Photon maps and numbers of stored photons: " << std::endl << std::endl;
 
         std::cout << std::right
@@ -230,6 +457,175 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
     }
 }
 
+/**************************************************************************
+Traces importons from the camera, which deposit their weight in the cell
+of each surface they hit, and sets the importance from the deposits. The 
+emission distribution of each light is then given by the importance that
+pilot photons emitted in each cell of the sample square reach.
+**************************************************************************/
+void PhotonMapper::traceImportance()
+{
+    auto before = std::chrono::high_resolution_clock::now();
+
+    // Seeds of the importons and the pilot photons, apart from those of the emitted photons
+    constexpr uint32_t importon_seed = 0xFFFFFFFFu;
+
+    importance_map = ImportanceMap(scene.BB());
+    emission_distributions.clear();
+
+    const size_t num_cells = importance_map.numCells();
+    std::vector<std::vector<double>> chunk_deposits(Parallel::numThreads());
+
+    Parallel::forChunks(num_importons, 1024, [&](size_t chunk, size_t begin, size_t end)
+    {
+        auto& deposits = chunk_deposits[chunk];
+        deposits.assign(num_cells, 0.0);
+
+        glm::dvec3 bsdf_absIdotN;
+        double bsdf_pdf;
+
+        Sampler::initiate(importon_seed);
+        for (size_t i = begin; i < end; i++)
+        {
+            Sampler::setIndex(static_cast<uint32_t>(i));
+            auto u = Sampler::get<Dim::PIXEL, 2>();
+            Ray ray = camera_ray(glm::dvec2(u[0], u[1]));
+            RefractionHistory refraction_history(ray);
+
+            double weight = 1.0;
+            for (uint16_t depth = 0; depth < max_importon_depth; depth++)
+            {
+                Sampler::nextSequence();
+
+                Intersection intersection = scene.intersect(ray);
+                if (!intersection) break;
+
+                Interaction interaction(intersection, ray, refraction_history.externalIOR(ray));
+
+                // Specular surfaces are included, since photons are continued with the importance there
+                deposits[importance_map.cell(interaction.position)] += weight;
+
+                if (!interaction.sampleBSDF(bsdf_absIdotN, bsdf_pdf, ray)) break;
+
+                weight *= std::min(glm::compMax(bsdf_absIdotN) / bsdf_pdf, 1.0);
+                refraction_history.update(ray);
+            }
+        }
+    });
+
+    std::vector<double> deposited(num_cells, 0.0);
+    for (const auto& deposits : chunk_deposits)
+    {
+        for (size_t i = 0; i < deposits.size(); i++) deposited[i] += deposits[i];
+    }
+    importance_map.set(deposited);
+
+    constexpr size_t num_sample_cells = EmissionDistribution::resolution * EmissionDistribution::resolution;
+
+    // The num_importons pilot photons are shared by the lights in proportion to their flux. Lights with fewer
+    // pilots than sample cells can't estimate a distribution and are emitted uniformly.
+    const size_t num_lights = scene.emissives.size();
+    std::vector<double> light_flux(num_lights, 0.0);
+    double total_flux = 0.0;
+    for (size_t l = 0; l < num_lights; l++)
+    {
+        const auto& light = scene.emissives[l];
+        if (light->material->isLaser) continue;
+        light_flux[l] = glm::compAdd(light->material->emittance * light->area());
+        total_flux += light_flux[l];
+    }
+
+    // Pilots [pilots_begin[l], pilots_begin[l + 1]) are emitted from light l
+    std::vector<size_t> pilots_begin(num_lights + 1, 0);
+    for (size_t l = 0; l < num_lights; l++)
+    {
+        size_t num_light_pilots = total_flux > 0.0 ? static_cast<size_t>(num_importons * light_flux[l] / total_flux) : 0;
+        if (num_light_pilots < num_sample_cells) num_light_pilots = 0;
+        pilots_begin[l + 1] = pilots_begin[l] + num_light_pilots;
+    }
+    size_t num_pilots = pilots_begin.back();
+
+    std::vector<std::vector<double>> chunk_weights(Parallel::numThreads());
+    Parallel::forChunks(num_pilots, 1024, [&](size_t chunk, size_t begin, size_t end)
+    {
+        auto& weights = chunk_weights[chunk];
+        weights.assign(num_lights * num_sample_cells, 0.0);
+
+        size_t l = std::upper_bound(pilots_begin.begin(), pilots_begin.end(), begin) - pilots_begin.begin() - 1;
+        Sampler::initiate(importon_seed - 1u - static_cast<uint32_t>(l));
+        for (size_t i = begin; i < end; i++)
+        {
+            while (i >= pilots_begin[l + 1])
+            {
+                Sampler::initiate(importon_seed - 1u - static_cast<uint32_t>(++l));
+            }
+            Sampler::setIndex(static_cast<uint32_t>(i - pilots_begin[l]));
+
+            const auto& light = scene.emissives[l];
+            auto u = Sampler::get<Dim::PM_LIGHT, 4>();
+            glm::dvec3 pos = (*light)(u[0], u[1]);
+            glm::dvec3 normal = light->normal(pos);
+            glm::dvec3 dir = CoordinateSystem::from(Sampling::cosWeightedHemi(u[2], u[3]), normal);
+            pos += normal * C::EPSILON;
+
+            weights[l * num_sample_cells + EmissionDistribution::cell(u[2], u[3])] += pilotImportance(Ray(pos, dir, scene.ior));
+        }
+    });
+
+    emission_distributions.resize(num_lights);
+    for (size_t l = 0; l < num_lights; l++)
+    {
+        if (pilots_begin[l + 1] == pilots_begin[l]) continue;
+
+        std::vector<double> weights(num_sample_cells, 0.0);
+        for (const auto& chunk : chunk_weights)
+        {
+            if (chunk.empty()) continue;
+            for (size_t i = 0; i < num_sample_cells; i++) weights[i] += chunk[l * num_sample_cells + i];
+        }
+        emission_distributions[l] = EmissionDistribution(weights);
+    }
+
+    auto now = std::chrono::high_resolution_clock::now();
+    std::cout << std::endl << "Importance traced with " << Format::largeNumber(num_importons) << " importons and "
+              << Format::largeNumber(num_pilots) << " pilot photons in "
+              << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(now - before).count()) << "." << std::endl;
+}
+
+/**************************************************************************
+Sum of the importance at the first max_importon_depth positions where a
+photon emitted along the ray would be stored, weighted by the fraction of 
+the flux of the photon that reaches each position.
+**************************************************************************/
+double PhotonMapper::pilotImportance(Ray ray)
+{
+    RefractionHistory refraction_history(ray);
+    glm::dvec3 bsdf_absIdotN;
+    double bsdf_pdf;
+
+    double weight = 1.0, importance = 0.0;
+    for (uint16_t depth = 0; depth < max_importon_depth; depth++)
+    {
+        Sampler::nextSequence();
+
+        Intersection intersection = scene.intersect(ray);
+        if (!intersection) break;
+
+        Interaction interaction(intersection, ray, refraction_history.externalIOR(ray));
+
+        if (!interaction.material->dirac_delta && (store_direct_photons || ray.depth != 0))
+        {
+            importance += weight * importance_map(interaction.position);
+        }
+
+        if (!interaction.sampleBSDF(bsdf_absIdotN, bsdf_pdf, ray, true)) break;
+
+        weight *= std::min(glm::compMax(bsdf_absIdotN) / bsdf_pdf, 1.0);
+        refraction_history.update(ray);
+    }
+    return importance;
+}
+
 void PhotonMapper::emitPhoton(Ray ray, glm::dvec3 flux, size_t thread)
 {
     RefractionHistory refraction_history(ray);
@@ -256,16 +652,23 @@ void PhotonMapper::emitPhoton(Ray ray, glm::dvec3 flux, size_t thread)
 
 
 
+        // Photons are stored and continued with the probability of the importance of the position
+        double importance = importance_map(interaction.position);
+
         // Only spawn photons at locations that can produce non-dirac delta interactions.
-        if (!interaction.material->dirac_delta)
+        if (!interaction.material->dirac_delta && (store_direct_photons || ray.depth != 0))
         {
+            double u = Sampler::get<Dim::PM_REJECT>()[0];
             if (ray.dirac_delta)
             {
-                caustic_vecs[thread].emplace_back(flux, interaction.position, -ray.direction);
+                if (importance > u)
+                {
+                    caustic_buffers[thread].emplace_back(photon_budget, flux / importance, interaction.position, -ray.direction);
+                }
             }
-            else if(non_caustic_reject > Sampler::get<Dim::PM_REJECT>()[0])
+            else if(non_caustic_reject * importance > u)
             {
-                global_vecs[thread].emplace_back(flux / non_caustic_reject, interaction.position, -ray.direction);
+                global_buffers[thread].emplace_back(photon_budget, flux / (non_caustic_reject * importance), interaction.position, -ray.direction);
             }
         }
         
@@ -280,7 +683,7 @@ void PhotonMapper::emitPhoton(Ray ray, glm::dvec3 flux, size_t thread)
         // Based on slide 13 of:
         // https://cgg.mff.cuni.cz/~jaroslav/teaching/2015-npgr010/slides/11%20-%20npgr010-2015%20-%20PM.pdf
         // I.e. reduce survival probability rather than flux to keep flux of spawned photons roughly constant.
-        double survive = std::min(glm::compMax(bsdf_absIdotN), 0.95);
+        double survive = std::min(glm::compMax(bsdf_absIdotN) * importance, 0.95);
         if (survive == 0.0 || survive <= Sampler::get<Dim::ABSORB>()[0])
         {
             return;
@@ -292,7 +695,7 @@ void PhotonMapper::emitPhoton(Ray ray, glm::dvec3 flux, size_t thread)
     }
 }
 
-glm::dvec3 PhotonMapper::sampleRay(Ray ray)
+glm::dvec3 PhotonMapper::sampleRay(Ray ray, Intersection intersection)
 {
     glm::dvec3 radiance(0.0), throughput(1.0);
     RefractionHistory refraction_history(ray);
@@ -303,8 +706,6 @@ glm::dvec3 PhotonMapper::sampleRay(Ray ray)
     {
         Sampler::nextSequence();
 
-        Intersection intersection = scene.intersect(ray);
-
         if (!intersection)
         {
             return radiance;
@@ -353,29 +754,41 @@ glm::dvec3 PhotonMapper::sampleRay(Ray ray)
         }
 
         refraction_history.update(ray);
+
+        intersection = scene.intersect(ray);
     }
 }
 
 glm::dvec3 PhotonMapper::estimateGlobalRadiance(const Interaction& interaction)
 {
-    thread_local AccessiblePQ<SearchResult<Photon>> photons;
-    global_map.knnSearch(interaction.position, k_nearest_photons, photons);
-    if (photons.empty())
+    // The BSDF over the PDF of Lambertian surfaces is their reflectance for all incident directions
+    glm::dvec3 irradiance;
+    if (precompute_irradiance && !interaction.material->rough && !interaction.material->rough_specular &&
+        irradiance_map.lookup(interaction.position, interaction.normal, irradiance))
+    {
+        return irradiance * interaction.material->reflectance;
+    }
+
+    thread_local FixedMaxHeap<SearchIndex> nearest;
+    global_map.knnSearch(interaction.position, k_nearest_photons, nearest);
+    if (nearest.empty())
     {
         return glm::dvec3(0.0);
     }
     
+    const std::vector<Photon>& photons = global_map.photons();
     double bsdf_pdf;
     glm::dvec3 bsdf_absIdotN;
     glm::dvec3 radiance(0.0);
-    for (const auto& p : photons.container())
+    for (const auto& r : nearest.container())
     {
-        if (interaction.BSDF(bsdf_absIdotN, p.data.dir(), bsdf_pdf))
+        const Photon& photon = photons[r.index];
+        if (interaction.BSDF(bsdf_absIdotN, photon.dir(), bsdf_pdf))
         {
-            radiance += p.data.flux() * bsdf_absIdotN / bsdf_pdf;
+            radiance += photon.flux() * bsdf_absIdotN / bsdf_pdf;
         }
     }
-    return radiance / (photons.top().distance2 * C::PI);
+    return radiance / (nearest.top().distance2 * C::PI);
 }
 
 /********************************************************************
@@ -383,29 +796,127 @@ Cone filtering method used for sharper caustics. Simplified for k = 1
 *********************************************************************/
 glm::dvec3 PhotonMapper::estimateCausticRadiance(const Interaction& interaction)
 {
-    thread_local AccessiblePQ<SearchResult<Photon>> photons;
-    caustic_map.knnSearch(interaction.position, k_nearest_photons, photons);
-    if (photons.empty())
+    thread_local FixedMaxHeap<SearchIndex> nearest;
+    caustic_map.knnSearch(interaction.position, k_nearest_photons, nearest);
+    if (nearest.empty())
     {
         return glm::dvec3(0.0);
     }
 
-    double inv_max_squared_radius = 1.0 / photons.top().distance2;
+    double inv_max_squared_radius = 1.0 / nearest.top().distance2;
 
+    const std::vector<Photon>& photons = caustic_map.photons();
     double bsdf_pdf;
     glm::dvec3 bsdf_absIdotN;
     glm::dvec3 radiance(0.0);
-    for(const auto& p : photons.container())
+    for(const auto& r : nearest.container())
     {
-        if (interaction.BSDF(bsdf_absIdotN, p.data.dir(), bsdf_pdf))
+        const Photon& photon = photons[r.index];
+        if (interaction.BSDF(bsdf_absIdotN, photon.dir(), bsdf_pdf))
         {
-            double wp = std::max(0.0, 1.0 - std::sqrt(p.distance2 * inv_max_squared_radius));
-            radiance += (p.data.flux() * bsdf_absIdotN * wp) / bsdf_pdf;
+            double wp = std::max(0.0, 1.0 - std::sqrt(r.distance2 * inv_max_squared_radius));
+            radiance += (photon.flux() * bsdf_absIdotN * wp) / bsdf_pdf;
         }
     }
     return 3.0 * radiance * inv_max_squared_radius * C::INV_PI;
 }
 
+namespace
+{
+    constexpr uint64_t CACHE_MAGIC = 0x48434143504d4850; // "PHMPCACH"
+
+    // Changed whenever the layout of the cached data or the hash changes
+    constexpr uint64_t CACHE_VERSION = 2;
+}
+
+uint64_t PhotonMapper::cacheHash(const nlohmann::json& j) const
+{
+    // Settings that don't affect the emitted photons
+    nlohmann::json settings = j;
+    for (const auto &field : { "cameras", "bvh", "num_render_threads" })
+    {
+        settings.erase(field);
+    }
+    for (const auto &field : { "k_nearest_photons", "direct_visualization", "precompute_irradiance", "cache", "sppm" })
+    {
+        settings.at("photon_map").erase(field);
+    }
+    std::string settings_str = settings.dump();
+
+    uint64_t layout[] = { CACHE_VERSION, sizeof(Photon), sizeof(LinearOctree<Photon>::LinearOctant), scene.surfaces.size() };
+    uint64_t hash = BinaryFile::hash(layout, sizeof(layout));
+    hash = BinaryFile::hash(settings_str.data(), settings_str.size(), hash);
+
+    // The geometry is also read from mesh files, which are not part of the settings
+    for (const auto &surface : scene.surfaces)
+    {
+        hash = surface->hash(hash);
+    }
+    return hash;
+}
+
+/**************************************************************************
+Reads the photon maps written by writeCache if the file exists and was
+written for the same hash. Returns false if the file can't be used, in 
+which case the photons are emitted again.
+**************************************************************************/
+bool PhotonMapper::readCache(const std::filesystem::path& path)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+    {
+        return false;
+    }
+    size_t file_size = in.tellg();
+    in.seekg(0);
+
+    uint64_t magic, file_hash;
+    if (!BinaryFile::read(in, magic) || magic != CACHE_MAGIC || !BinaryFile::read(in, file_hash) || file_hash != cache_hash)
+    {
+        std::cout << "\nPhoton map cache " << path.string() << " is out of date, emitting photons.\n";
+        return false;
+    }
+
+    // The photon positions are stored relative to the scene bounds, which are part of the hash
+    global_map = PhotonMap();
+    caustic_map = PhotonMap();
+    Photon::setBounds(scene.BB());
+
+    if (!global_map.read(in, file_size) || !caustic_map.read(in, file_size))
+    {
+        global_map = PhotonMap();
+        caustic_map = PhotonMap();
+        std::cout << "\nPhoton map cache " << path.string() << " is invalid, emitting photons.\n";
+        return false;
+    }
+
+    std::cout << "\nLoaded photon maps from " << path.string() << "." << std::endl << std::endl
+              << "Photon maps and numbers of stored photons: " << std::endl << std::endl;
+
+    std::cout << std::right
+              << std::setw(19) << "Global photons: "  << Format::largeNumber(global_map.size())  << std::endl
+              << std::setw(19) << "Caustic photons: " << Format::largeNumber(caustic_map.size()) << std::endl;
+    return true;
+}
+
+void PhotonMapper::writeCache(const std::filesystem::path& path) const
+{
+    std::ofstream out(path, std::ios::binary);
+    BinaryFile::write(out, CACHE_MAGIC);
+    BinaryFile::write(out, cache_hash);
+    global_map.write(out);
+    caustic_map.write(out);
+
+    if (out)
+    {
+        std::cout << "Photon maps saved to " << path.string() << ".\n";
+    }
+    else
+    {
+        std::cout << "Failed to save photon maps to " << path.string() << ".\n";
+    }
+}
+
 glm::dvec3 frequencyToRGB(double freq) {
     //TODO fill in function
 
@@ -1,13 +1,18 @@
 #pragma once
 
 #include <vector>
+#include <filesystem>
 
 #include <glm/vec3.hpp>
 #include <nlohmann/json.hpp>
 
 #include "photon.hpp"
+#include "photon-buffer.hpp"
 #include "../integrator.hpp"
-#include "../../octree/linear-octree.hpp"
+#include "photon-map.hpp"
+#include "irradiance-map.hpp"
+#include "importance-map.hpp"
+#include "emission-distribution.hpp"
 
 class PhotonMapper : public Integrator
 {
@@ -16,24 +21,71 @@ public:
 
     void emitPhoton(Ray ray, glm::dvec3 flux, size_t thread);
 
-    virtual glm::dvec3 sampleRay(Ray ray);
-    
+    virtual glm::dvec3 sampleRay(Ray ray, Intersection intersection);
+
+    // The photon maps are emitted before the image is rendered, i.e. again for each frame
+    virtual void beginPass(size_t pass, size_t num_pixels);
+
     glm::dvec3 estimateGlobalRadiance(const Interaction& interaction); // All radiance except caustic
     glm::dvec3 estimateCausticRadiance(const Interaction& interaction);
 
-private:
-    LinearOctree<Photon> caustic_map;
-    LinearOctree<Photon> global_map; // all photons except caustic photons
+protected:
+    // Photons of different passes are sampled independently
+    void emitPhotons(size_t pass = 0, bool print = true);
+
+    // The photon maps are view independent, so they can be saved and loaded by later renders of the scene
+    uint64_t cacheHash(const nlohmann::json& j) const;
+    bool readCache(const std::filesystem::path& path);
+    void writeCache(const std::filesystem::path& path) const;
+
+    void precomputeIrradiance();
+
+    // Estimates the visual importance by tracing importons from the camera, and the importance of the 
+    // emission directions of each light by tracing unstored pilot photons
+    void traceImportance();
+    double pilotImportance(Ray ray);
+
+    size_t photon_emissions;
+
+    PhotonMap caustic_map;
+    PhotonMap global_map; // all photons except caustic photons
+    PhotonMap::Structure map_structure;
 
-    // Temporary photon maps which are filled by each thread in the first pass. The Octree can't handle
-    // concurrent inserts, so this has to be done if multi-threading is to be used in the first pass.
-    std::vector<std::vector<Photon>> caustic_vecs;
-    std::vector<std::vector<Photon>> global_vecs;
+    // Irradiance at every irradiance_record_spacing:th global photon, used for diffuse surfaces if precomputed
+    IrradianceMap irradiance_map;
+    bool precompute_irradiance;
+    static constexpr size_t irradiance_record_spacing = 4;
+
+    // Photons are stored and continued with the probability of the importance of their position, and the 
+    // emission directions are sampled by their importance, which is disabled if num_importons is 0
+    ImportanceMap importance_map;
+    std::vector<EmissionDistribution> emission_distributions;
+    size_t num_importons;
+    static constexpr uint16_t max_importon_depth = 4;
+
+    // Photons stored by each thread, which are moved into the photon maps once emitted
+    std::vector<PhotonBuffer> caustic_buffers;
+    std::vector<PhotonBuffer> global_buffers;
+
+    // Emission stops once the stored photons reach the memory budget, unlimited if 0
+    PhotonBuffer::Budget photon_budget;
+    size_t memory_budget;
+
+    // The caustic and global chunk that each thread is filling, which are not counted against the 
+    // budget until they are full and hold the photons of the paths in progress when it is reached
+    static constexpr size_t reserved_chunks_per_thread = 2;
 
     double non_caustic_reject;
 
     bool direct_visualization;
 
+    // File relative to the scene directory where the photon maps are cached, not used if empty
+    std::string cache;
+    uint64_t cache_hash = 0;
+
+    // Photons are not stored where light sources are hit directly if the direct illumination is sampled separately
+    bool store_direct_photons = true;
+
     uint16_t max_node_data;
     size_t k_nearest_photons;
 
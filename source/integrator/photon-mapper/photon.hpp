@@ -1,38 +1,124 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
+
 #include <glm/glm.hpp>
 
-struct alignas(32) Photon
+#include "../../common/bounding-box.hpp"
+
+/*************************************************************************
+Photon compressed to 16 bytes. The position is quantized to a grid with
+2^21 cells per axis over the bounds set with setBounds, the flux is
+stored as RGBE with a shared exponent, and the direction is octahedral
+encoded with 16 bits per coordinate, which is decoded without any
+trigonometric functions.
+*************************************************************************/
+struct alignas(16) Photon
 {
+    // Uninitialized photon, e.g. for photons read from a file
+    Photon() { }
+
     Photon(const glm::dvec3& flux, const glm::dvec3& position, const glm::dvec3& direction)
-        : flux_(flux), position_(position)
     {
-        theta = (float)std::atan2(glm::length(glm::dvec2(direction)), direction.z);
-        phi = (float)std::atan2(direction.y, direction.x);
+        glm::dvec3 q = glm::clamp((position - origin) * inv_cell_size, 0.0, max_cell);
+        position_ = (uint64_t)q.x << (2 * axis_bits) | (uint64_t)q.y << axis_bits | (uint64_t)q.z;
+
+        setFlux(flux);
+
+        // Project onto the octahedron and fold the lower hemisphere over the upper one
+        glm::dvec2 oct = glm::dvec2(direction) / (std::abs(direction.x) + std::abs(direction.y) + std::abs(direction.z));
+        if (direction.z < 0.0)
+        {
+            oct = (1.0 - glm::abs(glm::dvec2(oct.y, oct.x))) * signNotZero(oct);
+        }
+        for (int c = 0; c < 2; c++)
+        {
+            direction_[c] = (uint16_t)std::lround((glm::clamp(oct[c], -1.0, 1.0) * 0.5 + 0.5) * 65535.0);
+        }
     }
 
     glm::dvec3 pos() const
     {
-        return position_;
+        constexpr uint64_t mask = (1ull << axis_bits) - 1;
+        glm::dvec3 q(
+            (double)(position_ >> (2 * axis_bits) & mask),
+            (double)(position_ >> axis_bits & mask),
+            (double)(position_ & mask)
+        );
+        return origin + (q + 0.5) * cell_size;
     }
 
     glm::dvec3 dir() const
     {
-        double sin_theta = std::sin(theta);
-        return glm::dvec3(
-            sin_theta * std::cos(phi),
-            sin_theta * std::sin(phi),
-            std::cos(theta)
-        );
+        glm::dvec2 oct = glm::dvec2(direction_[0], direction_[1]) * (2.0 / 65535.0) - 1.0;
+        glm::dvec3 direction(oct, 1.0 - std::abs(oct.x) - std::abs(oct.y));
+        if (direction.z < 0.0)
+        {
+            glm::dvec2 unfolded = (1.0 - glm::abs(glm::dvec2(oct.y, oct.x))) * signNotZero(oct);
+            direction.x = unfolded.x;
+            direction.y = unfolded.y;
+        }
+        return glm::normalize(direction);
     }
 
     glm::dvec3 flux() const
     {
-        return flux_;
+        if (flux_[3] == 0) return glm::dvec3(0.0);
+
+        double scale = std::ldexp(1.0, (int)flux_[3] - (128 + 8));
+        return (glm::dvec3(flux_[0], flux_[1], flux_[2]) + 0.5) * scale;
+    }
+
+    void setFlux(const glm::dvec3& flux)
+    {
+        double max_flux = glm::max(flux.x, glm::max(flux.y, flux.z));
+        if (max_flux > 1e-32)
+        {
+            int exponent;
+            double scale = std::frexp(max_flux, &exponent) * 256.0 / max_flux;
+            for (int c = 0; c < 3; c++)
+            {
+                flux_[c] = (uint8_t)glm::clamp(flux[c] * scale, 0.0, 255.0);
+            }
+            flux_[3] = (uint8_t)(exponent + 128);
+        }
+        else
+        {
+            flux_[0] = flux_[1] = flux_[2] = flux_[3] = 0;
+        }
+    }
+
+    // Bounds of the photon positions, which must be set before photons are created and kept while they are used
+    static void setBounds(const BoundingBox& BB)
+    {
+        constexpr double cells = double(1u << axis_bits);
+
+        origin = BB.min;
+        cell_size = BB.dimensions() / cells;
+        inv_cell_size = glm::dvec3(0.0);
+        for (int c = 0; c < 3; c++)
+        {
+            if (cell_size[c] > 0.0) inv_cell_size[c] = 1.0 / cell_size[c];
+        }
     }
 
 private:
-    // Single-precision and polar angles to reduce size to 32 bytes.
-    glm::vec3 flux_, position_;
-    float phi, theta;
+    static glm::dvec2 signNotZero(const glm::dvec2& v)
+    {
+        return glm::dvec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+    }
+
+    static constexpr uint32_t axis_bits = 21;
+    static constexpr double max_cell = double((1u << axis_bits) - 1);
+
+    inline static glm::dvec3 origin = glm::dvec3(0.0);
+    inline static glm::dvec3 cell_size = glm::dvec3(0.0);
+    inline static glm::dvec3 inv_cell_size = glm::dvec3(0.0);
+
+    uint64_t position_; // 21 bits per axis, x in the highest bits
+    uint8_t flux_[4];   // RGB mantissas and shared exponent
+    uint16_t direction_[2];
 };
+
+static_assert(sizeof(Photon) == 16, "Photons should be compressed to 16 bytes");
@@ -0,0 +1,172 @@
+#include "sppm.hpp"
+
+#include <cmath>
+#include <iostream>
+
+#include <glm/gtx/norm.hpp>
+
+#include "../../common/util.hpp"
+#include "../../common/constants.hpp"
+#include "../../sampling/sampler.hpp"
+#include "../../material/material.hpp"
+#include "../../surface/surface.hpp"
+#include "../../ray/interaction.hpp"
+
+thread_local SPPM::PixelGather SPPM::gather;
+
+SPPM::SPPM(const nlohmann::json& j) : PhotonMapper(j)
+{
+    const nlohmann::json& sppm = j.at("photon_map").at("sppm");
+
+    num_passes = std::max(getOptional(sppm, "passes", size_t(64)), size_t(1));
+    alpha = glm::clamp(getOptional(sppm, "alpha", 0.7), 0.0, 1.0);
+
+    // The default radius is a small fraction of the scene size
+    initial_radius = getOptional(sppm, "initial_radius", -1.0);
+    if (initial_radius <= 0.0)
+    {
+        initial_radius = glm::length(scene.BB().dimensions()) / 100.0;
+    }
+
+    // The direct illumination is sampled at the first non-specular hit of the camera rays
+    store_direct_photons = false;
+
+    std::cout << "Stochastic progressive photon mapping with " << num_passes << " passes and initial radius " << initial_radius << std::endl;
+}
+
+void SPPM::beginPass(size_t pass, size_t num_pixels)
+{
+    this->pass = pass;
+
+    if (pass == 0)
+    {
+        pixels.assign(num_pixels, PixelStatistics());
+        for (auto& pixel : pixels)
+        {
+            pixel.radius2 = initial_radius * initial_radius;
+        }
+    }
+
+    // The photons of the previous pass are released when the new photon maps are constructed
+    emitPhotons(pass, pass == 0);
+}
+
+void SPPM::beginPixel(size_t pixel)
+{
+    gather = PixelGather();
+    gather.pixel = pixel;
+}
+
+/****************************************************************
+Updates the statistics of the pixel with the photons gathered in
+this pass, which shrinks the radius such that the fraction alpha
+of the new photons is kept, and returns the progressive estimate.
+****************************************************************/
+glm::dvec3 SPPM::endPixel(size_t pixel, const glm::dvec3& radiance)
+{
+    PixelStatistics& p = pixels[pixel];
+
+    p.radiance += radiance;
+
+    if (gather.num_samples != 0)
+    {
+        double num_new_photons = gather.num_photons / gather.num_samples;
+        if (num_new_photons > 0.0)
+        {
+            double num_photons = p.num_photons + alpha * num_new_photons;
+            double ratio = num_photons / (p.num_photons + num_new_photons);
+
+            p.flux = (p.flux + gather.flux / static_cast<double>(gather.num_samples)) * ratio;
+            p.radius2 *= ratio;
+            p.num_photons = num_photons;
+        }
+    }
+
+    // The photon flux is normalized to the light source flux in each pass
+    double num_passes = static_cast<double>(pass + 1);
+    return (p.radiance + p.flux / (p.radius2 * C::PI)) / num_passes;
+}
+
+glm::dvec3 SPPM::sampleRay(Ray ray, Intersection intersection)
+{
+    glm::dvec3 radiance(0.0), throughput(1.0);
+    RefractionHistory refraction_history(ray);
+    glm::dvec3 bsdf_absIdotN;
+    LightSample ls;
+
+    gather.num_samples++;
+
+    while (true)
+    {
+        Sampler::nextSequence();
+
+        if (!intersection)
+        {
+            return radiance;
+        }
+
+        Interaction interaction(intersection, ray, refraction_history.externalIOR(ray));
+
+        radiance += Integrator::sampleEmissive(interaction, ls) * throughput;
+
+        if (!interaction.dirac_delta)
+        {
+            radiance += Integrator::sampleDirect(interaction, ls) * throughput;
+            gatherPhotons(interaction, throughput);
+
+            // The light source is also sampled with the BSDF, since sampleDirect uses MIS
+            if (!interaction.sampleBSDF(bsdf_absIdotN, ls.bsdf_pdf, ray))
+            {
+                return radiance;
+            }
+            throughput *= bsdf_absIdotN / ls.bsdf_pdf;
+            refraction_history.update(ray);
+
+            intersection = scene.intersect(ray);
+            if (intersection)
+            {
+                Interaction light_interaction(intersection, ray, refraction_history.externalIOR(ray));
+                radiance += Integrator::sampleEmissive(light_interaction, ls) * throughput;
+            }
+            return radiance;
+        }
+
+        if (!interaction.sampleBSDF(bsdf_absIdotN, ls.bsdf_pdf, ray))
+        {
+            return radiance;
+        }
+        throughput *= bsdf_absIdotN / ls.bsdf_pdf;
+
+        if (absorb(ray, throughput))
+        {
+            return radiance;
+        }
+
+        refraction_history.update(ray);
+
+        intersection = scene.intersect(ray);
+    }
+}
+
+void SPPM::gatherPhotons(const Interaction& interaction, const glm::dvec3& throughput)
+{
+    double radius = std::sqrt(pixels[gather.pixel].radius2);
+
+    double bsdf_pdf;
+    glm::dvec3 bsdf_absIdotN;
+    thread_local std::vector<SearchIndex> found;
+    for (const PhotonMap* map : { &global_map, &caustic_map })
+    {
+        map->radiusSearch(interaction.position, radius, found);
+        const std::vector<Photon>& photons = map->photons();
+        for (const auto& r : found)
+        {
+            const Photon& photon = photons[r.index];
+            gather.num_photons++;
+            if (interaction.BSDF(bsdf_absIdotN, photon.dir(), bsdf_pdf))
+            {
+                gather.flux += throughput * photon.flux() * bsdf_absIdotN / bsdf_pdf;
+            }
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+#include <nlohmann/json.hpp>
+
+#include "../photon-mapper/photon-mapper.hpp"
+
+/*************************************************************************
+Stochastic progressive photon mapping. Each pass emits a new set of 
+photons, which is gathered at the first non-specular camera ray hit of
+each pixel within a radius that shrinks over the passes, and is released
+before the next pass. Memory is therefore bounded by the photons of one 
+pass, while the estimate converges as more passes are rendered.
+*************************************************************************/
+class SPPM : public PhotonMapper
+{
+public:
+    SPPM(const nlohmann::json& j);
+
+    virtual glm::dvec3 sampleRay(Ray ray, Intersection intersection);
+
+    virtual void beginPass(size_t pass, size_t num_pixels);
+    virtual void beginPixel(size_t pixel);
+    virtual glm::dvec3 endPixel(size_t pixel, const glm::dvec3& radiance);
+
+private:
+    void gatherPhotons(const Interaction& interaction, const glm::dvec3& throughput);
+
+    struct PixelStatistics
+    {
+        double radius2;
+        double num_photons = 0.0;
+        glm::dvec3 flux = glm::dvec3(0.0);     // accumulated photon flux, scaled as the radius shrinks
+        glm::dvec3 radiance = glm::dvec3(0.0); // accumulated emitted and direct radiance
+    };
+
+    // Photons gathered for the camera rays of the pixel the thread is currently sampling
+    struct PixelGather
+    {
+        size_t pixel = 0, num_samples = 0;
+        double num_photons = 0.0;
+        glm::dvec3 flux = glm::dvec3(0.0);
+    };
+
+    std::vector<PixelStatistics> pixels;
+    thread_local static PixelGather gather;
+
+    double initial_radius;
+    double alpha;
+    size_t pass = 0;
+};
@@ -0,0 +1,253 @@
+#include "kd-tree.hpp"
+
+#include <array>
+#include <algorithm>
+
+#include <glm/gtx/norm.hpp>
+
+#include "../common/bounding-box.hpp"
+#include "../common/constexpr-math.hpp"
+#include "../common/parallel.hpp"
+
+template <class Data>
+KDTree<Data>::KDTree(std::vector<Data> &&data)
+    : heap_data(std::move(data))
+{
+    if (heap_data.empty()) return;
+
+    // Index of the element of each heap node in the balanced ranges of heap_data
+    std::vector<size_t> order(heap_data.size());
+    split_axes.resize(heap_data.size());
+    balance(0, 0, heap_data.size(), order);
+
+    // Move the elements to their heap nodes by following the cycles of the permutation
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        if (order[i] == i) continue;
+
+        Data element = heap_data[i];
+        size_t j = i;
+        while (order[j] != i)
+        {
+            size_t next = order[j];
+            heap_data[j] = heap_data[next];
+            order[j] = j;
+            j = next;
+        }
+        heap_data[j] = element;
+        order[j] = j;
+    }
+}
+
+template <class Data>
+void KDTree<Data>::knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchResult<Data>>& result) const
+{
+    thread_local FixedMaxHeap<SearchIndex> indices;
+    knnSearch(p, k, indices);
+
+    result.reset(indices.size());
+    for (const auto& r : indices.container())
+    {
+        result.push({ heap_data[r.index], r.distance2 });
+    }
+}
+
+template <class Data>
+std::vector<SearchResult<Data>> KDTree<Data>::radiusSearch(const glm::dvec3& p, double radius) const
+{
+    thread_local std::vector<SearchIndex> indices;
+    radiusSearch(p, radius, indices);
+
+    std::vector<SearchResult<Data>> result;
+    result.reserve(indices.size());
+    for (const auto& r : indices)
+    {
+        result.emplace_back(heap_data[r.index], r.distance2);
+    }
+    return result;
+}
+
+/**************************************************************************
+Descends to the leaf on the same side of each split plane as p and tests 
+the nodes on the way back up, so that the closest elements are found first
+and the search radius shrinks quickly. The path is kept on a fixed-size 
+stack, and the subtree on the far side of a split plane is only visited if
+its cell is within the search radius. The cells are the bounding box of all
+elements cut by the split planes above, so the per-axis distances from p 
+to a cell only differ from those to its parent along the split axis.
+**************************************************************************/
+template <class Data>
+void KDTree<Data>::knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchIndex>& result) const
+{
+    const size_t n = heap_data.size();
+    if (k > n) k = n;
+
+    result.reset(k);
+
+    if (k == 0) return;
+
+    struct Entry
+    {
+        size_t node_idx;
+        glm::dvec3 cell_offset;
+        double cell_distance2;
+    };
+
+    std::array<Entry, max_height> path;
+    size_t path_size = 0;
+
+    double max_distance2 = std::numeric_limits<double>::max();
+
+    size_t node_idx = 0;
+    glm::dvec3 cell_offset = glm::max(glm::max(BB.min - p, p - BB.max), glm::dvec3(0.0));
+    double cell_distance2 = glm::length2(cell_offset);
+
+    while (true)
+    {
+        while (node_idx < n)
+        {
+            uint8_t axis = split_axes[node_idx];
+            double delta = p[axis] - heap_data[node_idx].pos()[axis];
+            path[path_size++] = { node_idx, cell_offset, cell_distance2 };
+            node_idx = 2 * node_idx + (delta < 0.0 ? 1 : 2);
+        }
+
+        if (path_size == 0) break;
+
+        const Entry entry = path[--path_size];
+        glm::dvec3 pos = heap_data[entry.node_idx].pos();
+
+        double distance2 = glm::distance2(pos, p);
+        if (distance2 <= max_distance2 && result.push({ entry.node_idx, distance2 }) && result.full())
+        {
+            // No element can be farther than the farthest of the currently closest k elements 
+            max_distance2 = result.top().distance2;
+        }
+
+        // The cell on the far side of the split plane is at least as far away as the plane
+        uint8_t axis = split_axes[entry.node_idx];
+        double delta = p[axis] - pos[axis];
+        cell_offset = entry.cell_offset;
+        cell_offset[axis] = std::abs(delta);
+        cell_distance2 = glm::length2(cell_offset);
+
+        // Elements at the distance of the farthest of k found elements would not replace it
+        if (cell_distance2 < max_distance2)
+        {
+            node_idx = 2 * entry.node_idx + (delta < 0.0 ? 2 : 1);
+        }
+    }
+}
+
+template <class Data>
+void KDTree<Data>::radiusSearch(const glm::dvec3& p, double radius, std::vector<SearchIndex>& result) const
+{
+    result.clear();
+
+    const size_t n = heap_data.size();
+    if (n == 0) return;
+
+    struct Entry
+    {
+        size_t node_idx;
+        glm::dvec3 cell_offset;
+    };
+
+    std::array<Entry, max_height> to_visit;
+    size_t num_to_visit = 0;
+
+    const double radius2 = pow2(radius);
+
+    size_t node_idx = 0;
+    glm::dvec3 cell_offset = glm::max(glm::max(BB.min - p, p - BB.max), glm::dvec3(0.0));
+    if (glm::length2(cell_offset) > radius2) return;
+
+    while (true)
+    {
+        while (node_idx < n)
+        {
+            glm::dvec3 pos = heap_data[node_idx].pos();
+
+            double distance2 = glm::distance2(pos, p);
+            if (distance2 <= radius2)
+            {
+                result.push_back({ node_idx, distance2 });
+            }
+
+            uint8_t axis = split_axes[node_idx];
+            double delta = p[axis] - pos[axis];
+            size_t far_idx = 2 * node_idx + (delta < 0.0 ? 2 : 1);
+            if (far_idx < n)
+            {
+                glm::dvec3 far_offset = cell_offset;
+                far_offset[axis] = std::abs(delta);
+                if (glm::length2(far_offset) <= radius2)
+                {
+                    to_visit[num_to_visit++] = { far_idx, far_offset };
+                }
+            }
+            node_idx = 2 * node_idx + (delta < 0.0 ? 1 : 2);
+        }
+
+        if (num_to_visit == 0) break;
+
+        const Entry &entry = to_visit[--num_to_visit];
+        node_idx = entry.node_idx;
+        cell_offset = entry.cell_offset;
+    }
+}
+
+/**************************************************************************
+Splits [begin, end) along the axis of largest extent at the element that 
+gives a left-balanced subtree, and records it as heap node node_idx. The 
+left and right subtrees are then balanced from the elements before and
+after it, concurrently for large ranges.
+**************************************************************************/
+template <class Data>
+void KDTree<Data>::balance(size_t node_idx, size_t begin, size_t end, std::vector<size_t> &order)
+{
+    BoundingBox range_BB;
+    for (size_t i = begin; i < end; i++) range_BB.merge(heap_data[i].pos());
+
+    if (node_idx == 0) BB = range_BB;
+
+    if (end - begin == 1)
+    {
+        order[node_idx] = begin;
+        split_axes[node_idx] = 0;
+        return;
+    }
+
+    glm::dvec3 dims = range_BB.dimensions();
+    uint8_t axis = dims.x > dims.y ? (dims.x > dims.z ? 0 : 2) : (dims.y > dims.z ? 1 : 2);
+
+    size_t median = begin + leftSubtreeSize(end - begin);
+    std::nth_element(heap_data.begin() + begin, heap_data.begin() + median, heap_data.begin() + end,
+        [axis](const Data &a, const Data &b) { return a.pos()[axis] < b.pos()[axis]; });
+
+    order[node_idx] = median;
+    split_axes[node_idx] = axis;
+
+    Parallel::TaskGroup tasks;
+    if (median > begin)
+    {
+        auto left = [this, node_idx, begin, median, &order]() { balance(2 * node_idx + 1, begin, median, order); };
+        if (end - begin > parallel_size) tasks.spawn(left);
+        else left();
+    }
+    if (end > median + 1)
+    {
+        balance(2 * node_idx + 2, median + 1, end, order);
+    }
+}
+
+// Number of nodes in the left subtree of a left-balanced tree with n nodes
+template <class Data>
+size_t KDTree<Data>::leftSubtreeSize(size_t n)
+{
+    if (n <= 1) return 0;
+
+    size_t last_level_capacity = size_t(1) << highestSetBit(n);
+    size_t last_level_size = n - (last_level_capacity - 1);
+    return last_level_capacity / 2 - 1 + std::min(last_level_size, last_level_capacity / 2);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "../common/util.hpp"
+#include "../common/bounding-box.hpp"
+#include "../common/search-result.hpp"
+
+/**************************************************************************
+Left-balanced kd-tree stored as an implicit binary heap, as described by
+Jensen for photon maps. Node i holds one data element and has its children
+at 2i + 1 and 2i + 2, so no child pointers are stored, only the split axis
+of each node. The tree is complete apart from the rightmost part of the
+last level, which keeps every index below the number of elements.
+**************************************************************************/
+template <class Data>
+class KDTree
+{
+static_assert(
+    std::is_member_function_pointer<decltype(&Data::pos)>::value, 
+    "KDTree Data must implement a 'glm::dvec3 pos()' member."
+);
+public:
+    KDTree() { }
+
+    // Takes ownership of the data, which is reordered in place into the tree.
+    KDTree(std::vector<Data> &&data);
+
+    void knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchResult<Data>>& result) const;
+    std::vector<SearchResult<Data>> radiusSearch(const glm::dvec3& p, double radius) const;
+
+    // Write the indices of the found elements in heap_data into the caller's buffers, which keep 
+    // their capacity between searches.
+    void knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchIndex>& result) const;
+    void radiusSearch(const glm::dvec3& p, double radius, std::vector<SearchIndex>& result) const;
+
+    std::vector<Data> heap_data;
+    std::vector<uint8_t> split_axes;
+
+    // Bounding box of all elements, which bounds the cells of the nodes
+    BoundingBox BB;
+
+private:
+    void balance(size_t node_idx, size_t begin, size_t end, std::vector<size_t> &order);
+
+    static size_t leftSubtreeSize(size_t n);
+
+    // Ranges larger than this are balanced concurrently
+    static constexpr size_t parallel_size = 1 << 16;
+
+    // Larger than the height of any tree that fits in memory
+    static constexpr size_t max_height = 64;
+};
@@ -1,37 +1,101 @@
 #include "linear-octree.hpp"
 
 #include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 #include <glm/gtx/norm.hpp>
+#include <glm/gtx/component_wise.hpp>
 
 #include "../common/constexpr-math.hpp"
+#include "../common/parallel.hpp"
 #include "../common/util.hpp"
 
 template <class Data>
-LinearOctree<Data>::LinearOctree(Octree<Data> &octree_root)
+LinearOctree<Data>::LinearOctree(std::vector<Data> &&data, const BoundingBox &BB, size_t max_node_data)
+    : ordered_data(std::move(data)), max_node_data(std::max(max_node_data, size_t(1)))
 {
-    size_t octree_size = 0, data_size = 0;
-    octreeSize(octree_root, octree_size, data_size);
-
-    if (octree_size == 0 || data_size == 0) return;
+    if (ordered_data.empty()) return;
 
-    uint32_t df_idx = ROOT_IDX;
-    uint64_t data_idx = 0;
-    uint64_t contained_data;
-    compact(&octree_root, df_idx, data_idx, contained_data, true);
+    build(0, ordered_data.size(), BB.centroid(), BB.dimensions() / 2.0, 0, linear_tree);
+    computeScanPositions();
 }
 
-#include <iostream>
 template <class Data>
-void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, AccessiblePQ<SearchResult<Data>>& result) const
+void LinearOctree<Data>::computeScanPositions()
 {
-    result.clear();
+    const size_t n = ordered_data.size();
+    for (auto& positions : scan_positions)
+    {
+        positions.assign(n + scan_width - 1, 0.0f);
+    }
 
     if (linear_tree.empty()) return;
 
+    // Relative to the center of the data, so that the single-precision positions are as precise as possible
+    const BoundingBox& BB = linear_tree[ROOT_IDX].BB;
+    scan_origin = BB.centroid();
+    scan_extent = glm::compMax(BB.max - BB.min) / 2.0;
+
+    Parallel::forChunks(n, 1 << 14, [&](size_t chunk, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            glm::dvec3 pos = ordered_data[i].pos() - scan_origin;
+            for (int a = 0; a < 3; a++)
+            {
+                scan_positions[a][i] = (float)pos[a];
+            }
+        }
+    });
+}
+
+template <class Data>
+void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchResult<Data>>& result) const
+{
+    thread_local FixedMaxHeap<SearchIndex> indices;
+    knnSearch(p, k, indices);
+
+    result.reset(indices.size());
+    for (const auto& r : indices.container())
+    {
+        result.push({ ordered_data[r.index], r.distance2 });
+    }
+}
+
+template <class Data>
+std::vector<SearchResult<Data>> LinearOctree<Data>::radiusSearch(const glm::dvec3& p, double radius) const
+{
+    thread_local std::vector<SearchIndex> indices;
+    radiusSearch(p, radius, indices);
+
+    std::vector<SearchResult<Data>> result;
+    result.reserve(indices.size());
+    for (const auto& r : indices)
+    {
+        result.emplace_back(ordered_data[r.index], r.distance2);
+    }
+    return result;
+}
+
+template <class Data>
+void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchIndex>& result) const
+{
+    knnSearch(p, k, std::numeric_limits<double>::max(), result);
+}
+
+template <class Data>
+void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, double max_distance2, FixedMaxHeap<SearchIndex>& result) const
+{
     if (k > ordered_data.size()) k = ordered_data.size();
 
-    double max_distance2 = std::numeric_limits<double>::max();
+    result.reset(k);
+
+    if (linear_tree.empty()) return;
 
     struct alignas(16) DNode
     {
@@ -42,6 +106,7 @@ void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, AccessiblePQ<S
 
     thread_local AccessiblePQ<DNode> to_visit; to_visit.clear();
 
+    const ScanPoint sp = scanPoint(p);
     DNode current{ linear_tree[ROOT_IDX].BB.distance2(p), ROOT_IDX };
 
     while (true)
@@ -49,26 +114,17 @@ void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, AccessiblePQ<S
         const auto& node = linear_tree[current.octant];
         if (node.leaf)
         {
-            uint64_t end_idx = node.start_data + node.contained_data;
-            for (uint64_t i = node.start_data; i < end_idx; i++)
+            scanLeaf(sp, node.start_data, node.start_data + node.contained_data, max_distance2, [&](uint64_t i)
             {
-                const auto& data = ordered_data[i];
-                double distance2 = glm::distance2(data.pos(), p);
-                if (distance2 <= max_distance2)
+                double distance2 = glm::distance2(ordered_data[i].pos(), p);
+                // Replaces the farthest of the k elements if full
+                if (distance2 <= max_distance2 && result.push({ i, distance2 }) && result.full())
                 {
-                    // Remove the farthest of the k elements
-                    if (result.size() == k) result.pop();
-
-                    result.emplace(data, distance2);
-
-                    // Reduce search space
-                    if (result.size() == k)
-                    {
-                        // No element can be farther than the farthest of the currently closest k elements 
-                        max_distance2 = std::min(max_distance2, result.top().distance2);
-                    }
+                    // No element can be farther than the farthest of the currently closest k elements 
+                    max_distance2 = std::min(max_distance2, result.top().distance2);
                 }
-            }
+                return max_distance2;
+            });
         }
         else
         {
@@ -86,7 +142,9 @@ void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, AccessiblePQ<S
                     if (child_node.contained_data >= k)
                     {
                         // No element can be farther than the farthest possible point in a node that contains k elements.
-                        max_distance2 = std::min(max_distance2, child_node.BB.max_distance2(p));
+                        // The bound is widened slightly, since rounding can place the node itself or its elements just
+                        // outside of it, e.g. for coincident elements.
+                        max_distance2 = std::min(max_distance2, child_node.BB.max_distance2(p) * (1.0 + 1e-12));
                     }
                 }
                 child_octant = child_node.next_sibling;
@@ -107,15 +165,16 @@ void LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, AccessiblePQ<S
 }
 
 template <class Data>
-std::vector<SearchResult<Data>> LinearOctree<Data>::radiusSearch(const glm::dvec3& p, double radius) const
+void LinearOctree<Data>::radiusSearch(const glm::dvec3& p, double radius, std::vector<SearchIndex>& result) const
 {
-    std::vector<SearchResult<Data>> result;
+    result.clear();
 
-    if (linear_tree.empty()) return result;
+    if (linear_tree.empty()) return;
 
     thread_local std::vector<uint32_t> to_visit; to_visit.clear();
 
     const double radius2 = pow2(radius);
+    const ScanPoint sp = scanPoint(p);
     uint32_t node_idx = ROOT_IDX;
 
     while (true)
@@ -123,16 +182,15 @@ std::vector<SearchResult<Data>> LinearOctree<Data>::radiusSearch(const glm::dvec
         const auto& node = linear_tree[node_idx];
         if (node.leaf)
         {
-            uint64_t end_idx = node.start_data + node.contained_data;
-            for (uint64_t i = node.start_data; i < end_idx; i++)
+            scanLeaf(sp, node.start_data, node.start_data + node.contained_data, radius2, [&](uint64_t i)
             {
-                const auto& data = ordered_data[i];
-                double distance2 = glm::distance2(data.pos(), p);
+                double distance2 = glm::distance2(ordered_data[i].pos(), p);
                 if (distance2 <= radius2)
                 {
-                    result.emplace_back(data, distance2);
+                    result.push_back({ i, distance2 });
                 }
-            }
+                return radius2;
+            });
         }
         else
         {
@@ -148,8 +206,7 @@ std::vector<SearchResult<Data>> LinearOctree<Data>::radiusSearch(const glm::dvec
                         uint64_t end_idx = child_node.start_data + child_node.contained_data;
                         for (uint64_t i = child_node.start_data; i < end_idx; i++)
                         {
-                            const auto& data = ordered_data[i];
-                            result.emplace_back(data, glm::distance2(data.pos(), p));
+                            result.push_back({ i, glm::distance2(ordered_data[i].pos(), p) });
                         }
                     }
                     else
@@ -168,65 +225,416 @@ std::vector<SearchResult<Data>> LinearOctree<Data>::radiusSearch(const glm::dvec
         node_idx = to_visit.back();
         to_visit.pop_back();
     }
-    return result;
+}
+
+/**************************************************************************
+The k nearest elements of the previous point lie within its search radius
+plus the distance between the points, which bounds each search from the 
+start instead of an unbounded radius. For points in Morton order the bound
+is tight, so the search skips most of the nodes and elements it would 
+otherwise push before the heap fills up.
+**************************************************************************/
+template <class Data>
+void LinearOctree<Data>::knnSearch(const glm::dvec3* points, size_t num_points, size_t k, FixedMaxHeap<SearchIndex>* results) const
+{
+    for (size_t i = 0; i < num_points; i++)
+    {
+        double max_distance2 = std::numeric_limits<double>::max();
+        if (i > 0 && results[i - 1].full() && !results[i - 1].empty())
+        {
+            // Widened slightly for rounding, like the bound of nodes that contain k elements
+            double radius = std::sqrt(results[i - 1].top().distance2) + glm::distance(points[i], points[i - 1]);
+            max_distance2 = pow2(radius) * (1.0 + 1e-12);
+        }
+        knnSearch(points[i], k, max_distance2, results[i]);
+    }
+}
+
+/**************************************************************************
+Searches the points in groups of batch_size, which collect the leaves 
+within the radius of the group's bounding box in one traversal. Each point
+then scans the collected leaves within the radius of it.
+**************************************************************************/
+template <class Data>
+void LinearOctree<Data>::radiusSearch(const glm::dvec3* points, size_t num_points, double radius, std::vector<SearchIndex>* results) const
+{
+    thread_local std::vector<uint32_t> leaves;
+
+    const double radius2 = pow2(radius);
+
+    for (size_t group = 0; group < num_points; group += batch_size)
+    {
+        size_t group_end = std::min(group + batch_size, num_points);
+
+        BoundingBox group_BB;
+        for (size_t i = group; i < group_end; i++) group_BB.merge(points[i]);
+
+        collectLeaves(group_BB, radius, leaves);
+
+        for (size_t i = group; i < group_end; i++)
+        {
+            const glm::dvec3& p = points[i];
+            const ScanPoint sp = scanPoint(p);
+            auto& result = results[i];
+            result.clear();
+
+            for (uint32_t leaf : leaves)
+            {
+                const auto& node = linear_tree[leaf];
+                if (node.BB.distance2(p) > radius2) continue;
+
+                scanLeaf(sp, node.start_data, node.start_data + node.contained_data, radius2, [&](uint64_t j)
+                {
+                    double distance2 = glm::distance2(ordered_data[j].pos(), p);
+                    if (distance2 <= radius2)
+                    {
+                        result.push_back({ j, distance2 });
+                    }
+                    return radius2;
+                });
+            }
+        }
+    }
+}
+
+// Collects the leaves that are within radius of BB
+template <class Data>
+void LinearOctree<Data>::collectLeaves(const BoundingBox &BB, double radius, std::vector<uint32_t> &leaves) const
+{
+    leaves.clear();
+
+    if (linear_tree.empty()) return;
+
+    thread_local std::vector<uint32_t> to_visit; to_visit.clear();
+
+    const double radius2 = pow2(radius);
+    auto distance2 = [&BB](const BoundingBox &node_BB)
+    {
+        return glm::length2(glm::max(glm::max(node_BB.min - BB.max, BB.min - node_BB.max), glm::dvec3(0.0)));
+    };
+
+    if (distance2(linear_tree[ROOT_IDX].BB) > radius2) return;
+
+    uint32_t node_idx = ROOT_IDX;
+    while (true)
+    {
+        if (linear_tree[node_idx].leaf)
+        {
+            leaves.push_back(node_idx);
+        }
+        else
+        {
+            uint32_t child_idx = node_idx + 1;
+            while (child_idx != NULL_IDX)
+            {
+                const auto& child_node = linear_tree[child_idx];
+                if (distance2(child_node.BB) <= radius2)
+                {
+                    to_visit.push_back(child_idx);
+                }
+                child_idx = child_node.next_sibling;
+            }
+        }
+        if (to_visit.empty())
+        {
+            break;
+        }
+        node_idx = to_visit.back();
+        to_visit.pop_back();
+    }
 }
 
 template <class Data>
-void LinearOctree<Data>::octreeSize(const Octree<Data> &octree_root, size_t &size, size_t &data_size) const
+typename LinearOctree<Data>::ScanPoint LinearOctree<Data>::scanPoint(const glm::dvec3 &p) const
 {
-    if (octree_root.leaf() && octree_root.data_vec.empty()) return;
+    ScanPoint sp;
+    glm::dvec3 relative = p - scan_origin;
+    for (int a = 0; a < 3; a++)
+    {
+        sp.p[a] = (float)relative[a];
+    }
+    // Each coordinate difference is off by at most FLT_EPSILON times the sum of the magnitudes of the 
+    // two rounded positions, which is doubled to also cover the rounding of the relative positions
+    sp.error = std::sqrt(3.0) * FLT_EPSILON * 2.0 * (glm::compMax(glm::abs(relative)) + scan_extent);
+    return sp;
+}
 
-    size++;
-    data_size += octree_root.data_vec.size();
+/**************************************************************************
+Single-precision bound on the squared distance that no element within 
+max_distance2 of the query point exceeds despite the rounding of the 
+single-precision distances, so that the scan never skips an element that
+the double-precision test would accept.
+**************************************************************************/
+template <class Data>
+float LinearOctree<Data>::scanBound(const ScanPoint &sp, double max_distance2) const
+{
+    double bound = pow2(std::sqrt(max_distance2) + sp.error) * (1.0 + 4.0 * FLT_EPSILON);
+    if (!(bound < FLT_MAX)) return std::numeric_limits<float>::infinity();
+    float f = (float)bound;
+    return f < bound ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
 
-    if (!octree_root.leaf())
+// Bit j is set if element i + j may be within the bound
+template <class Data>
+uint32_t LinearOctree<Data>::scanMask(const ScanPoint &sp, uint64_t i, float bound) const
+{
+#if defined(__AVX512F__)
+    __m512 d2 = _mm512_setzero_ps();
+    for (int a = 0; a < 3; a++)
+    {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(scan_positions[a].data() + i), _mm512_set1_ps(sp.p[a]));
+        d2 = _mm512_fmadd_ps(d, d, d2);
+    }
+    return (uint32_t)_mm512_cmp_ps_mask(d2, _mm512_set1_ps(bound), _CMP_LE_OQ);
+#elif defined(__AVX__)
+    __m256 d2 = _mm256_setzero_ps();
+    for (int a = 0; a < 3; a++)
     {
-        for (const auto &octant : octree_root.octants)
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(scan_positions[a].data() + i), _mm256_set1_ps(sp.p[a]));
+        d2 = _mm256_add_ps(_mm256_mul_ps(d, d), d2);
+    }
+    return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(d2, _mm256_set1_ps(bound), _CMP_LE_OQ));
+#else
+    uint32_t mask = 0;
+    for (size_t j = 0; j < scan_width; j++)
+    {
+        float d2 = 0.0f;
+        for (int a = 0; a < 3; a++)
         {
-            octreeSize(*octant, size, data_size);
+            float d = scan_positions[a][i + j] - sp.p[a];
+            d2 += d * d;
         }
+        mask |= (uint32_t)(d2 <= bound) << j;
     }
+    return mask;
+#endif
 }
 
+/**************************************************************************
+Tests the elements in [begin, end) scan_width at a time in single 
+precision, and calls f with the index of each element that may be within
+max_distance2 of the query point for the exact test. f returns the new
+max_distance2, which can only shrink, e.g. when the k nearest elements
+are found.
+**************************************************************************/
 template <class Data>
-BoundingBox LinearOctree<Data>::compact(Octree<Data>* node, uint32_t& df_idx, uint64_t& data_idx, uint64_t& contained_data, bool last)
+template <class F>
+void LinearOctree<Data>::scanLeaf(const ScanPoint &sp, uint64_t begin, uint64_t end, double max_distance2, F &&f) const
 {
-    uint32_t idx = df_idx++;
+    float bound = scanBound(sp, max_distance2);
+    for (uint64_t i = begin; i < end; i += scan_width)
+    {
+        uint32_t mask = scanMask(sp, i, bound);
+        if (end - i < scan_width)
+        {
+            mask &= (1u << (end - i)) - 1u;
+        }
+        while (mask)
+        {
+            double distance2 = f(i + countTrailingZeros(mask));
+            mask &= mask - 1u;
+            if (distance2 < max_distance2)
+            {
+                max_distance2 = distance2;
+                bound = scanBound(sp, max_distance2);
+            }
+        }
+    }
+}
 
-    linear_tree.emplace_back();
-    linear_tree[idx].leaf = (uint8_t)node->leaf();
-    linear_tree[idx].start_data = data_idx;
-    linear_tree[idx].contained_data = node->data_vec.size();
+/**************
+Octant:  x y z
+     0:  0 0 0
+     1:  0 0 1
+     2:  0 1 0
+     3:  0 1 1
+     4:  1 0 0
+     5:  1 0 1
+     6:  1 1 0
+     7:  1 1 1
+***************/
+
+/**************************************************************************
+Builds the subtree of the data in [begin, end), which lies in the octree 
+cell with the given center and half size, and appends it to nodes in
+depth-first order with sibling indices relative to the start of nodes.
+
+The octant of a point at each depth is the next 3 bits of its Morton code
+in the grid over the root cell, so partitioning the range in place by
+octant is one pass of an MSD radix sort by Morton code. Each child octant
+is then the range of data that shares a code prefix, and the data of every
+subtree is contiguous. The octants of large ranges are built concurrently
+into separate node vectors, which are then appended in order.
+**************************************************************************/
+template <class Data>
+BoundingBox LinearOctree<Data>::build(uint64_t begin, uint64_t end, const glm::dvec3 &center, const glm::dvec3 &half_size, uint32_t depth, std::vector<LinearOctant> &nodes)
+{
+    uint32_t idx = (uint32_t)nodes.size();
+    nodes.emplace_back();
+    nodes[idx].start_data = begin;
+    nodes[idx].contained_data = end - begin;
+    nodes[idx].next_sibling = NULL_IDX;
 
     BoundingBox BB;
-    for (auto&& data : node->data_vec) BB.merge(data.pos());
-    ordered_data.insert(ordered_data.end(), node->data_vec.begin(), node->data_vec.end());
-    data_idx += node->data_vec.size();
-    node->data_vec.clear();
-    node->data_vec.shrink_to_fit();
+    if (end - begin <= max_node_data || depth == max_depth)
+    {
+        sortLeaf(begin, end, center, half_size, depth);
+        for (uint64_t i = begin; i < end; i++) BB.merge(ordered_data[i].pos());
+        nodes[idx].leaf = 1;
+        nodes[idx].BB = BB;
+        return BB;
+    }
+
+    std::array<uint64_t, 9> octant_begin;
+    partition(begin, end, center, octant_begin);
 
-    if (!node->leaf())
+    auto octantCenter = [&](uint32_t o)
     {
-        std::vector<size_t> use;
-        for (size_t i = 0; i < node->octants.size(); i++)
+        glm::dvec3 octant_center = center;
+        for (uint8_t c = 0; c < 3; c++)
         {
-            if (!(node->octants[i]->leaf() && node->octants[i]->data_vec.empty()))
+            octant_center[c] += half_size[c] * (o & (0b100 >> c) ? 0.5 : -0.5);
+        }
+        return octant_center;
+    };
+
+    std::array<uint32_t, 8> children;
+    uint32_t num_children = 0;
+    if (end - begin > parallel_size)
+    {
+        std::array<std::vector<LinearOctant>, 8> octant_nodes;
+        std::array<BoundingBox, 8> octant_BBs;
+        {
+            Parallel::TaskGroup tasks;
+            for (uint32_t o = 0; o < 8; o++)
             {
-                use.push_back(i);
+                if (octant_begin[o] == octant_begin[o + 1]) continue;
+                tasks.spawn([&, o]()
+                {
+                    octant_BBs[o] = build(octant_begin[o], octant_begin[o + 1], octantCenter(o), half_size * 0.5, depth + 1, octant_nodes[o]);
+                });
             }
         }
-        for (const auto& i : use)
+
+        for (uint32_t o = 0; o < 8; o++)
         {
-            uint64_t child_data;
-            BB.merge(compact(node->octants[i].get(), df_idx, data_idx, child_data, i == use.back()));
-            linear_tree[idx].contained_data += child_data;
+            if (octant_nodes[o].empty()) continue;
 
+            uint32_t offset = (uint32_t)nodes.size();
+            children[num_children++] = offset;
+            for (auto node : octant_nodes[o])
+            {
+                if (node.next_sibling != NULL_IDX) node.next_sibling += offset;
+                nodes.push_back(node);
+            }
+            octant_nodes[o].clear();
+            octant_nodes[o].shrink_to_fit();
+            BB.merge(octant_BBs[o]);
         }
     }
-    node->octants.clear();
-    node->octants.shrink_to_fit();
-    linear_tree[idx].next_sibling = last ? NULL_IDX : df_idx;
-    linear_tree[idx].BB = BB;
-    contained_data = linear_tree[idx].contained_data;
+    else
+    {
+        for (uint32_t o = 0; o < 8; o++)
+        {
+            if (octant_begin[o] == octant_begin[o + 1]) continue;
+
+            children[num_children++] = (uint32_t)nodes.size();
+            BB.merge(build(octant_begin[o], octant_begin[o + 1], octantCenter(o), half_size * 0.5, depth + 1, nodes));
+        }
+    }
+
+    for (uint32_t i = 0; i + 1 < num_children; i++)
+    {
+        nodes[children[i]].next_sibling = children[i + 1];
+    }
+
+    nodes[idx].leaf = 0;
+    nodes[idx].BB = BB;
     return BB;
 }
+
+/**************************************************************************
+Sorts the data of a leaf by Morton code within its cell, without adding 
+nodes, so that all of ordered_data is in Morton order and consecutive
+elements are close to each other.
+**************************************************************************/
+template <class Data>
+void LinearOctree<Data>::sortLeaf(uint64_t begin, uint64_t end, const glm::dvec3 &center, const glm::dvec3 &half_size, uint32_t depth)
+{
+    if (end - begin <= 8 || depth == max_depth) return;
+
+    std::array<uint64_t, 9> octant_begin;
+    partition(begin, end, center, octant_begin);
+    for (uint32_t o = 0; o < 8; o++)
+    {
+        if (octant_begin[o + 1] - octant_begin[o] < 2) continue;
+        glm::dvec3 octant_center = center;
+        for (uint8_t c = 0; c < 3; c++)
+        {
+            octant_center[c] += half_size[c] * (o & (0b100 >> c) ? 0.5 : -0.5);
+        }
+        sortLeaf(octant_begin[o], octant_begin[o + 1], octant_center, half_size * 0.5, depth + 1);
+    }
+}
+
+/**************************************************************************
+Reorders the data in [begin, end) in place by octant of the cell with the
+given center, and sets octant_begin[o] to the start of octant o, with 
+octant_begin[8] = end. The octants are counted in parallel for large 
+ranges, and each element is then swapped directly into the unfilled part 
+of its octant.
+**************************************************************************/
+template <class Data>
+void LinearOctree<Data>::partition(uint64_t begin, uint64_t end, const glm::dvec3 &center, std::array<uint64_t, 9> &octant_begin)
+{
+    auto octant = [&center](const Data &data)
+    {
+        glm::dvec3 pos = data.pos();
+        return uint32_t(pos.x >= center.x) << 2 | uint32_t(pos.y >= center.y) << 1 | uint32_t(pos.z >= center.z);
+    };
+
+    std::array<uint64_t, 8> counts{};
+    if (end - begin > parallel_size)
+    {
+        std::vector<std::array<uint64_t, 8>> chunk_counts(Parallel::numThreads(), std::array<uint64_t, 8>{});
+        Parallel::forChunks(end - begin, parallel_size, [&](size_t chunk, size_t chunk_begin, size_t chunk_end)
+        {
+            for (uint64_t i = begin + chunk_begin; i < begin + chunk_end; i++)
+            {
+                chunk_counts[chunk][octant(ordered_data[i])]++;
+            }
+        });
+        for (const auto &chunk : chunk_counts)
+        {
+            for (uint32_t o = 0; o < 8; o++) counts[o] += chunk[o];
+        }
+    }
+    else
+    {
+        for (uint64_t i = begin; i < end; i++) counts[octant(ordered_data[i])]++;
+    }
+
+    octant_begin[0] = begin;
+    for (uint32_t o = 0; o < 8; o++)
+    {
+        octant_begin[o + 1] = octant_begin[o] + counts[o];
+    }
+
+    std::array<uint64_t, 8> next;
+    std::copy(octant_begin.begin(), octant_begin.begin() + 8, next.begin());
+    for (uint32_t o = 0; o < 8; o++)
+    {
+        while (next[o] < octant_begin[o + 1])
+        {
+            uint32_t d = octant(ordered_data[next[o]]);
+            if (d == o)
+            {
+                next[o]++;
+            }
+            else
+            {
+                std::swap(ordered_data[next[o]], ordered_data[next[d]++]);
+            }
+        }
+    }
+}
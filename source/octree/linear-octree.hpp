@@ -1,21 +1,41 @@
 #pragma once
 
-#include "octree.hpp"
+#include <array>
+#include <vector>
 
+#include <glm/vec3.hpp>
+
+#include "../common/bounding-box.hpp"
 #include "../common/util.hpp"
+#include "../common/search-result.hpp"
 
 template <class Data>
 class LinearOctree
 {
+static_assert(
+    std::is_member_function_pointer<decltype(&Data::pos)>::value, 
+    "LinearOctree Data must implement a 'glm::dvec3 pos()' member."
+);
 public:
     LinearOctree() { }
 
-    // This destroys the input octree for memory reasons.
-    LinearOctree(Octree<Data> &octree_root);
+    // Takes ownership of the data, which is reordered in place into the octree.
+    LinearOctree(std::vector<Data> &&data, const BoundingBox &BB, size_t max_node_data);
 
-    void knnSearch(const glm::dvec3& p, size_t k, AccessiblePQ<SearchResult<Data>>& result) const;
+    void knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchResult<Data>>& result) const;
     std::vector<SearchResult<Data>> radiusSearch(const glm::dvec3& p, double radius) const;
 
+    // Write the indices of the found elements in ordered_data into the caller's buffers, which keep 
+    // their capacity between searches.
+    void knnSearch(const glm::dvec3& p, size_t k, FixedMaxHeap<SearchIndex>& result) const;
+    void radiusSearch(const glm::dvec3& p, double radius, std::vector<SearchIndex>& result) const;
+
+    // Search for num_points query points, with the result of points[i] written to results[i].
+    // Consecutive points share work, so they should be close to each other, e.g. sorted in 
+    // Morton order like ordered_data.
+    void knnSearch(const glm::dvec3* points, size_t num_points, size_t k, FixedMaxHeap<SearchIndex>* results) const;
+    void radiusSearch(const glm::dvec3* points, size_t num_points, double radius, std::vector<SearchIndex>* results) const;
+
     struct alignas(128) LinearOctant
     {
         BoundingBox BB;
@@ -28,10 +48,51 @@ public:
     std::vector<LinearOctant> linear_tree;
     std::vector<Data> ordered_data;
 
+    // Derives the single-precision leaf positions from ordered_data, e.g. after the tree is read from a file
+    void computeScanPositions();
+
 private:
-    BoundingBox compact(Octree<Data>* node, uint32_t& df_idx, uint64_t& data_idx, uint64_t& contained_data, bool last = false);
+    BoundingBox build(uint64_t begin, uint64_t end, const glm::dvec3 &center, const glm::dvec3 &half_size, uint32_t depth, std::vector<LinearOctant> &nodes);
+    void partition(uint64_t begin, uint64_t end, const glm::dvec3 &center, std::array<uint64_t, 9> &octant_begin);
+    void knnSearch(const glm::dvec3& p, size_t k, double max_distance2, FixedMaxHeap<SearchIndex>& result) const;
+    void sortLeaf(uint64_t begin, uint64_t end, const glm::dvec3 &center, const glm::dvec3 &half_size, uint32_t depth);
+    void collectLeaves(const BoundingBox &BB, double radius, std::vector<uint32_t> &leaves) const;
+
+    // Query point relative to scan_origin, and a bound on the error of its single-precision distances
+    struct ScanPoint
+    {
+        float p[3];
+        double error;
+    };
+
+    ScanPoint scanPoint(const glm::dvec3 &p) const;
+    float scanBound(const ScanPoint &sp, double max_distance2) const;
+    uint32_t scanMask(const ScanPoint &sp, uint64_t i, float bound) const;
+    template <class F>
+    void scanLeaf(const ScanPoint &sp, uint64_t begin, uint64_t end, double max_distance2, F &&f) const;
+
+    size_t max_node_data;
+
+    // Positions of ordered_data relative to scan_origin as single-precision SoA, padded so that
+    // scan_width elements can be loaded from any index
+    std::array<std::vector<float>, 3> scan_positions;
+    glm::dvec3 scan_origin = glm::dvec3(0.0);
+    double scan_extent = 0.0;
+
+    // Octants are not split below this depth, which bounds the recursion for coincident data
+    static constexpr uint32_t max_depth = 21;
+
+    // Ranges larger than this are partitioned and built concurrently
+    static constexpr size_t parallel_size = 1 << 16;
+
+    // Number of consecutive query points that share a traversal in batched radius searches
+    static constexpr size_t batch_size = 16;
 
-    void octreeSize(const Octree<Data> &octree_root, size_t &size, size_t &data_size) const;
+#if defined(__AVX512F__)
+    static constexpr size_t scan_width = 16;
+#else
+    static constexpr size_t scan_width = 8;
+#endif
 
     enum { ROOT_IDX = 0u, NULL_IDX = 0xFFFFFFFFu };
 };
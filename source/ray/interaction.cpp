@@ -13,7 +13,7 @@
 Interaction::Interaction(const Intersection &isect, const Ray &ray, double external_ior) :
     t(isect.t), ray(ray), out(-ray.direction), n1(ray.medium_ior),
     material(isect.surface->material), surface(isect.surface),
-    position(ray(t)), normal(isect.surface->normal(position))
+    position(ray(t)), normal(isect.surface->normal(isect, position))
 {
     waveLength = sampleWavelength();
     double cos_theta = glm::dot(ray.direction, normal);
@@ -24,7 +24,7 @@ Interaction::Interaction(const Intersection &isect, const Ray &ray, double exter
     glm::dvec3 shading_normal = normal;
     if (isect.interpolate)
     {
-        shading_normal = isect.surface->interpolatedNormal(isect.uv);
+        shading_normal = isect.surface->interpolatedNormal(isect);
         if (cos_theta < 0.0 != glm::dot(ray.direction, shading_normal) < 0.0)
         {
             shading_normal = normal;
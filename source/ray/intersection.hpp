@@ -16,6 +16,9 @@ struct Intersection
     glm::dvec2 uv;
     bool interpolate = false;
 
+    // Intersected object-space surface of the mesh if surface is an instance
+    const Surface::Base *instanced = nullptr;
+
     explicit operator bool() const
     {
         return surface.operator bool();
@@ -6,6 +6,8 @@
 #include "../common/util.hpp"
 #include "../common/constants.hpp"
 #include "../common/format.hpp"
+#include "../common/parallel.hpp"
+#include "../common/binary-file.hpp"
 #include "../material/material.hpp"
 #include "../surface/surface.hpp"
 #include "../bvh/bvh.hpp"
@@ -21,6 +23,26 @@ Scene::Scene(const nlohmann::json& j)
     auto vertices = getOptional(j, "vertices", std::unordered_map<std::string, std::vector<glm::dvec3>>());
     ior = getOptional(j, "ior", 1.0);
 
+    struct Mesh
+    {
+        std::shared_ptr<const BVH> bvh;
+        BoundingBox BB;
+        uint64_t hash = BinaryFile::hash_seed;
+    };
+    std::unordered_map<std::string, Mesh> meshes;
+
+    // Copy of the material without emittance, for surfaces that can't be sampled as lights
+    auto nonEmissive = [](const std::shared_ptr<Material> &material)
+    {
+        if (glm::compMax(material->emittance) <= C::EPSILON)
+        {
+            return material;
+        }
+        auto mat = std::make_shared<Material>(*material);
+        mat->emittance = glm::dvec3(0.0);
+        return mat;
+    };
+
     for (const auto& s : j.at("surfaces"))
     {
         std::string material_str = "default";
@@ -30,6 +52,8 @@ Scene::Scene(const nlohmann::json& j)
         }
         auto& material = materials.at(material_str);
 
+        size_t first_surface = surfaces.size();
+
         std::unique_ptr<Transform> transform;
         if (s.find("position") != s.end() || s.find("scale") != s.end() || s.find("rotation") != s.end())
         {
@@ -44,25 +68,8 @@ Scene::Scene(const nlohmann::json& j)
         if (type == "object")
         {
             std::vector<glm::dvec3> v, n;
-            std::vector<std::vector<size_t>> triangles_v, triangles_vt, triangles_vn;
-            if (s.find("file") != s.end())
-            {
-                auto obj_path = path / s.at("file").get<std::string>();
-                parseOBJ(obj_path, v, n, triangles_v, triangles_vt, triangles_vn);
-            }
-            else
-            {
-                v = vertices.at(s.at("vertex_set"));
-                triangles_v = s.at("triangles").get<std::vector<std::vector<size_t>>>();
-            }
-
-            bool smooth = getOptional(s, "smooth", false);
-
-            if (smooth && n.empty())
-            {
-                generateVertexNormals(n, v, triangles_v);
-                triangles_vn = triangles_v;
-            }
+            std::vector<std::vector<size_t>> triangles_v, triangles_vn;
+            bool smooth = loadMesh(s, vertices, v, n, triangles_v, triangles_vn);
 
             bool is_emissive = glm::compMax(material->emittance) > C::EPSILON;
             double total_area = 0.0;
@@ -109,6 +116,52 @@ Scene::Scene(const nlohmann::json& j)
                 if (transform) surfaces.back()->transform(*transform);
             }
         }
+        else if (type == "instance")
+        {
+            // Instances of the same mesh data share the object-space mesh and its BVH
+            std::string mesh_key = nlohmann::json::array({
+                getOptional<std::string>(s, "file", ""),
+                getOptional<std::string>(s, "vertex_set", ""),
+                getOptional(s, "triangles", nlohmann::json()),
+                getOptional(s, "smooth", false)
+            }).dump();
+
+            auto &mesh = meshes[mesh_key];
+            if (!mesh.bvh)
+            {
+                std::vector<glm::dvec3> v, n;
+                std::vector<std::vector<size_t>> triangles_v, triangles_vn;
+                bool smooth = loadMesh(s, vertices, v, n, triangles_v, triangles_vn);
+
+                std::vector<std::shared_ptr<Surface::Base>> triangles;
+                for (size_t i = 0; i < triangles_v.size(); i++)
+                {
+                    const auto &t = triangles_v[i];
+                    if (smooth)
+                    {
+                        const auto &tn = triangles_vn[i];
+                        triangles.push_back(std::make_shared<Surface::Triangle>(
+                            v.at(t.at(0)), v.at(t.at(1)), v.at(t.at(2)),
+                            n.at(tn.at(0)), n.at(tn.at(1)), n.at(tn.at(2)), nullptr)
+                        );
+                    }
+                    else
+                    {
+                        triangles.push_back(std::make_shared<Surface::Triangle>(v.at(t.at(0)), v.at(t.at(1)), v.at(t.at(2)), nullptr));
+                    }
+                    mesh.BB.merge(triangles.back()->BB());
+                    mesh.hash = triangles.back()->hash(mesh.hash);
+                }
+
+                if (triangles.empty()) continue;
+
+                std::cout << "\nBuilding BVH for instanced mesh with " << Format::largeNumber(triangles.size()) << " triangles.\n";
+                mesh.bvh = std::make_shared<BVH>(mesh.BB, triangles, BVH::nestedSettings(getOptional(j, "bvh", nlohmann::json::object())));
+            }
+
+            surfaces.push_back(std::make_shared<Surface::Instance>(mesh.bvh, mesh.BB, mesh.hash, nonEmissive(material)));
+            if (transform) surfaces.back()->transform(*transform);
+        }
         else
         {
             if (type == "triangle")
@@ -124,25 +177,43 @@ Scene::Scene(const nlohmann::json& j)
             {
                 // Emittance is not supported for general quadrics 
                 // (no parameterization -> no uniform surface sampling or surface area integral)
-                std::shared_ptr<Material> mat = material;
-                if (glm::compMax(material->emittance) > C::EPSILON)
-                {
-                    mat = std::make_shared<Material>(*material);
-                    mat->emittance = glm::dvec3(0.0);
-                }
-                surfaces.push_back(std::make_shared<Surface::Quadric>(s, mat));
+                surfaces.push_back(std::make_shared<Surface::Quadric>(s, nonEmissive(material)));
             }
             if (transform && !surfaces.empty()) surfaces.back()->transform(*transform);
         }
+
+        // Spheres are not transformed using the matrices, so only meshes can be animated
+        if (s.find("frames") != s.end() && (type == "object" || type == "instance"))
+        {
+            Animation animation{ first_surface, surfaces.size() };
+            for (const auto &f : s.at("frames"))
+            {
+                animation.frames.push_back(Transform(
+                    getOptional(f, "position", glm::dvec3(0.0)),
+                    getOptional(f, "scale", glm::dvec3(1.0)),
+                    glm::radians(getOptional(f, "rotation", glm::dvec3(0.0)))
+                ).matrix);
+            }
+            if (!animation.frames.empty())
+            {
+                num_frames = std::max(num_frames, animation.frames.size());
+                animations.push_back(animation);
+            }
+        }
     }
 
+    moveAnimated(0);
     computeBoundingBox();
 
     std::cout << "\nNumber of primitives: " << Format::largeNumber(surfaces.size()) << std::endl;
+    if (!animations.empty())
+    {
+        std::cout << "Number of animation frames: " << num_frames << std::endl;
+    }
 
     if (j.find("bvh") != j.end())
     {
-        bvh = std::make_shared<BVH>(BB_, surfaces, j.at("bvh"));
+        bvh = std::make_shared<BVH>(BB_, surfaces, j.at("bvh"), !animations.empty());
     }
 
     generateEmissives();
@@ -175,6 +246,41 @@ Intersection Scene::intersect(const Ray& ray) const
     return intersection;
 }
 
+void Scene::intersect(const Ray *rays, Intersection *intersections, size_t num_rays) const
+{
+    if (bvh)
+    {
+        for (size_t i = 0; i < num_rays; i += BVH::max_packet_size)
+        {
+            bvh->intersect(rays + i, intersections + i, std::min(num_rays - i, BVH::max_packet_size));
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < num_rays; i++)
+    {
+        intersections[i] = intersect(rays[i]);
+    }
+}
+
+bool Scene::occluded(const Ray& ray, double t_max, const std::shared_ptr<Surface::Base> &ignore_surface) const
+{
+    if (bvh)
+    {
+        return bvh->occluded(ray, t_max, ignore_surface);
+    }
+
+    for (const auto& s : surfaces)
+    {
+        Intersection t_intersection;
+        if (s != ignore_surface && s->intersect(ray, t_intersection) && t_intersection.t < t_max)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 void Scene::generateEmissives()
 {
     for (const auto& surface : surfaces)
@@ -208,6 +314,41 @@ void Scene::generateEmissives()
     }
 }
 
+void Scene::setFrame(size_t frame)
+{
+    if (animations.empty()) return;
+
+    moveAnimated(frame);
+
+    BB_ = BoundingBox();
+    computeBoundingBox();
+
+    if (bvh)
+    {
+        bvh->update();
+    }
+}
+
+// The surfaces are transformed by the change from the current frame transform
+void Scene::moveAnimated(size_t frame)
+{
+    for (auto &animation : animations)
+    {
+        const glm::dmat4 &M = animation.frames[std::min(frame, animation.frames.size() - 1)];
+        if (M == animation.current) continue;
+
+        Transform T(M * glm::inverse(animation.current));
+        Parallel::forChunks(animation.end - animation.begin, 4096, [&](size_t chunk, size_t begin, size_t end)
+        {
+            for (size_t i = animation.begin + begin; i < animation.begin + end; i++)
+            {
+                surfaces[i]->transform(T);
+            }
+        });
+        animation.current = M;
+    }
+}
+
 void Scene::computeBoundingBox()
 {
     for (const auto& surface : surfaces)
@@ -235,6 +376,41 @@ std::shared_ptr<Surface::Base> Scene::selectLight(double u, double& select_proba
     return emissives[emissive_idx];
 }
 
+/**************************************************************************
+Loads the vertices and triangles of an object from its OBJ file or from 
+its vertex set. Vertex normals are generated if the object is smooth and
+has none. Returns true if the object is smooth.
+**************************************************************************/
+bool Scene::loadMesh(const nlohmann::json &s,
+                     const std::unordered_map<std::string, std::vector<glm::dvec3>> &vertex_sets,
+                     std::vector<glm::dvec3> &vertices,
+                     std::vector<glm::dvec3> &normals,
+                     std::vector<std::vector<size_t>> &triangles_v,
+                     std::vector<std::vector<size_t>> &triangles_vn) const
+{
+    std::vector<std::vector<size_t>> triangles_vt;
+    if (s.find("file") != s.end())
+    {
+        auto obj_path = path / s.at("file").get<std::string>();
+        parseOBJ(obj_path, vertices, normals, triangles_v, triangles_vt, triangles_vn);
+    }
+    else
+    {
+        vertices = vertex_sets.at(s.at("vertex_set"));
+        triangles_v = s.at("triangles").get<std::vector<std::vector<size_t>>>();
+    }
+
+    bool smooth = getOptional(s, "smooth", false);
+
+    if (smooth && normals.empty())
+    {
+        generateVertexNormals(normals, vertices, triangles_v);
+        triangles_vn = triangles_v;
+    }
+
+    return smooth;
+}
+
 void Scene::parseOBJ(const std::filesystem::path &path,
                      std::vector<glm::dvec3> &vertices,
                      std::vector<glm::dvec3> &normals,
@@ -2,8 +2,10 @@
 
 #include <vector>
 #include <memory>
+#include <unordered_map>
 #include <filesystem>
 
+#include <glm/mat4x4.hpp>
 #include <nlohmann/json.hpp>
 
 #include "../ray/ray.hpp"
@@ -20,8 +22,17 @@ public:
 
     Intersection intersect(const Ray& ray) const;
 
+    // Intersects a packet of coherent rays
+    void intersect(const Ray *rays, Intersection *intersections, size_t num_rays) const;
+
+    // Returns true if any surface except ignore_surface is intersected closer than t_max
+    bool occluded(const Ray& ray, double t_max, const std::shared_ptr<Surface::Base> &ignore_surface = nullptr) const;
+
     void generateEmissives();
 
+    // Moves the animated surfaces to the frame and updates the BVH
+    void setFrame(size_t frame);
+
     glm::dvec3 skyColor(const Ray& ray) const;
 
     std::vector<std::shared_ptr<Surface::Base>> surfaces;
@@ -39,12 +50,33 @@ public:
 
     double ior;
 
+    // Number of frames of the animation, the longest frame list of the surfaces
+    size_t num_frames = 1;
+
     static std::filesystem::path path;
 
 private:
     BoundingBox BB_;
 
+    // Surfaces [begin, end) moved by the frame transforms, which are applied on top of the surface 
+    // transform. Surfaces hold their last frame if they have fewer frames than the animation.
+    struct Animation
+    {
+        size_t begin, end;
+        std::vector<glm::dmat4> frames;
+        glm::dmat4 current = glm::dmat4(1.0);
+    };
+    std::vector<Animation> animations;
+
     void computeBoundingBox();
+    void moveAnimated(size_t frame);
+
+    bool loadMesh(const nlohmann::json &s,
+                  const std::unordered_map<std::string, std::vector<glm::dvec3>> &vertex_sets,
+                  std::vector<glm::dvec3> &vertices,
+                  std::vector<glm::dvec3> &normals,
+                  std::vector<std::vector<size_t>> &triangles_v,
+                  std::vector<std::vector<size_t>> &triangles_vn) const;
 
     void parseOBJ(const std::filesystem::path &path,
                   std::vector<glm::dvec3> &vertices,
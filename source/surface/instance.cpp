@@ -0,0 +1,103 @@
+#include "surface.hpp"
+
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include "../bvh/bvh.hpp"
+#include "../common/binary-file.hpp"
+
+Surface::Instance::Instance(std::shared_ptr<const BVH> mesh, const BoundingBox &mesh_BB, uint64_t mesh_hash, std::shared_ptr<Material> material)
+    : Base(material), mesh(mesh), mesh_BB(mesh_BB), mesh_hash(mesh_hash), to_world(1.0), to_object(1.0), normal_matrix(1.0)
+{
+    computeBoundingBox();
+}
+
+/**************************************************************************
+The object-space direction is normalized, since the mesh intersection
+tests expect unit directions, so object-space distances are scaled by
+t_scale to get world-space distances.
+**************************************************************************/
+Ray Surface::Instance::objectRay(const Ray& ray, double &t_scale) const
+{
+    Ray object_ray = ray;
+    object_ray.start = to_object * glm::dvec4(ray.start, 1.0);
+    object_ray.direction = glm::dmat3(to_object) * ray.direction;
+
+    double length = glm::length(object_ray.direction);
+    object_ray.direction /= length;
+    t_scale = 1.0 / length;
+
+    return object_ray;
+}
+
+bool Surface::Instance::intersect(const Ray& ray, Intersection& intersection) const
+{
+    double t_scale;
+    Intersection object_intersection = mesh->intersect(objectRay(ray, t_scale));
+    if (!object_intersection)
+    {
+        return false;
+    }
+
+    intersection = Intersection(object_intersection.t * t_scale);
+    intersection.uv = object_intersection.uv;
+    intersection.interpolate = object_intersection.interpolate;
+    intersection.instanced = object_intersection.surface.get();
+
+    return true;
+}
+
+bool Surface::Instance::occluded(const Ray& ray, double t_max) const
+{
+    double t_scale;
+    Ray object_ray = objectRay(ray, t_scale);
+    return mesh->occluded(object_ray, t_max / t_scale, nullptr);
+}
+
+glm::dvec3 Surface::Instance::normal(const Intersection &intersection, const glm::dvec3& pos) const
+{
+    glm::dvec3 object_pos = to_object * glm::dvec4(pos, 1.0);
+    return glm::normalize(normal_matrix * intersection.instanced->normal(object_pos));
+}
+
+glm::dvec3 Surface::Instance::interpolatedNormal(const Intersection &intersection) const
+{
+    return glm::normalize(normal_matrix * intersection.instanced->interpolatedNormal(intersection.uv));
+}
+
+// The normal depends on the intersected mesh triangle, see normal(intersection, pos)
+glm::dvec3 Surface::Instance::normal(const glm::dvec3& pos) const
+{
+    return glm::dvec3();
+}
+
+// Instances are never sampled as light sources
+glm::dvec3 Surface::Instance::operator()(double u, double v) const
+{
+    return to_world * glm::dvec4(mesh_BB.centroid(), 1.0);
+}
+
+void Surface::Instance::transform(const Transform &T)
+{
+    to_world = T.matrix * to_world;
+    to_object = glm::inverse(to_world);
+    normal_matrix = glm::inverseTranspose(glm::dmat3(to_world));
+    computeBoundingBox();
+}
+
+uint64_t Surface::Instance::hash(uint64_t h) const
+{
+    h = BinaryFile::hash(&mesh_hash, sizeof(mesh_hash), h);
+    return BinaryFile::hash(&to_world, sizeof(to_world), h);
+}
+
+void Surface::Instance::computeBoundingBox()
+{
+    BB_ = BoundingBox();
+    for (int i = 0; i < 8; i++)
+    {
+        glm::dvec3 corner(i & 1 ? mesh_BB.max.x : mesh_BB.min.x,
+                          i & 2 ? mesh_BB.max.y : mesh_BB.min.y,
+                          i & 4 ? mesh_BB.max.z : mesh_BB.min.z);
+        BB_.merge(glm::dvec3(to_world * glm::dvec4(corner, 1.0)));
+    }
+}
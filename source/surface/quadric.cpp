@@ -5,6 +5,7 @@
 #include "../common/util.hpp"
 #include "../common/constexpr-math.hpp"
 #include "../common/constants.hpp"
+#include "../common/binary-file.hpp"
 
 Surface::Quadric::Quadric(const nlohmann::json &j, std::shared_ptr<Material> material)
     : Base(material)
@@ -121,6 +122,13 @@ void Surface::Quadric::transform(const Transform &T)
     computeBoundingBox();
 }
 
+// The bounding box also clips the quadric
+uint64_t Surface::Quadric::hash(uint64_t h) const
+{
+    h = BinaryFile::hash(&Q, sizeof(Q), h);
+    return BinaryFile::hash(&BB_, sizeof(BB_), h);
+}
+
 glm::dvec3 Surface::Quadric::operator()(double u, double v) const
 {
     return glm::dvec3();
@@ -2,6 +2,7 @@
 
 #include "../common/constexpr-math.hpp"
 #include "../common/constants.hpp"
+#include "../common/binary-file.hpp"
 
 Surface::Sphere::Sphere(double radius, std::shared_ptr<Material> material)
     : Base(material), origin(0.0), radius(radius)
@@ -34,6 +35,12 @@ void Surface::Sphere::transform(const Transform &T)
     computeBoundingBox();
 }
 
+uint64_t Surface::Sphere::hash(uint64_t h) const
+{
+    glm::dvec4 s(origin, radius);
+    return BinaryFile::hash(&s, sizeof(s), h);
+}
+
 glm::dvec3 Surface::Sphere::operator()(double u, double v) const
 {
     double z = 1.0 - 2.0 * u;
@@ -10,6 +10,7 @@
 #include "../common/util.hpp"
 
 class Material;
+class BVH;
 
 namespace Surface
 {
@@ -26,11 +27,33 @@ namespace Surface
         virtual glm::dvec3 normal(const glm::dvec3& pos) const = 0;
         virtual void transform(const Transform &T) = 0;
 
+        // Hash of the geometry, used to detect changes of the scene in cache files
+        virtual uint64_t hash(uint64_t h) const = 0;
+
         virtual glm::dvec3 interpolatedNormal(const glm::dvec2& uv) const 
         { 
             return glm::dvec3(); 
         }
 
+        // Normals at an intersection returned by intersect
+        virtual glm::dvec3 normal(const Intersection &intersection, const glm::dvec3& pos) const
+        {
+            return normal(pos);
+        }
+
+        virtual glm::dvec3 interpolatedNormal(const Intersection &intersection) const
+        {
+            return interpolatedNormal(intersection.uv);
+        }
+
+        // Splits the part of the surface that is contained in BB with the plane at position along axis.
+        virtual void splitBB(int axis, double position, const BoundingBox &BB, BoundingBox &left, BoundingBox &right) const
+        {
+            left = right = BB;
+            left.max[axis] = std::min(left.max[axis], position);
+            right.min[axis] = std::max(right.min[axis], position);
+        }
+
         BoundingBox BB() const
         {
             return BB_;
@@ -59,6 +82,7 @@ namespace Surface
         virtual glm::dvec3 operator()(double u, double v) const;
         virtual glm::dvec3 normal(const glm::dvec3& pos) const;
         virtual void transform(const Transform &T);
+        virtual uint64_t hash(uint64_t h) const;
 
     protected:
         virtual void computeArea();
@@ -82,8 +106,13 @@ namespace Surface
         virtual glm::dvec3 normal(const glm::dvec3& pos) const;
         virtual glm::dvec3 interpolatedNormal(const glm::dvec2& uv) const;
         virtual void transform(const Transform &T);
+        virtual uint64_t hash(uint64_t h) const;
+        virtual void splitBB(int axis, double position, const BoundingBox &BB, BoundingBox &left, BoundingBox &right) const;
 
         glm::dvec3 normal() const;
+        const glm::dvec3 &vertex0() const;
+        const glm::dvec3 &edge1() const;
+        const glm::dvec3 &edge2() const;
 
     protected:
         virtual void computeArea();
@@ -105,6 +134,7 @@ namespace Surface
         virtual glm::dvec3 operator()(double u, double v) const;
         virtual glm::dvec3 normal(const glm::dvec3& pos) const;
         virtual void transform(const Transform &T);
+        virtual uint64_t hash(uint64_t h) const;
 
     protected:
         virtual void computeArea();
@@ -114,4 +144,43 @@ namespace Surface
         glm::dmat4x4 Q; // Quadric matrix
         glm::dmat4x3 G; // Gradient matrix
     };
+
+    /*************************************************************************
+     Transformed instance of a triangle mesh. The mesh triangles are stored in
+     object space in a bottom-level BVH that is shared by all instances of the
+     mesh, and rays are transformed into object space when intersected. The 
+     intersected mesh triangle is returned in Intersection::instanced, and the 
+     normals are transformed back to world space from it.
+
+     Instances can't be emissive, so they are never sampled and have no area.
+    *************************************************************************/
+    class Instance : public Base
+    {
+    public:
+        Instance(std::shared_ptr<const BVH> mesh, const BoundingBox &mesh_BB, uint64_t mesh_hash, std::shared_ptr<Material> material);
+
+        virtual bool intersect(const Ray& ray, Intersection& intersection) const;
+        virtual glm::dvec3 operator()(double u, double v) const;
+        virtual glm::dvec3 normal(const glm::dvec3& pos) const;
+        virtual glm::dvec3 normal(const Intersection &intersection, const glm::dvec3& pos) const;
+        virtual glm::dvec3 interpolatedNormal(const Intersection &intersection) const;
+        virtual void transform(const Transform &T);
+        virtual uint64_t hash(uint64_t h) const;
+
+        bool occluded(const Ray& ray, double t_max) const;
+
+    protected:
+        virtual void computeArea() { }
+        virtual void computeBoundingBox();
+
+    private:
+        // Object-space ray, and the scale from object-space to world-space distances
+        Ray objectRay(const Ray& ray, double &t_scale) const;
+
+        std::shared_ptr<const BVH> mesh;
+        BoundingBox mesh_BB;
+        uint64_t mesh_hash; // hash of the object-space mesh triangles
+        glm::dmat4 to_world, to_object;
+        glm::dmat3 normal_matrix;
+    };
 }
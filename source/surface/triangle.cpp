@@ -3,6 +3,7 @@
 #include <glm/gtx/transform.hpp>
 
 #include "../common/constants.hpp"
+#include "../common/binary-file.hpp"
 
 Surface::Triangle::Triangle(const glm::dvec3& v0, const glm::dvec3& v1, const glm::dvec3& v2, std::shared_ptr<Material> material)
     : Base(material), v0(v0), v1(v1), v2(v2), E1(v1 - v0), E2(v2 - v0), normal_(glm::normalize(glm::cross(E1, E2))), N(nullptr)
@@ -90,6 +91,17 @@ void Surface::Triangle::transform(const Transform &T)
     computeBoundingBox();
 }
 
+uint64_t Surface::Triangle::hash(uint64_t h) const
+{
+    glm::dvec3 v[3] = { v0, E1, E2 };
+    h = BinaryFile::hash(v, sizeof(v), h);
+    if (N)
+    {
+        h = BinaryFile::hash(N.get(), sizeof(glm::dmat3), h);
+    }
+    return h;
+}
+
 glm::dvec3 Surface::Triangle::operator()(double u, double v) const
 {
     double su = std::sqrt(u);
@@ -106,12 +118,59 @@ glm::dvec3 Surface::Triangle::normal() const
     return normal_;
 }
 
+const glm::dvec3 &Surface::Triangle::vertex0() const
+{
+    return v0;
+}
+
+const glm::dvec3 &Surface::Triangle::edge1() const
+{
+    return E1;
+}
+
+const glm::dvec3 &Surface::Triangle::edge2() const
+{
+    return E2;
+}
+
 glm::dvec3 Surface::Triangle::interpolatedNormal(const glm::dvec2& uv) const
 {
     const auto &vn = *N;
     return glm::normalize((1.0 - uv.x - uv.y) * vn[0] + uv.x * vn[1] + uv.y * vn[2]);
 }
 
+/**************************************************************************
+Splits the triangle bounding box with an axis-aligned plane by clipping the 
+triangle edges against the plane. The resulting boxes are clipped to BB, 
+which is the bounds of the part of the triangle that is being split.
+**************************************************************************/
+void Surface::Triangle::splitBB(int axis, double position, const BoundingBox &BB, BoundingBox &left, BoundingBox &right) const
+{
+    left = BoundingBox();
+    right = BoundingBox();
+
+    const glm::dvec3 *v[3] = { &v0, &v1, &v2 };
+    for (int i = 0; i < 3; i++)
+    {
+        const glm::dvec3 &a = *v[i];
+        const glm::dvec3 &b = *v[(i + 1) % 3];
+
+        if (a[axis] <= position) left.merge(a);
+        if (a[axis] >= position) right.merge(a);
+
+        if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position))
+        {
+            glm::dvec3 p = glm::mix(a, b, (position - a[axis]) / (b[axis] - a[axis]));
+            p[axis] = position;
+            left.merge(p);
+            right.merge(p);
+        }
+    }
+
+    left.clip(BB);
+    right.clip(BB);
+}
+
 void Surface::Triangle::computeBoundingBox()
 {
     BB_ = BoundingBox();